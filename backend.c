@@ -1,764 +1,7040 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <ctype.h>
-
-#ifndef _WIN32
-#error "This program is Windows-only."
-#endif
-
-#include <direct.h>
-#define MKDIR(path) _mkdir(path)
-
-#define DATA_DIR "backend_data"
-#define UNDO_DIR  DATA_DIR "/undo"
-#define REDO_DIR  DATA_DIR "/redo"
-#define CURRENT_FILE DATA_DIR "/current.txt"
-#define META_FILE DATA_DIR "/meta.txt"
-
-static void ensure_dirs() {
-    struct stat st = {0};
-    if (stat(DATA_DIR, &st) == -1) {
-        MKDIR(DATA_DIR);
-    }
-    if (stat(UNDO_DIR, &st) == -1) {
-        MKDIR(UNDO_DIR);
-    }
-    if (stat(REDO_DIR, &st) == -1) {
-        MKDIR(REDO_DIR);
-    }
-}
-
-static char *read_whole_file(const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return NULL;
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char *buf = (char *) malloc(size + 1);
-    if (!buf) { fclose(f); return NULL; }
-    fread(buf, 1, size, f);
-    buf[size] = '\0';
-    fclose(f);
-    return buf;
-}
-
-static int write_whole_file(const char *path, const char *content) {
-    FILE *f = fopen(path, "wb");
-    if (!f) return 0;
-    fwrite(content, 1, strlen(content), f);
-    fclose(f);
-    return 1;
-}
-
-// meta keeps counters undo_count and redo_count
-static void read_meta(int *undo_count, int *redo_count) {
-    *undo_count = 0; *redo_count = 0;
-    FILE *f = fopen(META_FILE, "r");
-    if (!f) return;
-    fscanf(f, "%d %d", undo_count, redo_count);
-    fclose(f);
-}
-static void write_meta(int undo_count, int redo_count) {
-    FILE *f = fopen(META_FILE, "w");
-    if (!f) return;
-    fprintf(f, "%d %d", undo_count, redo_count);
-    fclose(f);
-}
-
-// stack functions
-static int push_stack(const char *dir, const char *content, int *count) {
-    (*count)++;
-    char path[512];
-    snprintf(path, sizeof(path), "%s/%d.txt", dir, *count);
-    return write_whole_file(path, content);
-}
-static char *pop_stack(const char *dir, int *count) {
-    if (*count <= 0) return NULL;
-    char path[512];
-    snprintf(path, sizeof(path), "%s/%d.txt", dir, *count);
-    char *content = read_whole_file(path);
-
-    remove(path);
-    (*count)--;
-    return content;
-}
-
-// In-memory stack for undo/redo
-typedef struct MemStack {
-    char **items;
-    int size;
-    int cap;
-} MemStack;
-
-static void memstack_init(MemStack *s) {
-    s->items = NULL;
-    s->size = 0;
-    s->cap = 0;
-}
-
-static void memstack_free(MemStack *s) {
-    if (!s) return;
-    for (int i = 0; i < s->size; ++i) free(s->items[i]);
-    free(s->items);
-    s->items = NULL; s->size = 0; s->cap = 0;
-}
-
-static int memstack_push(MemStack *s, const char *content) {
-    if (!s) return 0;
-    if (s->size + 1 > s->cap) {
-        int newcap = s->cap == 0 ? 8 : s->cap * 2;
-        char **tmp = (char **)realloc(s->items, sizeof(char*) * newcap);
-        if (!tmp) return 0;
-        s->items = tmp;
-        s->cap = newcap;
-    }
-    s->items[s->size++] = strdup(content ? content : "");
-    return 1;
-}
-
-static char *memstack_pop(MemStack *s) {
-    if (!s || s->size <= 0) return NULL;
-    char *it = s->items[--s->size];
-    s->items[s->size] = NULL;
-    return it;
-}
-
-static void memstack_clear(MemStack *s) {
-    if (!s) return;
-    for (int i = 0; i < s->size; ++i) free(s->items[i]);
-    s->size = 0;
-}
-
-static MemStack undo_stack, redo_stack;
-
-// AVL Tree 
-typedef struct AVLNode {
-    char *word;
-    int *positions;
-    int pos_count;
-    int pos_cap;
-    int height;
-    struct AVLNode *left;
-    struct AVLNode *right;
-} AVLNode;
-
-// Get height of node
-static int height(AVLNode *node) {
-    if (node == NULL) return 0;
-    return node->height;
-}
-
-// Get balance factor
-static int get_balance(AVLNode *node) {
-    if (node == NULL) return 0;
-    return height(node->left) - height(node->right);
-}
-
-// Update height of node
-static void update_height(AVLNode *node) {
-    if (node == NULL) return;
-    int left_height = height(node->left);
-    int right_height = height(node->right);
-    node->height = (left_height > right_height ? left_height : right_height) + 1;
-}
-
-// Right rotation
-static AVLNode *rotate_right(AVLNode *y) {
-    AVLNode *x = y->left;
-    AVLNode *T2 = x->right;
-    x->right = y;
-    y->left = T2;
-    update_height(y);
-    update_height(x);
-    return x;
-}
-
-// Left rotation
-static AVLNode *rotate_left(AVLNode *x) {
-    AVLNode *y = x->right;
-    AVLNode *T2 = y->left;
-    y->left = x;
-    x->right = T2;
-    update_height(x);
-    update_height(y);
-    return y;
-}
-
-// Create new node
-static AVLNode *new_node(const char *word, int position) {
-    AVLNode *node = (AVLNode *)malloc(sizeof(AVLNode));
-    node->word = strdup(word);
-    node->positions = (int *)malloc(sizeof(int) * 4);
-    node->positions[0] = position;
-    node->pos_count = 1;
-    node->pos_cap = 4;
-    node->height = 1;
-    node->left = NULL;
-    node->right = NULL;
-    return node;
-}
-
-// Insert word into AVL tree
-static AVLNode *insert(AVLNode *node, const char *word, int position) {
-    if (node == NULL)
-        return new_node(word, position);
-
-    int cmp = strcmp(word, node->word);
-    if (cmp < 0)
-        node->left = insert(node->left, word, position);
-    else if (cmp > 0)
-        node->right = insert(node->right, word, position);
-    else
-    {
-        // append position to this node
-        if (node->pos_count + 1 > node->pos_cap) {
-            int newcap = node->pos_cap * 2;
-            int *tmp = (int *)realloc(node->positions, sizeof(int) * newcap);
-            if (tmp) { node->positions = tmp; node->pos_cap = newcap; }
-        }
-        node->positions[node->pos_count++] = position;
-        return node;
-    }
-
-    update_height(node);
-    int balance = get_balance(node);
-
-    // Left Left Case
-    if (balance > 1 && strcmp(word, node->left->word) < 0)
-        return rotate_right(node);
-
-    // Right Right Case
-    if (balance < -1 && strcmp(word, node->right->word) > 0)
-        return rotate_left(node);
-
-    // Left Right Case
-    if (balance > 1 && strcmp(word, node->left->word) > 0) {
-        node->left = rotate_left(node->left);
-        return rotate_right(node);
-    }
-
-    // Right Left Case
-    if (balance < -1 && strcmp(word, node->right->word) < 0) {
-        node->right = rotate_right(node->right);
-        return rotate_left(node);
-    }
-
-    return node;
-}
-
-
-static void free_tree(AVLNode *node) {
-    if (node == NULL) return;
-    free_tree(node->left);
-    free_tree(node->right);
-    free(node->word);
-    free(node->positions);
-    free(node);
-}
-
-// Build an AVL of words from text; store start indices of each whole-word occurrence
-static AVLNode *build_avl_from_text(const char *text) {
-    if (!text) return NULL;
-    AVLNode *root = NULL;
-    size_t n = strlen(text);
-    size_t i = 0;
-    while (i < n) {
-        if (isalnum((unsigned char)text[i])) {
-            size_t j = i;
-            while (j < n && isalnum((unsigned char)text[j])) j++;
-            size_t wlen = j - i;
-            char *w = (char *)malloc(wlen + 1);
-            memcpy(w, &text[i], wlen);
-            w[wlen] = '\0';
-            root = insert(root, w, (int)i);
-            free(w);
-            i = j;
-        } else i++;
-    }
-    return root;
-}
-
-// Replace whole-word occurrences of `oldw` with `neww` in text, return newly allocated string
-static char *replace_whole_words(const char *text, const char *oldw, const char *neww) {
-    if (!text || !oldw || !neww) return strdup(text ? text : "");
-    size_t n = strlen(text);
-    size_t oldlen = strlen(oldw);
-    size_t newlen = strlen(neww);
-    // worst case size: replace every char with neww -> allocate n * (newlen+1) + 1
-    size_t bufcap = n * (newlen + 1) + 1;
-    char *out = (char *)malloc(bufcap);
-    if (!out) return strdup(text);
-    size_t oi = 0;
-    size_t i = 0;
-    while (i < n) {
-        if (isalnum((unsigned char)text[i])) {
-            size_t j = i;
-            while (j < n && isalnum((unsigned char)text[j])) j++;
-            size_t wlen = j - i;
-            if (wlen == oldlen && strncmp(&text[i], oldw, oldlen) == 0) {
-                // copy neww
-                memcpy(&out[oi], neww, newlen); oi += newlen;
-            } else {
-                memcpy(&out[oi], &text[i], wlen); oi += wlen;
-            }
-            // copy following non-word chars
-            i = j;
-            while (i < n && !isalnum((unsigned char)text[i])) {
-                out[oi++] = text[i++];
-            }
-        } else {
-            out[oi++] = text[i++];
-        }
-    }
-    out[oi] = '\0';
-    // shrink to fit
-    char *shr = (char *)realloc(out, oi + 1);
-    return shr ? shr : out;
-}
-
-// Search word in AVL tree 
-static void avl_search_and_print(const char *text, const char *pat) {
-    // Use the existing whole-word scanner but keep signature correct.
-    if (!text || !pat) { printf("Word not found!"); return; }
-    size_t n = strlen(text);
-    size_t m = strlen(pat);
-    if (m == 0) { printf("Pattern empty."); return; }
-
-    char *highlighted = (char *)malloc(n * 3 + 1);
-    if (!highlighted) { printf("Internal error"); return; }
-    size_t hi = 0;
-    size_t i = 0;
-    int found = 0;
-
-    while (i < n) {
-        if (isalnum((unsigned char)text[i])) {
-            size_t j = i;
-            while (j < n && isalnum((unsigned char)text[j])) j++;
-            size_t wlen = j - i;
-            if (wlen == m && strncmp(&text[i], pat, m) == 0) {
-                const char *pre = "[HIGHLIGHT]";
-                const char *post = "[/HIGHLIGHT]";
-                memcpy(&highlighted[hi], pre, strlen(pre)); hi += strlen(pre);
-                memcpy(&highlighted[hi], &text[i], wlen); hi += wlen;
-                memcpy(&highlighted[hi], post, strlen(post)); hi += strlen(post);
-                found = 1;
-            } else {
-                memcpy(&highlighted[hi], &text[i], wlen); hi += wlen;
-            }
-            i = j;
-            while (i < n && !isalnum((unsigned char)text[i])) {
-                highlighted[hi++] = text[i++];
-            }
-        } else {
-            highlighted[hi++] = text[i++];
-        }
-    }
-    highlighted[hi] = '\0';
-
-    if (!found) printf("Word not found!");
-    else printf("%s", highlighted);
-
-    free(highlighted);
-}
-
-
-// Doubly-linked list
-
-typedef struct CharNode {
-    char ch;
-    struct CharNode *prev;
-    struct CharNode *next;
-} CharNode;
-
-typedef struct Buffer {
-    CharNode *head;
-    CharNode *tail;
-    
-    CharNode *cursor;
-} Buffer;
-
-static Buffer *buffer_create_from_string(const char *s) {
-    Buffer *b = (Buffer *)malloc(sizeof(Buffer));
-    if (!b) return NULL;
-    b->head = b->tail = b->cursor = NULL;
-    if (!s || s[0] == '\0') {
-        b->cursor = NULL; 
-        return b;
-    }
-    const char *p = s;
-    while (*p) {
-        CharNode *n = (CharNode *)malloc(sizeof(CharNode));
-        n->ch = *p;
-        n->prev = b->tail;
-        n->next = NULL;
-        if (b->tail) b->tail->next = n;
-        else b->head = n;
-        b->tail = n;
-        p++;
-    }
-    b->cursor = NULL; 
-    return b;
-}
-
-static void buffer_free(Buffer *b) {
-    if (!b) return;
-    CharNode *it = b->head;
-    while (it) {
-        CharNode *nx = it->next;
-        free(it);
-        it = nx;
-    }
-    free(b);
-}
-
-static char *buffer_to_string(Buffer *b) {
-    if (!b) return strdup("");
-    
-    size_t n = 0;
-    for (CharNode *it = b->head; it; it = it->next) n++;
-    char *out = (char *)malloc(n + 1);
-    size_t i = 0;
-    for (CharNode *it = b->head; it; it = it->next) out[i++] = it->ch;
-    out[i] = '\0';
-    return out;
-}
-
-static char *buffer_to_string_with_cursor(Buffer *b) {
-    if (!b) return strdup("|");
-    size_t n = 0;
-    for (CharNode *it = b->head; it; it = it->next) n++;
-
-    char *out = (char *)malloc(n + 2);
-    size_t oi = 0;
-    
-    CharNode *it = b->head;
-    while (it && it != b->cursor) {
-        out[oi++] = it->ch;
-        it = it->next;
-    }
-    
-    out[oi++] = '|';
-    
-    while (it) {
-        out[oi++] = it->ch;
-        it = it->next;
-    }
-    out[oi] = '\0';
-    return out;
-}
-
-// insert a string 
-static void buffer_insert_string(Buffer *b, const char *s) {
-    if (!b || !s) return;
-    // insert each character 
-    for (const char *p = s; *p; ++p) {
-        CharNode *n = (CharNode *)malloc(sizeof(CharNode));
-        n->ch = *p;
-        if (b->cursor == NULL) {
-            
-            n->next = NULL;
-            n->prev = b->tail;
-            if (b->tail) b->tail->next = n;
-            else b->head = n;
-            b->tail = n;
-        } else {
-            // insert before cursor node
-            n->next = b->cursor;
-            n->prev = b->cursor->prev;
-            if (b->cursor->prev) b->cursor->prev->next = n;
-            else b->head = n;
-            b->cursor->prev = n;
-        }
-    }
-}
-
-
-static int buffer_delete_before_cursor(Buffer *b) {
-    if (!b) return 0;
-    CharNode *del = NULL;
-    if (b->cursor == NULL) del = b->tail;
-    else del = b->cursor->prev;
-    if (!del) return 0;
-    if (del->prev) del->prev->next = del->next;
-    else b->head = del->next;
-    if (del->next) del->next->prev = del->prev;
-    else b->tail = del->prev;
-    free(del);
-    return 1;
-}
-
-static void buffer_move_left(Buffer *b) {
-    if (!b) return;
-    if (b->cursor == b->head) {
-        
-        return;
-    }
-    if (b->cursor == NULL) {
-        
-        b->cursor = b->tail;
-    } else {
-        if (b->cursor->prev) b->cursor = b->cursor->prev;
-    }
-}
-
-static void buffer_move_right(Buffer *b) {
-    if (!b) return;
-    if (b->cursor == NULL) {
-        
-        return;
-    }
-    b->cursor = b->cursor->next;
-}
-
-
-
-static char *get_current_content() {
-    char *cur = read_whole_file(CURRENT_FILE);
-    if (!cur) {
-        // create empty current
-        write_whole_file(CURRENT_FILE, "");
-        cur = strdup("");
-    }
-    return cur;
-}
-
-int main() {
-    ensure_dirs();
-    // initialize in-memory undo/redo stacks
-    memstack_init(&undo_stack);
-    memstack_init(&redo_stack);
-    int undo_count = 0, redo_count = 0;
-    // read_meta kept for compatibility but we will prefer in-memory stacks
-    read_meta(&undo_count, &redo_count);
-    
-    size_t cap = 1024;
-    size_t len = 0;
-    char *raw = (char *)malloc(cap + 1);
-    if (!raw) return 0;
-    int ch;
-    while ((ch = fgetc(stdin)) != EOF) {
-        if (len + 1 >= cap) {
-            cap *= 2;
-            char *tmp = (char *)realloc(raw, cap + 1);
-            if (!tmp) { free(raw); return 0; }
-            raw = tmp;
-        }
-        raw[len++] = (char)ch;
-    }
-    raw[len] = '\0';
-    
-    while (len > 0 && (raw[len-1] == '\n' || raw[len-1] == '\r')) raw[--len] = '\0';
-    if (len == 0) { free(raw); return 0; }
-    
-
-    
-    char *cur_forbuf = read_whole_file(CURRENT_FILE);
-    Buffer *buf = buffer_create_from_string(cur_forbuf ? cur_forbuf : "");
-    if (cur_forbuf) free(cur_forbuf);
-    if (strcmp(raw, "undo") == 0) {
-        char *prev = memstack_pop(&undo_stack);
-        if (!prev) {
-            printf("Nothing to undo!");
-        } else {
-            char *current = get_current_content();
-            memstack_push(&redo_stack, current);
-            write_whole_file(CURRENT_FILE, prev);
-            buffer_free(buf);
-            buf = buffer_create_from_string(prev);
-            printf("%s", prev);
-            free(prev);
-        }
-        write_meta(undo_stack.size, redo_stack.size);
-    }
-    else if (strncmp(raw, "search:", 7) == 0) {
-        const char *pattern = raw + 7;
-        char *current = get_current_content();
-        avl_search_and_print(current, pattern);
-        free(current);
-        
-    }
-    else if (strncmp(raw, "insert:", 7) == 0) {
-        const char *s = raw + 7;
-        // push previous content to undo and clear redo
-        char *prev = buffer_to_string(buf);
-        memstack_push(&undo_stack, prev);
-        free(prev);
-        memstack_clear(&redo_stack);
-        // insert at cursor
-        buffer_insert_string(buf, s);
-        char *out = buffer_to_string(buf);
-        // update CURRENT_FILE
-        write_whole_file(CURRENT_FILE, out);
-    // buffer already updated by insert operations; keep cursor semantics
-        printf("%s", out);
-        free(out);
-        write_meta(undo_stack.size, redo_stack.size);
-    }
-    else if (strcmp(raw, "delete") == 0) {
-        // push previous content
-        char *prev = buffer_to_string(buf);
-        memstack_push(&undo_stack, prev);
-        free(prev);
-        memstack_clear(&redo_stack);
-
-        int ok = buffer_delete_before_cursor(buf);
-        char *out = buffer_to_string(buf);
-        write_whole_file(CURRENT_FILE, out);
-        if (ok) printf("%s", out);
-        else printf("Nothing to delete");
-        free(out);
-        write_meta(undo_stack.size, redo_stack.size);
-    }
-    else if (strcmp(raw, "cursor:left") == 0) {
-        buffer_move_left(buf);
-        char *out = buffer_to_string_with_cursor(buf);
-        printf("%s", out);
-        free(out);
-    }
-    else if (strcmp(raw, "cursor:right") == 0) {
-        buffer_move_right(buf);
-        char *out = buffer_to_string_with_cursor(buf);
-        printf("%s", out);
-        free(out);
-    }
-    else if (strcmp(raw, "showcursor") == 0) {
-        char *out = buffer_to_string_with_cursor(buf);
-        printf("%s", out);
-        free(out);
-    }
-    else if (strcmp(raw, "new") == 0) {
-        char *current = get_current_content();
-        memstack_push(&undo_stack, current);
-        free(current);
-        memstack_clear(&redo_stack);
-        write_whole_file(CURRENT_FILE, "");
-        buffer_free(buf);
-        buf = buffer_create_from_string("");
-        printf("");
-        write_meta(undo_stack.size, redo_stack.size);
-    }
-    
-    else if (strncmp(raw, "save:", 5) == 0) {
-        
-        const char *p = raw + 5;
-        const char *sep = strstr(p, "::");
-        char filename[512];
-        const char *content;
-        if (sep) {
-            size_t fnlen = sep - p;
-            if (fnlen >= sizeof(filename)) fnlen = sizeof(filename)-1;
-            strncpy(filename, p, fnlen);
-            filename[fnlen] = '\0';
-            content = sep + 2;
-        } else {
-        
-            strcpy(filename, "document.txt");
-            content = NULL;
-        }
-
-    char *current = get_current_content();
-    memstack_push(&undo_stack, current);
-    memstack_clear(&redo_stack);
-
-        char *new_content;
-        if (content) new_content = strdup(content);
-        else new_content = strdup(current);
-        free(current);
-
-        
-        write_whole_file(CURRENT_FILE, new_content);
-        buffer_free(buf);
-        buf = buffer_create_from_string(new_content);
-
-        if (!write_whole_file(filename, new_content)) {
-            printf("Failed to save to %s", filename);
-        } else {
-            printf("Saved to %s.", filename);
-        }
-        free(new_content);
-        write_meta(undo_stack.size, redo_stack.size);
-    }
-
-    else if (strncmp(raw, "replace:", 8) == 0) {
-        // format: replace:old::new
-        const char *p = raw + 8;
-        const char *sep = strstr(p, "::");
-        if (!sep) {
-            printf("Invalid replace format. Use replace:old::new");
-        } else {
-            size_t oldlen = sep - p;
-            char oldw[512];
-            if (oldlen >= sizeof(oldw)) oldlen = sizeof(oldw)-1;
-            strncpy(oldw, p, oldlen); oldw[oldlen] = '\0';
-            const char *neww = sep + 2;
-
-            char *current = get_current_content();
-            // Build AVL (not strictly required for replacement mechanics here but per requirement)
-            AVLNode *root = build_avl_from_text(current);
-            // If word not present, print and cleanup
-            // We can search by scanning the AVL (simple search function)
-            // quick search by traversing tree
-            int found = 0;
-            AVLNode *it = root;
-            while (it) {
-                int c = strcmp(oldw, it->word);
-                if (c == 0) { found = 1; break; }
-                it = c < 0 ? it->left : it->right;
-            }
-            if (!found) {
-                printf("Word not found!");
-                free_tree(root);
-                free(current);
-            } else {
-                // push previous state to undo and clear redo
-                memstack_push(&undo_stack, current);
-                memstack_clear(&redo_stack);
-
-                char *newtxt = replace_whole_words(current, oldw, neww);
-                write_whole_file(CURRENT_FILE, newtxt);
-                buffer_free(buf);
-                buf = buffer_create_from_string(newtxt);
-                printf("%s", newtxt);
-
-                free(newtxt);
-                free_tree(root);
-                free(current);
-                write_meta(undo_stack.size, redo_stack.size);
-            }
-        }
-    }
-
-    else if (strcmp(raw, "redo") == 0) {
-        char *next = memstack_pop(&redo_stack);
-        if (!next) {
-            printf("Nothing to redo!");
-        } else {
-            char *current = get_current_content();
-            memstack_push(&undo_stack, current);
-            write_whole_file(CURRENT_FILE, next);
-            buffer_free(buf);
-            buf = buffer_create_from_string(next);
-            printf("%s", next);
-            free(next);
-        }
-        write_meta(undo_stack.size, redo_stack.size);
-    }
-    
-    else if (strcmp(raw, "show") == 0) {
-        char *current = get_current_content();
-        printf("%s", current);
-        free(current);
-    }
-    else {
-        printf("Invalid command.");
-    }
-
-    
-    buffer_free(buf);
-    memstack_free(&undo_stack);
-    memstack_free(&redo_stack);
-    free(raw);
-    return 0;
-}
\ No newline at end of file
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // O_DIRECT
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <winsock2.h>
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#define MKDIR(path) _mkdir(path)
+#define RMDIR(path) _rmdir(path)
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+// POSIX: the handful of Win32 calls the backend uses, on pthreads and libc
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#define MKDIR(path) mkdir(path, 0777)
+#define RMDIR(path) rmdir(path)
+#ifdef __APPLE__
+#define fdatasync(fd) fsync(fd)
+#endif
+
+typedef unsigned long DWORD;
+typedef long LONG;
+typedef void *LPVOID;
+#define WINAPI
+#define INFINITE 0xFFFFFFFFu
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define InitializeCriticalSection(cs) pthread_mutex_init(cs, NULL)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+
+typedef pthread_cond_t CONDITION_VARIABLE;
+#define WakeConditionVariable(cv) pthread_cond_signal(cv)
+#define WakeAllConditionVariable(cv) pthread_cond_broadcast(cv)
+
+static void InitializeConditionVariable(CONDITION_VARIABLE *cv) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cv, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static int SleepConditionVariableCS(CONDITION_VARIABLE *cv, CRITICAL_SECTION *cs, DWORD ms) {
+    if (ms == INFINITE) return pthread_cond_wait(cv, cs) == 0;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (t.tv_nsec >= 1000000000) { t.tv_sec++; t.tv_nsec -= 1000000000; }
+    return pthread_cond_timedwait(cv, cs, &t) == 0;
+}
+
+static DWORD GetTickCount() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (DWORD)(t.tv_sec * 1000 + t.tv_nsec / 1000000);
+}
+
+#define SwitchToThread() sched_yield()
+#define InterlockedExchange(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement(p) __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+
+typedef struct {
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+static void GetSystemInfo(SYSTEM_INFO *si) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    si->dwNumberOfProcessors = n > 0 ? (DWORD)n : 1;
+}
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket(s) close(s)
+typedef struct { int unused; } WSADATA;
+#define MAKEWORD(lo, hi) ((lo) | ((hi) << 8))
+#define WSAStartup(version, data) ((void)(version), (void)(data), 0)
+#endif
+
+// Files and threads, under names of our own: the CRT spells these with
+// reserved leading underscores, which POSIX code must not define.
+typedef DWORD (WINAPI *ThreadFn)(LPVOID arg);
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+
+static int file_fd(FILE *f) { return _fileno(f); }
+static int file_sync(int fd) { return _commit(fd); }
+static int fd_read(int fd, char *dst, int n) { return _read(fd, dst, (unsigned)n); }
+static int fd_dup(int fd) { return _dup(fd); }
+static int fd_close(int fd) { return _close(fd); }
+static void stream_binary(FILE *f) { _setmode(_fileno(f), _O_BINARY); }
+
+static Thread thread_start(ThreadFn fn, LPVOID arg) {
+    return CreateThread(NULL, 0, fn, arg, 0, NULL);
+}
+
+static void thread_join(Thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static void thread_detach(Thread t) {
+    CloseHandle(t);
+}
+#else
+typedef struct PosixThread {
+    pthread_t id;
+} PosixThread;
+typedef PosixThread *Thread;
+
+static int file_fd(FILE *f) { return fileno(f); }
+static int file_sync(int fd) { return fsync(fd); }
+static int fd_read(int fd, char *dst, int n) { return (int)read(fd, dst, (size_t)n); }
+static int fd_dup(int fd) { return dup(fd); }
+static int fd_close(int fd) { return close(fd); }
+static void stream_binary(FILE *f) { (void)f; }
+
+// what the new thread runs; it frees this itself
+typedef struct PosixStart {
+    ThreadFn fn;
+    LPVOID arg;
+} PosixStart;
+
+static void *posix_thread_main(void *p) {
+    PosixStart st = *(PosixStart *)p;
+    free(p);
+    st.fn(st.arg);
+    return NULL;
+}
+
+static Thread thread_start(ThreadFn fn, LPVOID arg) {
+    PosixThread *t = (PosixThread *)malloc(sizeof(PosixThread));
+    PosixStart *st = (PosixStart *)malloc(sizeof(PosixStart));
+    if (!t || !st) { free(t); free(st); return NULL; }
+    st->fn = fn;
+    st->arg = arg;
+    if (pthread_create(&t->id, NULL, posix_thread_main, st) != 0) { free(t); free(st); return NULL; }
+    return t;
+}
+
+static void thread_join(Thread t) {
+    pthread_join(t->id, NULL);
+    free(t);
+}
+
+static void thread_detach(Thread t) {
+    pthread_detach(t->id);
+    free(t);
+}
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Instrumentation, compiled in with -DWITH_STATS (make STATS=1): counters
+// for allocations, bytes copied out of the text and index work, and scoped
+// timers around the hot paths. `stats` replies with them as JSON, and
+// --trace=FILE also logs every timed scope as a Chrome trace event (load
+// the file in chrome://tracing or Perfetto). Without the switch it all
+// compiles away and `stats` replies {"enabled":false}.
+enum {
+    STAT_ALLOCS,            // malloc, calloc and realloc calls
+    STAT_ALLOC_BYTES,
+    STAT_FREES,
+    STAT_TEXT_COPIED,       // bytes copied out of the document
+    STAT_REPLY_BYTES,       // bytes sent to clients
+    STAT_JOURNAL_BYTES,
+    STAT_INDEX_BYTES,       // text (re)tokenized
+    STAT_INDEX_TOKENS,
+    STAT_INDEX_WORDS,       // distinct words added (hash and tree nodes)
+    STAT_COUNT
+};
+
+enum {
+    TIMER_COMMAND,          // one text command
+    TIMER_REQUEST,          // one binary request
+    TIMER_LOAD,
+    TIMER_SAVE,
+    TIMER_JOURNAL_SYNC,
+    TIMER_SNAPSHOT,         // serializing a snapshot
+    TIMER_SNAPSHOT_WRITE,
+    TIMER_INDEX_REFRESH,
+    TIMER_INDEX_QUERY,
+    TIMER_REPLACE,
+    TIMER_FIND,
+    TIMER_REGEX,
+    TIMER_FREEZE,
+    TIMER_REPLY_WRITE,
+    TIMER_COUNT
+};
+
+#ifdef WITH_STATS
+static const char *const stat_names[STAT_COUNT] = {
+    "allocs", "alloc_bytes", "frees", "text_copied", "reply_bytes",
+    "journal_bytes", "index_bytes", "index_tokens", "index_words"
+};
+
+static const char *const timer_names[TIMER_COUNT] = {
+    "command", "request", "load", "save", "journal_sync", "snapshot",
+    "snapshot_write", "index_refresh", "index_query", "replace", "find",
+    "regex", "freeze", "reply_write"
+};
+
+typedef struct TimerTotals {
+    volatile unsigned long long count, total_ns, max_ns;
+} TimerTotals;
+
+static volatile unsigned long long stat_counters[STAT_COUNT];
+static TimerTotals timer_totals[TIMER_COUNT];
+
+#ifdef _MSC_VER
+#define ATOMIC_ADD(p, v) InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+#define ATOMIC_CAS(p, old, v) (unsigned long long)InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(v), (LONG64)(old))
+#define ATOMIC_LOAD(p) ATOMIC_CAS(p, 0, 0)
+#else
+#define ATOMIC_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_CAS(p, old, v) __sync_val_compare_and_swap(p, old, v)
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#endif
+
+static void stat_add(int id, unsigned long long v) {
+    ATOMIC_ADD(&stat_counters[id], v);
+}
+
+static unsigned long long stats_now() {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (unsigned long long)((double)t.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000000ull + (unsigned long long)t.tv_nsec;
+#endif
+}
+
+// Chrome trace event log: a JSON array of complete ("X") events
+static FILE *trace_file;
+static CRITICAL_SECTION trace_lock;
+static unsigned long long trace_epoch;
+static int trace_events;
+static volatile LONG trace_threads;
+static THREAD_LOCAL int trace_tid;
+
+static int trace_open(const char *path) {
+    trace_file = fopen(path, "wb");
+    if (!trace_file) return 0;
+    InitializeCriticalSection(&trace_lock);
+    trace_epoch = stats_now();
+    fputs("[\n", trace_file);
+    return 1;
+}
+
+static void trace_close() {
+    if (!trace_file) return;
+    fputs("\n]\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+typedef struct StatTimer {
+    int id;
+    unsigned long long start;
+} StatTimer;
+
+static StatTimer stats_start(int id) {
+    StatTimer t = { id, stats_now() };
+    return t;
+}
+
+// detail, if any, goes into the trace event's args: for a command, its
+// name (what comes before the first character that is not a letter)
+static void stats_stop(StatTimer *t, const char *detail) {
+    unsigned long long end = stats_now(), ns = end - t->start;
+    TimerTotals *tt = &timer_totals[t->id];
+    ATOMIC_ADD(&tt->count, 1);
+    ATOMIC_ADD(&tt->total_ns, ns);
+    for (unsigned long long cur = ATOMIC_LOAD(&tt->max_ns); ns > cur; ) {
+        unsigned long long seen = ATOMIC_CAS(&tt->max_ns, cur, ns);
+        if (seen == cur) break;
+        cur = seen;
+    }
+    if (!trace_file) return;
+    if (!trace_tid) trace_tid = (int)InterlockedIncrement(&trace_threads);
+    EnterCriticalSection(&trace_lock);
+    if (trace_file) {
+        fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                trace_events++ ? ",\n" : "", timer_names[t->id], trace_tid,
+                (double)(t->start - trace_epoch) / 1000.0, (double)ns / 1000.0);
+        int n = 0;
+        while (detail && n < 32 && isalpha((unsigned char)detail[n])) n++;
+        if (n) fprintf(trace_file, ",\"args\":{\"detail\":\"%.*s\"}", n, detail);
+        fputs("}", trace_file);
+    }
+    LeaveCriticalSection(&trace_lock);
+}
+
+static void *stats_malloc(size_t n) {
+    stat_add(STAT_ALLOCS, 1);
+    stat_add(STAT_ALLOC_BYTES, n);
+    return malloc(n);
+}
+
+static void *stats_calloc(size_t n, size_t size) {
+    stat_add(STAT_ALLOCS, 1);
+    stat_add(STAT_ALLOC_BYTES, n * size);
+    return calloc(n, size);
+}
+
+static void *stats_realloc(void *p, size_t n) {
+    stat_add(STAT_ALLOCS, 1);
+    stat_add(STAT_ALLOC_BYTES, n);
+    return realloc(p, n);
+}
+
+static void stats_free(void *p) {
+    if (p) stat_add(STAT_FREES, 1);
+    free(p);
+}
+
+// every allocation below goes through the counting wrappers
+#define malloc(n) stats_malloc(n)
+#define calloc(n, size) stats_calloc(n, size)
+#define realloc(p, n) stats_realloc(p, n)
+#define free(p) stats_free(p)
+#else
+typedef int StatTimer;
+#define stat_add(id, v) ((void)(v))
+#define stats_start(id) 0
+#define stats_stop(t, detail) ((void)(t))
+#endif
+
+#define DATA_DIR "backend_data"
+#define CURRENT_FILE DATA_DIR "/current.txt"    // legacy plain-text document
+#define DOCS_DIR DATA_DIR "/docs"               // one directory per further document
+#define DOC_ID_MAX 64
+// a document's directory is DATA_DIR or DOCS_DIR/<id>; paths of the files
+// in it have room for the longest name (snapshot.cur.tmp, journal.<gen>)
+#define DOC_DIR_MAX (sizeof(DOCS_DIR) + 1 + DOC_ID_MAX)
+#define DOC_PATH_MAX (DOC_DIR_MAX + 32)
+
+static void ensure_dirs() {
+    struct stat st = {0};
+    if (stat(DATA_DIR, &st) == -1) {
+        MKDIR(DATA_DIR);
+    }
+}
+
+// returns a malloc'd NUL-terminated copy of the file; *out_size gets its length
+static char *read_whole_file(const char *path, size_t *out_size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = (char *) malloc(size + 1);
+    if (!buf) { fclose(f); return NULL; }
+    size_t got = fread(buf, 1, size, f);
+    buf[got] = '\0';
+    fclose(f);
+    if (out_size) *out_size = got;
+    return buf;
+}
+
+// Read-only file mappings. Documents are mapped instead of being read into
+// the heap; the piece table uses the mapped bytes as its original text, so
+// only the pages that are actually touched become resident.
+typedef struct FileMap {
+    const char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} FileMap;
+
+// returns NULL if the file is missing, empty or cannot be mapped
+#ifdef _WIN32
+static FileMap *map_file(const char *path) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0) { CloseHandle(file); return NULL; }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) { CloseHandle(file); return NULL; }
+    const char *data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    FileMap *m = data ? (FileMap *)malloc(sizeof(FileMap)) : NULL;
+    if (!m) {
+        if (data) UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return NULL;
+    }
+    m->data = data;
+    m->size = (size_t)size.QuadPart;
+    m->file = file;
+    m->mapping = mapping;
+    return m;
+}
+
+static void unmap_file(FileMap *m) {
+    if (!m) return;
+    UnmapViewOfFile(m->data);
+    CloseHandle(m->mapping);
+    CloseHandle(m->file);
+    free(m);
+}
+#else
+static FileMap *map_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return NULL; }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // the mapping keeps the file
+    FileMap *m = data != MAP_FAILED ? (FileMap *)malloc(sizeof(FileMap)) : NULL;
+    if (!m) {
+        if (data != MAP_FAILED) munmap(data, (size_t)st.st_size);
+        return NULL;
+    }
+    m->data = (const char *)data;
+    m->size = (size_t)st.st_size;
+    return m;
+}
+
+static void unmap_file(FileMap *m) {
+    if (!m) return;
+    munmap((void *)m->data, m->size);
+    free(m);
+}
+#endif
+
+// Reply buffer: commands write their output here and the caller ships it
+// either straight to stdout (one-shot mode) or as one frame (serve mode).
+// Every thread answering requests has its own.
+typedef struct OutBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+} OutBuf;
+
+static THREAD_LOCAL OutBuf reply;
+
+// make room for n more bytes plus a terminator
+static int out_reserve(OutBuf *o, size_t n) {
+    if (o->len + n + 1 > o->cap) {
+        size_t newcap = o->cap == 0 ? 1024 : o->cap;
+        while (o->len + n + 1 > newcap) newcap *= 2;
+        char *tmp = (char *)realloc(o->data, newcap);
+        if (!tmp) return 0;
+        o->data = tmp;
+        o->cap = newcap;
+    }
+    return 1;
+}
+
+static void out_write(OutBuf *o, const char *s, size_t n) {
+    if (!out_reserve(o, n)) return;
+    if (n) memcpy(o->data + o->len, s, n);
+    o->len += n;
+    o->data[o->len] = '\0';
+}
+
+static void out_puts(OutBuf *o, const char *s) {
+    out_write(o, s, strlen(s));
+}
+
+static void out_printf(OutBuf *o, const char *fmt, ...) {
+    char small[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(small)) { out_write(o, small, (size_t)n); return; }
+    char *big = (char *)malloc((size_t)n + 1);
+    if (!big) return;
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    out_write(o, big, (size_t)n);
+    free(big);
+}
+
+static void out_reset(OutBuf *o) {
+    o->len = 0;
+    if (o->data) o->data[0] = '\0';
+}
+
+static void out_free(OutBuf *o) {
+    free(o->data);
+    o->data = NULL; o->len = 0; o->cap = 0;
+}
+
+// Journal records
+
+// Every change is appended to backend_data/journal.<gen> as a checksummed
+// record before the command replies:
+//   type (1 byte) | payload length (u32) | crc32 of payload (u32) | payload
+// Integers are little-endian. Recovery maps the live snapshot and replays the
+// journal generations that follow it. All of these files live in the
+// directory of the document they belong to.
+#define SNAPSHOT_CURRENT "snapshot.cur"     // generation of the live snapshot
+#define SNAPSHOT_TMP "snapshot.tmp"
+#define SNAPSHOT_MAGIC "MWPSNAP2"
+#define SNAPSHOT_PACKED_MAGIC "MWPSNAP4"    // history and text in checksummed compressed blocks
+#define SNAPSHOT_PACKED3_MAGIC "MWPSNAP3"   // the same without block checksums
+#define JOURNAL_COMPACT_BYTES (4 * 1024 * 1024)
+
+enum {
+    REC_BEGIN = 'B',    // new undo unit: kind, cursor
+    REC_EDIT = 'E',     // pos, rlen, ilen, removed bytes, inserted bytes
+    REC_OPS = 'O',      // a batch of edits applied left to right (replace)
+    REC_UNDO = 'U',
+    REC_REDO = 'R',
+    REC_CURSOR = 'C'    // count, primary cursor, carets
+};
+
+static char doc_dir[DOC_DIR_MAX] = DATA_DIR;   // storage of the active document
+static FILE *journal;
+static unsigned long journal_gen;
+static size_t journal_bytes;
+static int journal_pending;     // records written since the last sync
+static int journal_failed;      // a write or sync failed: no more records
+static int journal_replaying;   // set while recovery re-applies records
+static int cursor_dirty;        // cursors may differ from the last journaled ones
+static DWORD unsynced_since;    // GetTickCount() of the oldest unsynced record
+
+static unsigned int crc32_bytes(const char *s, size_t n) {
+    static unsigned int table[256];
+    static int ready = 0;
+    if (!ready) {
+        for (unsigned int i = 0; i < 256; ++i) {
+            unsigned int c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        ready = 1;
+    }
+    unsigned int crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; ++i) crc = table[(crc ^ (unsigned char)s[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void put_u8(OutBuf *o, unsigned int v) {
+    char c = (char)v;
+    out_write(o, &c, 1);
+}
+
+static void put_u32(OutBuf *o, unsigned long v) {
+    char b[4];
+    for (int i = 0; i < 4; ++i) b[i] = (char)((v >> (8 * i)) & 0xFF);
+    out_write(o, b, 4);
+}
+
+static void put_u64(OutBuf *o, unsigned long long v) {
+    char b[8];
+    for (int i = 0; i < 8; ++i) b[i] = (char)((v >> (8 * i)) & 0xFF);
+    out_write(o, b, 8);
+}
+
+// Reader over a byte range; any short read sets ok = 0 and returns zeros.
+typedef struct ByteReader {
+    const char *p;
+    const char *end;
+    int ok;
+} ByteReader;
+
+static unsigned long long get_uint(ByteReader *r, int width) {
+    if (!r->ok || r->end - r->p < width) { r->ok = 0; return 0; }
+    unsigned long long v = 0;
+    for (int i = 0; i < width; ++i) v |= (unsigned long long)(unsigned char)r->p[i] << (8 * i);
+    r->p += width;
+    return v;
+}
+
+static const char *get_bytes(ByteReader *r, size_t n) {
+    if (!r->ok || (size_t)(r->end - r->p) < n) { r->ok = 0; return NULL; }
+    const char *s = r->p;
+    r->p += n;
+    return s;
+}
+
+static void doc_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/%s", doc_dir, name);
+}
+
+static void journal_path(char *path, size_t size, unsigned long gen) {
+    snprintf(path, size, "%s/journal.%lu", doc_dir, gen);
+}
+
+// Snapshots get a fresh name per generation because a file that is mapped
+// cannot be replaced on Windows; snapshot.cur names the live one.
+static void snapshot_path(char *path, size_t size, unsigned long gen) {
+    snprintf(path, size, "%s/snapshot.%lu", doc_dir, gen);
+}
+
+// Once a write fails the journal stops taking records: anything after a
+// torn one would be lost on replay anyway. The text is ahead of the disk
+// from then on, so edits are refused (see edits_refused).
+static void journal_append(int type, OutBuf *payload) {
+    if (!journal || journal_replaying || journal_failed) return;
+    OutBuf head = {0};
+    put_u8(&head, (unsigned int)type);
+    put_u32(&head, (unsigned long)payload->len);
+    put_u32(&head, crc32_bytes(payload->data ? payload->data : "", payload->len));
+    if (fwrite(head.data, 1, head.len, journal) != head.len
+        || fwrite(payload->data ? payload->data : "", 1, payload->len, journal) != payload->len)
+        journal_failed = 1;
+    journal_bytes += head.len + payload->len;
+    stat_add(STAT_JOURNAL_BYTES, head.len + payload->len);
+    if (!journal_pending) unsynced_since = GetTickCount();
+    journal_pending = 1;
+    cursor_dirty = 1;
+    out_free(&head);
+}
+
+static void journal_edit(size_t pos, const char *removed, size_t rlen, const char *ins, size_t ilen) {
+    if (!journal || journal_replaying) return;
+    OutBuf o = {0};
+    put_u64(&o, pos);
+    put_u64(&o, rlen);
+    put_u64(&o, ilen);
+    out_write(&o, removed, rlen);
+    out_write(&o, ins, ilen);
+    journal_append(REC_EDIT, &o);
+    out_free(&o);
+}
+
+static void journal_mark(int type) {
+    OutBuf o = {0};
+    journal_append(type, &o);
+    out_free(&o);
+}
+
+// push written records to stable storage; 0 when they did not all get
+// there, in which case they stay pending
+static int journal_sync() {
+    if (journal_failed) return 0;
+    if (!journal || !journal_pending) return 1;
+    StatTimer timer = stats_start(TIMER_JOURNAL_SYNC);
+    if (fflush(journal) != 0 || file_sync(file_fd(journal)) != 0) journal_failed = 1;
+    else journal_pending = 0;
+    stats_stop(&timer, NULL);
+    return !journal_failed;
+}
+
+// Bump arena: allocations are carved from large blocks and released all
+// at once, so structures made of many small pieces cost one free. An arena
+// starts with a block of `first` bytes (ARENA_BLOCK_BYTES when 0) and
+// doubles from there, so the many small ones (one per undo unit) stay small.
+#define ARENA_BLOCK_BYTES (1024 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, cap;
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *head;
+    size_t first;
+} Arena;
+
+// where an arena was, to rewind to after a temporary allocation
+typedef struct ArenaMark {
+    ArenaBlock *blk;
+    size_t used;
+} ArenaMark;
+
+static void *arena_take(Arena *a, size_t n, size_t align) {
+    ArenaBlock *blk = a->head;
+    size_t at = blk ? (blk->used + align - 1) & ~(align - 1) : 0;
+    if (!blk || at > blk->cap || blk->cap - at < n) {
+        size_t cap = !blk ? (a->first ? a->first : ARENA_BLOCK_BYTES)
+                   : blk->cap >= ARENA_BLOCK_BYTES / 2 ? ARENA_BLOCK_BYTES : blk->cap * 2;
+        if (cap < n) cap = n;
+        blk = (ArenaBlock *)malloc(sizeof(ArenaBlock) + cap);
+        if (!blk) return NULL;
+        blk->next = a->head;
+        blk->used = 0;
+        blk->cap = cap;
+        a->head = blk;
+        at = 0;
+    }
+    blk->used = at + n;
+    return blk->data + at;
+}
+
+static void *arena_alloc(Arena *a, size_t n) {
+    return arena_take(a, (n + 7) & ~(size_t)7, 8);
+}
+
+// n bytes of s and a '\0' behind them
+static char *arena_dup(Arena *a, const char *s, size_t n) {
+    char *d = (char *)arena_take(a, n + 1, 1);
+    if (!d) return NULL;
+    if (n) memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+// make room for add more bytes behind the n-byte string p from arena_dup,
+// in place when p is the last thing allocated; the result is not
+// terminated
+static char *arena_grow(Arena *a, char *p, size_t n, size_t add) {
+    ArenaBlock *blk = a->head;
+    if (blk && p + n + 1 == blk->data + blk->used && blk->cap - blk->used >= add) {
+        blk->used += add;
+        return p;
+    }
+    char *d = (char *)arena_take(a, n + add + 1, 1);
+    if (d && n) memcpy(d, p, n);
+    return d;
+}
+
+static ArenaMark arena_mark(Arena *a) {
+    ArenaMark m = { a->head, a->head ? a->head->used : 0 };
+    return m;
+}
+
+// drop everything allocated since m. Rewinding an arena to empty keeps its
+// first block for the next use unless that block was oversized.
+static void arena_rewind(Arena *a, ArenaMark m) {
+    while (a->head && a->head != m.blk) {
+        ArenaBlock *next = a->head->next;
+        if (!next && a->head->cap <= (a->first ? a->first : ARENA_BLOCK_BYTES)) {
+            a->head->used = 0;
+            return;
+        }
+        free(a->head);
+        a->head = next;
+    }
+    if (a->head) a->head->used = m.used;
+}
+
+static void arena_release(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+// Per-request scratch memory of each thread, rewound after every request:
+// command copies and other temporaries that die with the request.
+#define SCRATCH_BLOCK_BYTES (64 * 1024)
+
+static THREAD_LOCAL Arena scratch = { NULL, SCRATCH_BLOCK_BYTES };
+
+static void scratch_reset() {
+    ArenaMark empty = { NULL, 0 };
+    arena_rewind(&scratch, empty);
+}
+
+// Slab: fixed-size objects carved from an arena and recycled through a
+// free list, so building and dropping them costs no malloc/free. The
+// memory goes back to the list, never to the system.
+typedef struct Slab {
+    size_t size;            // object size, a multiple of 8
+    void *free_list;
+    Arena chunks;
+} Slab;
+
+static void *slab_alloc(Slab *s) {
+    void *p = s->free_list;
+    if (p) {
+        s->free_list = *(void **)p;
+        return p;
+    }
+    return arena_alloc(&s->chunks, s->size);
+}
+
+static void slab_free(Slab *s, void *p) {
+    if (!p) return;
+    *(void **)p = s->free_list;
+    s->free_list = p;
+}
+
+// Undo/redo history. Each undo unit is a group of edits; an edit records
+// where it happened, the bytes it removed and the bytes it inserted, so
+// history costs memory proportional to the edits rather than the document.
+// A group's bytes live in its own arena and go with it in one release.
+#define GROUP_ARENA_BYTES 256
+typedef struct EditOp {
+    size_t pos;
+    char *removed;
+    size_t rlen;
+    char *inserted;
+    size_t ilen;
+} EditOp;
+
+// how a group was produced; consecutive typing/backspacing merges
+enum { EDIT_OTHER, EDIT_TYPING, EDIT_BACKSPACE };
+
+typedef struct EditGroup {
+    EditOp *ops;
+    int count;
+    int cap;
+    int kind;
+    size_t cursor;      // cursor before the group was applied
+    Arena bytes;        // removed and inserted bytes of the ops
+} EditGroup;
+
+typedef struct MemStack {
+    EditGroup *items;
+    int size;
+    int cap;
+} MemStack;
+
+static void edit_group_free(EditGroup *g) {
+    arena_release(&g->bytes);
+    free(g->ops);
+    g->ops = NULL; g->count = 0; g->cap = 0;
+}
+
+static int edit_group_add(EditGroup *g, size_t pos, const char *removed, size_t rlen,
+                          const char *inserted, size_t ilen) {
+    if (g->count + 1 > g->cap) {
+        int newcap = g->cap == 0 ? 4 : g->cap * 2;
+        EditOp *tmp = (EditOp *)realloc(g->ops, sizeof(EditOp) * newcap);
+        if (!tmp) return 0;
+        g->ops = tmp;
+        g->cap = newcap;
+    }
+    if (!g->bytes.first) g->bytes.first = GROUP_ARENA_BYTES;
+    EditOp *op = &g->ops[g->count++];
+    op->pos = pos;
+    // the side that may still grow by merging goes last, to grow in place
+    if (ilen) op->removed = arena_dup(&g->bytes, removed, rlen);
+    op->inserted = arena_dup(&g->bytes, inserted, ilen);
+    if (!ilen) op->removed = arena_dup(&g->bytes, removed, rlen);
+    op->rlen = rlen;
+    op->ilen = ilen;
+    return 1;
+}
+
+static void memstack_init(MemStack *s) {
+    s->items = NULL;
+    s->size = 0;
+    s->cap = 0;
+}
+
+static void memstack_clear(MemStack *s) {
+    if (!s) return;
+    for (int i = 0; i < s->size; ++i) edit_group_free(&s->items[i]);
+    s->size = 0;
+}
+
+static void memstack_free(MemStack *s) {
+    if (!s) return;
+    memstack_clear(s);
+    free(s->items);
+    s->items = NULL; s->size = 0; s->cap = 0;
+}
+
+// push takes ownership of the group's ops and bytes
+static int memstack_push(MemStack *s, EditGroup *g) {
+    if (!s) return 0;
+    if (s->size + 1 > s->cap) {
+        int newcap = s->cap == 0 ? 8 : s->cap * 2;
+        EditGroup *tmp = (EditGroup *)realloc(s->items, sizeof(EditGroup) * newcap);
+        if (!tmp) return 0;
+        s->items = tmp;
+        s->cap = newcap;
+    }
+    s->items[s->size++] = *g;
+    g->ops = NULL; g->count = 0; g->cap = 0;
+    g->bytes.head = NULL;
+    return 1;
+}
+
+static int memstack_pop(MemStack *s, EditGroup *out) {
+    if (!s || s->size <= 0) return 0;
+    *out = s->items[--s->size];
+    return 1;
+}
+
+static EditGroup *memstack_top(MemStack *s) {
+    return s && s->size > 0 ? &s->items[s->size - 1] : NULL;
+}
+
+static MemStack undo_stack, redo_stack;
+
+// AVL Tree 
+// Words of the index in sorted order. Lookups go through the index's hash
+// table; the tree only gets a node the first time a word is seen, and all
+// nodes live in the index arena.
+typedef struct AVLNode {
+    const char *word;       // interned, shared with the word entry
+    size_t len;
+    unsigned int id;        // word entry
+    int height;
+    struct AVLNode *left;
+    struct AVLNode *right;
+} AVLNode;
+
+// Get height of node
+static int height(AVLNode *node) {
+    if (node == NULL) return 0;
+    return node->height;
+}
+
+// Get balance factor
+static int get_balance(AVLNode *node) {
+    if (node == NULL) return 0;
+    return height(node->left) - height(node->right);
+}
+
+// Update height of node
+static void update_height(AVLNode *node) {
+    if (node == NULL) return;
+    int left_height = height(node->left);
+    int right_height = height(node->right);
+    node->height = (left_height > right_height ? left_height : right_height) + 1;
+}
+
+// Right rotation
+static AVLNode *rotate_right(AVLNode *y) {
+    AVLNode *x = y->left;
+    AVLNode *T2 = x->right;
+    x->right = y;
+    y->left = T2;
+    update_height(y);
+    update_height(x);
+    return x;
+}
+
+// Left rotation
+static AVLNode *rotate_left(AVLNode *x) {
+    AVLNode *y = x->right;
+    AVLNode *T2 = y->left;
+    y->left = x;
+    x->right = T2;
+    update_height(x);
+    update_height(y);
+    return y;
+}
+
+// Compare word[0, len) with a node's word: case-folded first and exact
+// only to break ties, so all spellings of a word sit together and every
+// folded prefix is one contiguous range of the tree
+static int word_cmp(const char *word, size_t len, AVLNode *node) {
+    size_t n = len < node->len ? len : node->len;
+    for (size_t i = 0; i < n; ++i) {
+        int a = tolower((unsigned char)word[i]), b = tolower((unsigned char)node->word[i]);
+        if (a != b) return a < b ? -1 : 1;
+    }
+    if (len != node->len) return len < node->len ? -1 : 1;
+    int c = memcmp(word, node->word, n);
+    return c < 0 ? -1 : c > 0;
+}
+
+// -1, 0 or 1 as the node's word sorts before, starts with or sorts after
+// the prefix, ignoring case
+static int prefix_cmp(AVLNode *node, const char *prefix, size_t plen) {
+    size_t n = node->len < plen ? node->len : plen;
+    for (size_t i = 0; i < n; ++i) {
+        int a = tolower((unsigned char)node->word[i]), b = tolower((unsigned char)prefix[i]);
+        if (a != b) return a < b ? -1 : 1;
+    }
+    return node->len < plen ? -1 : 0;
+}
+
+// visit, in order, every node whose word starts with prefix (ignoring case)
+static void avl_prefix_walk(AVLNode *node, const char *prefix, size_t plen,
+                            void (*fn)(void *ctx, AVLNode *node), void *ctx) {
+    if (node == NULL) return;
+    int c = prefix_cmp(node, prefix, plen);
+    if (c >= 0) avl_prefix_walk(node->left, prefix, plen, fn, ctx);
+    if (c == 0) fn(ctx, node);
+    if (c <= 0) avl_prefix_walk(node->right, prefix, plen, fn, ctx);
+}
+
+// Create new node
+static AVLNode *new_node(Arena *a, const char *word, size_t len, unsigned int id) {
+    AVLNode *node = (AVLNode *)arena_alloc(a, sizeof(AVLNode));
+    if (!node) return NULL;
+    node->word = word;
+    node->len = len;
+    node->id = id;
+    node->height = 1;
+    node->left = NULL;
+    node->right = NULL;
+    return node;
+}
+
+// Insert a word that is not in the tree yet
+static AVLNode *insert(Arena *a, AVLNode *node, const char *word, size_t len, unsigned int id) {
+    if (node == NULL)
+        return new_node(a, word, len, id);
+
+    int cmp = word_cmp(word, len, node);
+    AVLNode *child;
+    if (cmp < 0) {
+        if (!(child = insert(a, node->left, word, len, id))) return NULL;
+        node->left = child;
+    } else if (cmp > 0) {
+        if (!(child = insert(a, node->right, word, len, id))) return NULL;
+        node->right = child;
+    } else
+        return node;
+
+    update_height(node);
+    int balance = get_balance(node);
+
+    // Left Left Case
+    if (balance > 1 && word_cmp(word, len, node->left) < 0)
+        return rotate_right(node);
+
+    // Right Right Case
+    if (balance < -1 && word_cmp(word, len, node->right) > 0)
+        return rotate_left(node);
+
+    // Left Right Case
+    if (balance > 1 && word_cmp(word, len, node->left) > 0) {
+        node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+
+    // Right Left Case
+    if (balance < -1 && word_cmp(word, len, node->right) < 0) {
+        node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+
+// Rope
+
+// Balanced (AVL by height) binary tree of text chunks. Nodes are immutable
+// once built and reference counted, so split/join share every untouched
+// subtree. Every rope_* function below consumes the references it is given
+// and returns owned references.
+#define ROPE_LEAF_MAX 2048
+
+typedef struct RopeNode {
+    int refs;
+    int height;         // leaves have height 1
+    size_t bytes;
+    size_t lines;       // number of '\n' in the subtree
+    struct RopeNode *left;
+    struct RopeNode *right;
+    size_t len;         // leaf only
+    char data[];        // leaf only
+} RopeNode;
+
+static size_t count_newlines(const char *s, size_t n) {
+    size_t c = 0;
+    const char *end = s + n;
+    while (s < end && (s = (const char *)memchr(s, '\n', end - s)) != NULL) { c++; s++; }
+    return c;
+}
+
+// internal nodes all have the same size and come and go with every edit,
+// so they are recycled through a slab; leaves are sized to their text
+static Slab rope_nodes = { (sizeof(RopeNode) + 7) & ~(size_t)7, NULL, { NULL, 64 * 1024 } };
+
+static int rope_height(RopeNode *r) { return r ? r->height : 0; }
+static size_t rope_bytes(RopeNode *r) { return r ? r->bytes : 0; }
+static size_t rope_lines(RopeNode *r) { return r ? r->lines : 0; }
+static int rope_is_leaf(RopeNode *r) { return r->left == NULL; }
+
+static RopeNode *rope_ref(RopeNode *r) {
+    if (r) r->refs++;
+    return r;
+}
+
+static void rope_release(RopeNode *r) {
+    while (r && --r->refs == 0) {
+        RopeNode *right = r->right;
+        if (rope_is_leaf(r)) {
+            free(r);
+        } else {
+            rope_release(r->left);
+            slab_free(&rope_nodes, r);
+        }
+        r = right;
+    }
+}
+
+static RopeNode *rope_leaf(const char *s, size_t n) {
+    RopeNode *r = (RopeNode *)malloc(sizeof(RopeNode) + n);
+    if (!r) return NULL;
+    r->refs = 1;
+    r->height = 1;
+    r->bytes = n;
+    r->lines = count_newlines(s, n);
+    r->left = r->right = NULL;
+    r->len = n;
+    memcpy(r->data, s, n);
+    return r;
+}
+
+static RopeNode *rope_node(RopeNode *l, RopeNode *r) {
+    RopeNode *n = (RopeNode *)slab_alloc(&rope_nodes);
+    if (!n) return NULL;
+    n->refs = 1;
+    n->height = (rope_height(l) > rope_height(r) ? rope_height(l) : rope_height(r)) + 1;
+    n->bytes = l->bytes + r->bytes;
+    n->lines = l->lines + r->lines;
+    n->left = l;
+    n->right = r;
+    n->len = 0;
+    return n;
+}
+
+// hand back the children of internal node r as owned references
+static void rope_unpack(RopeNode *r, RopeNode **l, RopeNode **rt) {
+    *l = r->left;
+    *rt = r->right;
+    if (r->refs == 1) {
+        slab_free(&rope_nodes, r);
+    } else {
+        rope_ref(*l);
+        rope_ref(*rt);
+        r->refs--;
+    }
+}
+
+// build a perfectly balanced rope over s
+static RopeNode *rope_build(const char *s, size_t n) {
+    if (n == 0) return NULL;
+    if (n <= ROPE_LEAF_MAX) return rope_leaf(s, n);
+    size_t chunks = (n + ROPE_LEAF_MAX - 1) / ROPE_LEAF_MAX;
+    size_t half = (chunks / 2) * ROPE_LEAF_MAX;
+    return rope_node(rope_build(s, half), rope_build(s + half, n - half));
+}
+
+// join two subtrees whose heights differ by at most two
+static RopeNode *rope_balance(RopeNode *l, RopeNode *r) {
+    int hl = rope_height(l), hr = rope_height(r);
+    RopeNode *a, *b, *c, *d;
+    if (hl > hr + 1) {
+        rope_unpack(l, &a, &b);
+        if (rope_height(a) >= rope_height(b)) return rope_node(a, rope_node(b, r));
+        rope_unpack(b, &c, &d);
+        return rope_node(rope_node(a, c), rope_node(d, r));
+    }
+    if (hr > hl + 1) {
+        rope_unpack(r, &a, &b);
+        if (rope_height(b) >= rope_height(a)) return rope_node(rope_node(l, a), b);
+        rope_unpack(a, &c, &d);
+        return rope_node(rope_node(l, c), rope_node(d, b));
+    }
+    return rope_node(l, r);
+}
+
+// concatenate; O(|height(a) - height(b)|)
+static RopeNode *rope_join(RopeNode *a, RopeNode *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (rope_is_leaf(a) && rope_is_leaf(b) && a->len + b->len <= ROPE_LEAF_MAX) {
+        RopeNode *m = (RopeNode *)malloc(sizeof(RopeNode) + a->len + b->len);
+        if (!m) return rope_node(a, b);
+        m->refs = 1;
+        m->height = 1;
+        m->bytes = m->len = a->len + b->len;
+        m->lines = a->lines + b->lines;
+        m->left = m->right = NULL;
+        memcpy(m->data, a->data, a->len);
+        memcpy(m->data + a->len, b->data, b->len);
+        rope_release(a);
+        rope_release(b);
+        return m;
+    }
+    int ha = rope_height(a), hb = rope_height(b);
+    RopeNode *l, *r;
+    if (ha > hb + 1) {
+        rope_unpack(a, &l, &r);
+        return rope_balance(l, rope_join(r, b));
+    }
+    if (hb > ha + 1) {
+        rope_unpack(b, &l, &r);
+        return rope_balance(rope_join(a, l), r);
+    }
+    return rope_node(a, b);
+}
+
+// split r into [0, off) and [off, end)
+static void rope_split(RopeNode *r, size_t off, RopeNode **out_l, RopeNode **out_r) {
+    if (!r || off == 0) { *out_l = NULL; *out_r = r; return; }
+    if (off >= r->bytes) { *out_l = r; *out_r = NULL; return; }
+    if (rope_is_leaf(r)) {
+        *out_l = rope_leaf(r->data, off);
+        *out_r = rope_leaf(r->data + off, r->len - off);
+        rope_release(r);
+        return;
+    }
+    RopeNode *l, *rt, *m;
+    size_t lb = r->left->bytes;
+    rope_unpack(r, &l, &rt);
+    if (off < lb) {
+        rope_split(l, off, out_l, &m);
+        *out_r = rope_join(m, rt);
+    } else if (off == lb) {
+        *out_l = l;
+        *out_r = rt;
+    } else {
+        rope_split(rt, off - lb, &m, out_r);
+        *out_l = rope_join(l, m);
+    }
+}
+
+static RopeNode *rope_insert(RopeNode *r, size_t pos, const char *s, size_t n) {
+    RopeNode *l, *rt;
+    rope_split(r, pos, &l, &rt);
+    return rope_join(rope_join(l, rope_build(s, n)), rt);
+}
+
+static RopeNode *rope_delete(RopeNode *r, size_t pos, size_t n) {
+    RopeNode *l, *rest, *mid, *rt;
+    rope_split(r, pos, &l, &rest);
+    rope_split(rest, n, &mid, &rt);
+    rope_release(mid);
+    return rope_join(l, rt);
+}
+
+static char rope_char_at(RopeNode *r, size_t pos) {
+    while (r && !rope_is_leaf(r)) {
+        if (pos < r->left->bytes) r = r->left;
+        else { pos -= r->left->bytes; r = r->right; }
+    }
+    return r && pos < r->len ? r->data[pos] : '\0';
+}
+
+static size_t rope_copy_range(RopeNode *r, size_t pos, size_t n, char *dst) {
+    if (!r || n == 0 || pos >= r->bytes) return 0;
+    if (rope_is_leaf(r)) {
+        size_t take = r->len - pos < n ? r->len - pos : n;
+        memcpy(dst, r->data + pos, take);
+        return take;
+    }
+    size_t lb = r->left->bytes;
+    size_t done = 0;
+    if (pos < lb) done = rope_copy_range(r->left, pos, n, dst);
+    if (done < n) done += rope_copy_range(r->right, pos + done - lb, n - done, dst + done);
+    return done;
+}
+
+// Callback for walking text in place, one contiguous run at a time; a
+// zero return stops the walk.
+typedef int (*ChunkFn)(void *ctx, const char *p, size_t n);
+
+// visit the leaves covering [pos, pos+n); returns 0 if fn stopped the walk
+static int rope_chunks(RopeNode *r, size_t pos, size_t n, ChunkFn fn, void *ctx) {
+    if (!r || n == 0 || pos >= r->bytes) return 1;
+    if (rope_is_leaf(r)) {
+        size_t take = r->len - pos < n ? r->len - pos : n;
+        return fn(ctx, r->data + pos, take);
+    }
+    size_t lb = r->left->bytes;
+    if (pos < lb) {
+        size_t take = lb - pos < n ? lb - pos : n;
+        if (!rope_chunks(r->left, pos, take, fn, ctx)) return 0;
+        pos += take;
+        n -= take;
+    }
+    return rope_chunks(r->right, pos - lb, n, fn, ctx);
+}
+
+// offset of the k-th '\n' (k >= 1, at most rope_lines(r))
+static size_t rope_nth_newline(RopeNode *r, size_t k) {
+    size_t off = 0;
+    while (!rope_is_leaf(r)) {
+        if (k <= r->left->lines) {
+            r = r->left;
+        } else {
+            k -= r->left->lines;
+            off += r->left->bytes;
+            r = r->right;
+        }
+    }
+    const char *p = r->data;
+    for (;;) {
+        p = (const char *)memchr(p, '\n', r->len - (size_t)(p - r->data));
+        if (--k == 0) return off + (size_t)(p - r->data);
+        p++;
+    }
+}
+
+// number of '\n' in [0, pos)
+static size_t rope_newlines_before(RopeNode *r, size_t pos) {
+    size_t c = 0;
+    while (r && !rope_is_leaf(r)) {
+        if (pos < r->left->bytes) {
+            r = r->left;
+        } else {
+            c += r->left->lines;
+            pos -= r->left->bytes;
+            r = r->right;
+        }
+    }
+    return r ? c + count_newlines(r->data, pos < r->len ? pos : r->len) : c;
+}
+
+// visit every leaf from the last to the first
+static int rope_chunks_reverse(RopeNode *r, ChunkFn fn, void *ctx) {
+    if (!r) return 1;
+    if (rope_is_leaf(r)) return r->len == 0 || fn(ctx, r->data, r->len);
+    return rope_chunks_reverse(r->right, fn, ctx) && rope_chunks_reverse(r->left, fn, ctx);
+}
+
+// Piece table
+
+// The text is a sequence of pieces, each pointing either into the original
+// text or into an append-only add buffer. Add blocks are never moved or
+// reallocated, so a piece is just a pointer and a length, and typing at the
+// end of the last added piece only grows that piece. The pieces are the
+// leaves of a balanced tree built the same way as the rope (immutable,
+// reference counted nodes with byte and line counts per subtree), so
+// finding an offset or line and splicing in an edit cost O(log pieces).
+#define ADD_BLOCK_SIZE (64 * 1024)
+
+typedef struct AddBlock {
+    struct AddBlock *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} AddBlock;
+
+#define LINES_UNKNOWN ((size_t)-1)
+
+typedef struct PieceNode {
+    int refs;
+    int height;         // leaves have height 1
+    size_t bytes;
+    size_t lines;       // '\n' count, LINES_UNKNOWN until a line query needs it
+    struct PieceNode *left;
+    struct PieceNode *right;
+    const char *text;   // leaf only
+} PieceNode;
+
+// deepest path from the root to a piece; an AVL tree of 2^64 pieces is
+// under 93 levels deep
+#define PIECE_PATH_MAX 96
+
+static Slab piece_nodes = { (sizeof(PieceNode) + 7) & ~(size_t)7, NULL, { NULL, 64 * 1024 } };
+
+static int piece_height(PieceNode *t) { return t ? t->height : 0; }
+static size_t piece_bytes(PieceNode *t) { return t ? t->bytes : 0; }
+static int piece_is_leaf(PieceNode *t) { return t->left == NULL; }
+
+static PieceNode *piece_ref(PieceNode *t) {
+    if (t) t->refs++;
+    return t;
+}
+
+static void piece_release(PieceNode *t) {
+    while (t && --t->refs == 0) {
+        PieceNode *right = t->right;
+        piece_release(t->left);
+        slab_free(&piece_nodes, t);
+        t = right;
+    }
+}
+
+static PieceNode *piece_leaf(const char *text, size_t len) {
+    PieceNode *t = (PieceNode *)slab_alloc(&piece_nodes);
+    if (!t) return NULL;
+    t->refs = 1;
+    t->height = 1;
+    t->bytes = len;
+    t->lines = LINES_UNKNOWN;
+    t->left = t->right = NULL;
+    t->text = text;
+    return t;
+}
+
+static PieceNode *piece_node(PieceNode *l, PieceNode *r) {
+    PieceNode *t = (PieceNode *)slab_alloc(&piece_nodes);
+    if (!t) return NULL;
+    t->refs = 1;
+    t->height = (l->height > r->height ? l->height : r->height) + 1;
+    t->bytes = l->bytes + r->bytes;
+    t->lines = l->lines == LINES_UNKNOWN || r->lines == LINES_UNKNOWN ? LINES_UNKNOWN
+                                                                     : l->lines + r->lines;
+    t->left = l;
+    t->right = r;
+    t->text = NULL;
+    return t;
+}
+
+// hand back the children of internal node t as owned references
+static void piece_unpack(PieceNode *t, PieceNode **l, PieceNode **r) {
+    *l = t->left;
+    *r = t->right;
+    if (t->refs == 1) {
+        slab_free(&piece_nodes, t);
+    } else {
+        piece_ref(*l);
+        piece_ref(*r);
+        t->refs--;
+    }
+}
+
+// join two subtrees whose heights differ by at most two
+static PieceNode *pieces_balance(PieceNode *l, PieceNode *r) {
+    int hl = piece_height(l), hr = piece_height(r);
+    PieceNode *a, *b, *c, *d;
+    if (hl > hr + 1) {
+        piece_unpack(l, &a, &b);
+        if (piece_height(a) >= piece_height(b)) return piece_node(a, piece_node(b, r));
+        piece_unpack(b, &c, &d);
+        return piece_node(piece_node(a, c), piece_node(d, r));
+    }
+    if (hr > hl + 1) {
+        piece_unpack(r, &a, &b);
+        if (piece_height(b) >= piece_height(a)) return piece_node(piece_node(l, a), b);
+        piece_unpack(a, &c, &d);
+        return piece_node(piece_node(l, c), piece_node(d, b));
+    }
+    return piece_node(l, r);
+}
+
+// concatenate; O(|height(a) - height(b)|)
+static PieceNode *pieces_join(PieceNode *a, PieceNode *b) {
+    if (!a) return b;
+    if (!b) return a;
+    int ha = a->height, hb = b->height;
+    PieceNode *l, *r;
+    if (ha > hb + 1) {
+        piece_unpack(a, &l, &r);
+        return pieces_balance(l, pieces_join(r, b));
+    }
+    if (hb > ha + 1) {
+        piece_unpack(b, &l, &r);
+        return pieces_balance(pieces_join(a, l), r);
+    }
+    return piece_node(a, b);
+}
+
+// split t into [0, off) and [off, end)
+static void pieces_split(PieceNode *t, size_t off, PieceNode **out_l, PieceNode **out_r) {
+    if (!t || off == 0) { *out_l = NULL; *out_r = t; return; }
+    if (off >= t->bytes) { *out_l = t; *out_r = NULL; return; }
+    if (piece_is_leaf(t)) {
+        *out_l = piece_leaf(t->text, off);
+        *out_r = piece_leaf(t->text + off, t->bytes - off);
+        piece_release(t);
+        return;
+    }
+    PieceNode *l, *r, *m;
+    size_t lb = t->left->bytes;
+    piece_unpack(t, &l, &r);
+    if (off < lb) {
+        pieces_split(l, off, out_l, &m);
+        *out_r = pieces_join(m, r);
+    } else if (off == lb) {
+        *out_l = l;
+        *out_r = r;
+    } else {
+        pieces_split(r, off - lb, &m, out_r);
+        *out_l = pieces_join(l, m);
+    }
+}
+
+// concatenate, making one piece of the two that meet if the second
+// continues the first in memory (typing after an insertion appends to it)
+static PieceNode *pieces_concat(PieceNode *a, PieceNode *b) {
+    if (!a) return b;
+    if (!b) return a;
+    PieceNode *x = a, *y = b;
+    while (!piece_is_leaf(x)) x = x->right;
+    while (!piece_is_leaf(y)) y = y->left;
+    if (x->text + x->bytes != y->text) return pieces_join(a, b);
+    PieceNode *m = piece_leaf(x->text, x->bytes + y->bytes);
+    if (!m) return pieces_join(a, b);
+    if (x->lines != LINES_UNKNOWN && y->lines != LINES_UNKNOWN) m->lines = x->lines + y->lines;
+    PieceNode *head, *tail, *drop;
+    pieces_split(a, a->bytes - x->bytes, &head, &drop);
+    piece_release(drop);
+    pieces_split(b, y->bytes, &drop, &tail);
+    piece_release(drop);
+    return pieces_join(pieces_join(head, m), tail);
+}
+
+// the leaf holding offset pos (pos < bytes); *start gets where it begins
+static PieceNode *pieces_leaf_at(PieceNode *t, size_t pos, size_t *start) {
+    size_t off = 0;
+    while (!piece_is_leaf(t)) {
+        if (pos - off < t->left->bytes) {
+            t = t->left;
+        } else {
+            off += t->left->bytes;
+            t = t->right;
+        }
+    }
+    *start = off;
+    return t;
+}
+
+static size_t pieces_copy_range(PieceNode *t, size_t pos, size_t n, char *dst) {
+    if (!t || n == 0 || pos >= t->bytes) return 0;
+    if (piece_is_leaf(t)) {
+        size_t take = t->bytes - pos < n ? t->bytes - pos : n;
+        memcpy(dst, t->text + pos, take);
+        return take;
+    }
+    size_t lb = t->left->bytes;
+    size_t done = 0;
+    if (pos < lb) done = pieces_copy_range(t->left, pos, n, dst);
+    if (done < n) done += pieces_copy_range(t->right, pos + done - lb, n - done, dst + done);
+    return done;
+}
+
+// visit the pieces covering [pos, pos+n); returns 0 if fn stopped the walk
+static int pieces_chunks(PieceNode *t, size_t pos, size_t n, ChunkFn fn, void *ctx) {
+    if (!t || n == 0 || pos >= t->bytes) return 1;
+    if (piece_is_leaf(t)) {
+        size_t take = t->bytes - pos < n ? t->bytes - pos : n;
+        return fn(ctx, t->text + pos, take);
+    }
+    size_t lb = t->left->bytes;
+    if (pos < lb) {
+        size_t take = lb - pos < n ? lb - pos : n;
+        if (!pieces_chunks(t->left, pos, take, fn, ctx)) return 0;
+        pos += take;
+        n -= take;
+    }
+    return pieces_chunks(t->right, pos - lb, n, fn, ctx);
+}
+
+// visit every piece from the last to the first
+static int pieces_chunks_reverse(PieceNode *t, ChunkFn fn, void *ctx) {
+    if (!t) return 1;
+    if (piece_is_leaf(t)) return fn(ctx, t->text, t->bytes);
+    return pieces_chunks_reverse(t->right, fn, ctx) && pieces_chunks_reverse(t->left, fn, ctx);
+}
+
+// The text pieces point into: the original text and the add blocks.
+// Frozen copies of a buffer (see buffer_freeze) point into the same text,
+// so it is reference counted and goes away with the last buffer using it.
+typedef struct TextStore {
+    int refs;
+    char *original;     // loaded text, owned
+    FileMap *map;       // or: mapped file the original text lives in
+    AddBlock *add;      // newest block first
+    size_t *orig_blocks;
+} TextStore;
+
+static TextStore *store_new() {
+    TextStore *st = (TextStore *)calloc(1, sizeof(TextStore));
+    if (st) st->refs = 1;
+    return st;
+}
+
+static void store_release(TextStore *st) {
+    if (!st || --st->refs > 0) return;
+    AddBlock *blk = st->add;
+    while (blk) {
+        AddBlock *nx = blk->next;
+        free(blk);
+        blk = nx;
+    }
+    free(st->orig_blocks);
+    free(st->original);
+    unmap_file(st->map);
+    free(st);
+}
+
+// Text engines behind the Buffer API. The piece table is the default;
+// --engine=rope keeps the text in a balanced rope instead.
+enum { ENGINE_PIECES, ENGINE_ROPE };
+static int buffer_engine = ENGINE_PIECES;
+
+typedef struct Buffer {
+    int engine;
+    int frozen;         // a read-only copy made by buffer_freeze
+    unsigned long long version;     // bumped by every change to the text
+    RopeNode *rope;     // ENGINE_ROPE only
+    TextStore *store;   // ENGINE_PIECES only
+    PieceNode *pieces;  // ENGINE_PIECES only
+    size_t length;
+    size_t cursor;      // primary cursor: byte offset; cursor == length means end of text
+    size_t *carets;     // further cursors, sorted, distinct and never equal to cursor
+    size_t ncarets;
+    size_t caret_cap;
+    const char *orig_text;      // the original text, owned or mapped
+    size_t orig_len;
+    size_t *orig_blocks;        // '\n' count before each ORIG_LINE_BLOCK of it, in store
+} Buffer;
+
+// copy s into the add buffer and return where it landed
+static const char *add_buffer_append(Buffer *b, const char *s, size_t n) {
+    AddBlock *blk = b->store->add;
+    if (!blk || blk->cap - blk->used < n) {
+        size_t cap = n > ADD_BLOCK_SIZE ? n : ADD_BLOCK_SIZE;
+        blk = (AddBlock *)malloc(sizeof(AddBlock) + cap);
+        if (!blk) return NULL;
+        blk->next = b->store->add;
+        blk->used = 0;
+        blk->cap = cap;
+        b->store->add = blk;
+    }
+    char *dst = blk->data + blk->used;
+    memcpy(dst, s, n);
+    blk->used += n;
+    return dst;
+}
+
+// true if text ends exactly where the newest add block is still writable
+static int add_buffer_is_tail(Buffer *b, const char *end) {
+    AddBlock *blk = b->store->add;
+    return blk && end == blk->data + blk->used;
+}
+
+// takes ownership of s (malloc'd, n bytes, NUL-terminated)
+static Buffer *buffer_create_owned(char *s, size_t n) {
+    Buffer *b = (Buffer *)calloc(1, sizeof(Buffer));
+    if (!b) { free(s); return NULL; }
+    b->engine = buffer_engine;
+    if (b->engine == ENGINE_ROPE) {
+        b->rope = rope_build(s, n);
+        b->length = b->cursor = rope_bytes(b->rope);
+        free(s);
+        return b;
+    }
+    b->store = store_new();
+    if (!b->store) { free(s); free(b); return NULL; }
+    b->store->original = s;
+    b->orig_text = s;
+    b->orig_len = n;
+    if (n > 0) b->pieces = piece_leaf(s, n);
+    b->length = b->cursor = n;
+    return b;
+}
+
+// use n bytes at text inside mapping m as the original text; the buffer
+// takes ownership of m. The rope engine copies into its leaves instead.
+static Buffer *buffer_create_mapped(FileMap *m, const char *text, size_t n) {
+    Buffer *b = (Buffer *)calloc(1, sizeof(Buffer));
+    if (!b) { unmap_file(m); return NULL; }
+    b->engine = buffer_engine;
+    if (b->engine == ENGINE_ROPE) {
+        b->rope = rope_build(text, n);
+        b->length = b->cursor = rope_bytes(b->rope);
+        unmap_file(m);
+        return b;
+    }
+    b->store = store_new();
+    if (!b->store) { unmap_file(m); free(b); return NULL; }
+    b->store->map = m;
+    b->orig_text = text;
+    b->orig_len = n;
+    if (n > 0) b->pieces = piece_leaf(text, n);
+    b->length = b->cursor = n;
+    return b;
+}
+
+static Buffer *buffer_create_from_string(const char *s) {
+    size_t n = s ? strlen(s) : 0;
+    char *copy = (char *)malloc(n + 1);
+    if (!copy) return NULL;
+    if (n) memcpy(copy, s, n);
+    copy[n] = '\0';
+    return buffer_create_owned(copy, n);
+}
+
+static void buffer_free(Buffer *b) {
+    if (!b) return;
+    rope_release(b->rope);
+    piece_release(b->pieces);
+    store_release(b->store);
+    free(b->carets);
+    free(b);
+}
+
+
+static size_t buffer_length(Buffer *b) {
+    return b ? b->length : 0;
+}
+
+// Cursors. The primary cursor is where single-cursor commands act and what
+// replies show; carets are the further cursors of multi-cursor editing.
+// Every edit moves all of them the same way, and cursors that meet merge.
+static size_t buffer_cursor(Buffer *b) {
+    return b ? b->cursor : 0;
+}
+
+// drop carets that ran into a neighbour or into the primary cursor
+static void carets_dedupe(Buffer *b) {
+    size_t k = 0;
+    for (size_t i = 0; i < b->ncarets; ++i) {
+        size_t c = b->carets[i];
+        if (c == b->cursor || (k > 0 && b->carets[k - 1] == c)) continue;
+        b->carets[k++] = c;
+    }
+    b->ncarets = k;
+}
+
+static void buffer_set_cursor(Buffer *b, size_t pos) {
+    if (!b) return;
+    b->cursor = pos > b->length ? b->length : pos;
+    carets_dedupe(b);
+}
+
+// add a caret at pos; returns 0 when out of memory
+static int buffer_add_caret(Buffer *b, size_t pos) {
+    if (!b) return 0;
+    if (pos > b->length) pos = b->length;
+    if (pos == b->cursor) return 1;
+    size_t lo = 0, hi = b->ncarets;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (b->carets[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < b->ncarets && b->carets[lo] == pos) return 1;
+    if (b->ncarets == b->caret_cap) {
+        size_t newcap = b->caret_cap ? b->caret_cap * 2 : 8;
+        size_t *tmp = (size_t *)realloc(b->carets, sizeof(size_t) * newcap);
+        if (!tmp) return 0;
+        b->carets = tmp;
+        b->caret_cap = newcap;
+    }
+    memmove(&b->carets[lo + 1], &b->carets[lo], sizeof(size_t) * (b->ncarets - lo));
+    b->carets[lo] = pos;
+    b->ncarets++;
+    return 1;
+}
+
+static void buffer_clear_carets(Buffer *b) {
+    if (b) b->ncarets = 0;
+}
+
+// where a cursor at c ends up once rlen bytes at pos become ilen bytes;
+// a cursor at an insertion point moves past the inserted text
+static size_t cursor_after_edit(size_t c, size_t pos, size_t rlen, size_t ilen) {
+    if (c >= pos + rlen) return c - rlen + ilen;
+    return c > pos ? pos : c;
+}
+
+static void buffer_shift_cursors(Buffer *b, size_t pos, size_t rlen, size_t ilen) {
+    b->cursor = cursor_after_edit(b->cursor, pos, rlen, ilen);
+    for (size_t i = 0; i < b->ncarets; ++i)
+        b->carets[i] = cursor_after_edit(b->carets[i], pos, rlen, ilen);
+    carets_dedupe(b);
+}
+
+static int cmp_size(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// move every cursor to fn(b, cursor)
+typedef size_t (*CursorMoveFn)(Buffer *b, size_t pos);
+
+static void buffer_move_cursors(Buffer *b, CursorMoveFn fn) {
+    if (!b) return;
+    b->cursor = fn(b, b->cursor);
+    for (size_t i = 0; i < b->ncarets; ++i) b->carets[i] = fn(b, b->carets[i]);
+    qsort(b->carets, b->ncarets, sizeof(size_t), cmp_size);
+    carets_dedupe(b);
+}
+
+static char buffer_char_at(Buffer *b, size_t pos) {
+    if (!b || pos >= b->length) return '\0';
+    if (b->engine == ENGINE_ROPE) return rope_char_at(b->rope, pos);
+    size_t start;
+    PieceNode *p = pieces_leaf_at(b->pieces, pos, &start);
+    return p->text[pos - start];
+}
+
+// copy n bytes starting at pos into dst (no terminator); returns bytes copied
+static size_t buffer_copy_range(Buffer *b, size_t pos, size_t n, char *dst) {
+    if (!b || pos >= b->length || n == 0) return 0;
+    if (n > b->length - pos) n = b->length - pos;
+    stat_add(STAT_TEXT_COPIED, n);
+    if (b->engine == ENGINE_ROPE) return rope_copy_range(b->rope, pos, n, dst);
+    return pieces_copy_range(b->pieces, pos, n, dst);
+}
+
+// pass [pos, pos+n) to fn as the runs it is stored in, without copying
+static void buffer_chunks(Buffer *b, size_t pos, size_t n, ChunkFn fn, void *ctx) {
+    if (!b || pos >= b->length || n == 0) return;
+    if (n > b->length - pos) n = b->length - pos;
+    if (b->engine == ENGINE_ROPE) {
+        rope_chunks(b->rope, pos, n, fn, ctx);
+        return;
+    }
+    pieces_chunks(b->pieces, pos, n, fn, ctx);
+}
+
+// pass the whole text to fn run by run, starting from the end
+static void buffer_chunks_reverse(Buffer *b, ChunkFn fn, void *ctx) {
+    if (!b) return;
+    if (b->engine == ENGINE_ROPE) {
+        rope_chunks_reverse(b->rope, fn, ctx);
+        return;
+    }
+    pieces_chunks_reverse(b->pieces, fn, ctx);
+}
+
+static char *buffer_to_string_with_cursor(Buffer *b) {
+    if (!b) return strdup("|");
+    char *out = (char *)malloc(b->length + 2);
+    if (!out) return NULL;
+    size_t oi = buffer_copy_range(b, 0, b->cursor, out);
+    out[oi++] = '|';
+    oi += buffer_copy_range(b, b->cursor, b->length - b->cursor, out + oi);
+    out[oi] = '\0';
+    return out;
+}
+
+// Line addressing. The rope keeps line counts in its nodes. The piece tree
+// does too, but counts a piece only when a line query first needs it, and
+// then only the subtrees holding pieces that were not counted yet. Pieces of
+// the original text are counted through a sparse index of that text built
+// on first use: the count before every ORIG_LINE_BLOCK bytes, so any count
+// inside it scans at most one block.
+#define ORIG_LINE_BLOCK 4096
+
+static int orig_index(Buffer *b) {
+    if (b->orig_blocks) return 1;
+    // a frozen copy only reads what its buffer had built; it counts instead
+    if (b->frozen) return 0;
+    size_t nblocks = b->orig_len / ORIG_LINE_BLOCK + 1;
+    b->orig_blocks = (size_t *)malloc(sizeof(size_t) * nblocks);
+    if (!b->orig_blocks) return 0;
+    b->store->orig_blocks = b->orig_blocks;
+    size_t c = 0;
+    for (size_t k = 0; k < nblocks; ++k) {
+        b->orig_blocks[k] = c;
+        size_t at = k * ORIG_LINE_BLOCK;
+        size_t n = b->orig_len - at < ORIG_LINE_BLOCK ? b->orig_len - at : ORIG_LINE_BLOCK;
+        c += count_newlines(b->orig_text + at, n);
+    }
+    return 1;
+}
+
+// number of '\n' in the original text before offset x
+static size_t orig_rank(Buffer *b, size_t x) {
+    size_t k = x / ORIG_LINE_BLOCK;
+    return b->orig_blocks[k] + count_newlines(b->orig_text + k * ORIG_LINE_BLOCK, x - k * ORIG_LINE_BLOCK);
+}
+
+static int in_original(Buffer *b, const char *p) {
+    return b->orig_text && p >= b->orig_text && p < b->orig_text + b->orig_len;
+}
+
+// number of '\n' in the first n bytes of piece p
+static size_t piece_newlines(Buffer *b, const PieceNode *p, size_t n) {
+    if (n == p->bytes && p->lines != LINES_UNKNOWN) return p->lines;
+    if (in_original(b, p->text) && orig_index(b)) {
+        size_t a = (size_t)(p->text - b->orig_text);
+        return orig_rank(b, a + n) - orig_rank(b, a);
+    }
+    return count_newlines(p->text, n);
+}
+
+// offset within piece p of its k-th '\n' (1 <= k <= p->lines)
+static size_t piece_nth_newline(Buffer *b, const PieceNode *p, size_t k) {
+    const char *from = p->text;
+    if (in_original(b, p->text) && b->orig_blocks) {
+        // skip to the block holding it
+        size_t a = (size_t)(p->text - b->orig_text);
+        size_t want = orig_rank(b, a) + k;
+        size_t lo = a / ORIG_LINE_BLOCK, hi = b->orig_len / ORIG_LINE_BLOCK + 1;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (b->orig_blocks[mid] < want) lo = mid;
+            else hi = mid;
+        }
+        if (lo * ORIG_LINE_BLOCK > a) {
+            from = b->orig_text + lo * ORIG_LINE_BLOCK;
+            k = want - b->orig_blocks[lo];
+        }
+    }
+    const char *end = p->text + p->bytes;
+    for (;;) {
+        from = (const char *)memchr(from, '\n', (size_t)(end - from));
+        if (--k == 0) return (size_t)(from - p->text);
+        from++;
+    }
+}
+
+// fill in the line counts missing below t; returns t's count
+static size_t pieces_count_lines(Buffer *b, PieceNode *t) {
+    if (t->lines != LINES_UNKNOWN) return t->lines;
+    if (piece_is_leaf(t)) t->lines = piece_newlines(b, t, t->bytes);
+    else t->lines = pieces_count_lines(b, t->left) + pieces_count_lines(b, t->right);
+    return t->lines;
+}
+
+static size_t buffer_newlines(Buffer *b) {
+    if (!b) return 0;
+    if (b->engine == ENGINE_ROPE) return rope_lines(b->rope);
+    return b->pieces ? pieces_count_lines(b, b->pieces) : 0;
+}
+
+static size_t buffer_line_count(Buffer *b) {
+    return buffer_newlines(b) + 1;
+}
+
+// offset where line (from 0) starts; the length for lines past the end
+static size_t buffer_line_start(Buffer *b, size_t line) {
+    if (!b || line == 0) return 0;
+    if (line > buffer_newlines(b)) return b->length;
+    if (b->engine == ENGINE_ROPE) return rope_nth_newline(b->rope, line) + 1;
+    // the piece holding the line-th '\n'
+    PieceNode *t = b->pieces;
+    size_t off = 0;
+    while (!piece_is_leaf(t)) {
+        if (line <= t->left->lines) {
+            t = t->left;
+        } else {
+            line -= t->left->lines;
+            off += t->left->bytes;
+            t = t->right;
+        }
+    }
+    return off + piece_nth_newline(b, t, line) + 1;
+}
+
+// line (from 0) holding offset pos
+static size_t buffer_line_of(Buffer *b, size_t pos) {
+    if (!b) return 0;
+    if (pos >= b->length) return buffer_newlines(b);
+    if (b->engine == ENGINE_ROPE) return rope_newlines_before(b->rope, pos);
+    pieces_count_lines(b, b->pieces);
+    PieceNode *t = b->pieces;
+    size_t c = 0;
+    while (!piece_is_leaf(t)) {
+        if (pos < t->left->bytes) {
+            t = t->left;
+        } else {
+            c += t->left->lines;
+            pos -= t->left->bytes;
+            t = t->right;
+        }
+    }
+    return c + piece_newlines(b, t, pos);
+}
+
+// A read-only copy of b as it is now, for readers on other threads. The
+// rope or piece tree is shared outright, and so is the text the pieces
+// point into. b can go on changing: its edits only append to the add blocks
+// and build new nodes, never touching what the copy uses. Taking and
+// freeing copies must not race with edits to b (reference counts).
+static Buffer *buffer_freeze(Buffer *b) {
+    Buffer *f = (Buffer *)calloc(1, sizeof(Buffer));
+    if (!f) return NULL;
+    f->engine = b->engine;
+    f->frozen = 1;
+    f->version = b->version;
+    f->length = b->length;
+    f->cursor = b->cursor;
+    if (b->engine == ENGINE_ROPE) {
+        f->rope = rope_ref(b->rope);
+        return f;
+    }
+    // line counts are filled in now, so readers sharing the nodes never
+    // write to them, and b's later edits only count nodes of their own
+    buffer_newlines(b);
+    f->pieces = piece_ref(b->pieces);
+    f->store = b->store;
+    f->store->refs++;
+    f->orig_text = b->orig_text;
+    f->orig_len = b->orig_len;
+    f->orig_blocks = b->orig_blocks;
+    return f;
+}
+
+// insert n bytes at pos; cursors at or after pos shift
+static int buffer_insert_at(Buffer *b, size_t pos, const char *s, size_t n) {
+    if (!b || !s || n == 0) return 0;
+    if (pos > b->length) pos = b->length;
+    b->version++;
+
+    if (b->engine == ENGINE_ROPE) {
+        b->rope = rope_insert(b->rope, pos, s, n);
+        b->length = rope_bytes(b->rope);
+        buffer_shift_cursors(b, pos, 0, n);
+        return 1;
+    }
+
+    // typing straight after the last insertion: grow that piece in place,
+    // along with the counts above it, unless a frozen copy shares the path
+    if (pos > 0) {
+        PieceNode *path[PIECE_PATH_MAX];
+        int depth = 0;
+        PieceNode *t = b->pieces;
+        size_t start = 0;
+        while (t->refs == 1 && !piece_is_leaf(t) && depth < PIECE_PATH_MAX - 1) {
+            path[depth++] = t;
+            if (pos - 1 - start < t->left->bytes) {
+                t = t->left;
+            } else {
+                start += t->left->bytes;
+                t = t->right;
+            }
+        }
+        if (t->refs == 1 && piece_is_leaf(t) && start + t->bytes == pos
+            && add_buffer_is_tail(b, t->text + t->bytes)
+            && b->store->add->cap - b->store->add->used >= n) {
+            add_buffer_append(b, s, n);
+            size_t nl = count_newlines(s, n);
+            path[depth++] = t;
+            for (int k = 0; k < depth; ++k) {
+                path[k]->bytes += n;
+                if (path[k]->lines != LINES_UNKNOWN) path[k]->lines += nl;
+            }
+            b->length += n;
+            buffer_shift_cursors(b, pos, 0, n);
+            return 1;
+        }
+    }
+
+    const char *text = add_buffer_append(b, s, n);
+    if (!text) return 0;
+    PieceNode *ins = piece_leaf(text, n);
+    if (!ins) return 0;
+    PieceNode *l, *r;
+    pieces_split(b->pieces, pos, &l, &r);
+    b->pieces = pieces_concat(pieces_concat(l, ins), r);
+    b->length += n;
+    buffer_shift_cursors(b, pos, 0, n);
+    return 1;
+}
+
+// remove n bytes at pos; cursors are pulled back with the text
+static int buffer_delete_range(Buffer *b, size_t pos, size_t n) {
+    if (!b || pos >= b->length || n == 0) return 0;
+    if (n > b->length - pos) n = b->length - pos;
+    b->version++;
+    if (b->engine == ENGINE_ROPE) {
+        b->rope = rope_delete(b->rope, pos, n);
+        b->length = rope_bytes(b->rope);
+        buffer_shift_cursors(b, pos, n, 0);
+        return 1;
+    }
+    PieceNode *l, *rest, *mid, *r;
+    pieces_split(b->pieces, pos, &l, &rest);
+    pieces_split(rest, n, &mid, &r);
+    piece_release(mid);
+    b->pieces = pieces_concat(l, r);
+    b->length -= n;
+    buffer_shift_cursors(b, pos, n, 0);
+    return 1;
+}
+
+// One replacement of a batch: rlen bytes at pos (in the text as it was
+// before the batch) become ins[0, ilen).
+typedef struct BufferEdit {
+    size_t pos;
+    size_t rlen;
+    const char *ins;
+    size_t ilen;
+} BufferEdit;
+
+// move the sorted positions c[0, nc) through a sorted batch of edits
+static void shift_sorted(size_t *c, size_t nc, const BufferEdit *e, size_t n) {
+    long long shift = 0;
+    size_t i = 0;
+    for (size_t k = 0; k < nc; ++k) {
+        while (i < n && c[k] >= e[i].pos + e[i].rlen) {
+            shift += (long long)e[i].ilen - (long long)e[i].rlen;
+            i++;
+        }
+        size_t at = i < n && c[k] > e[i].pos ? e[i].pos : c[k];
+        c[k] = (size_t)((long long)at + shift);
+    }
+}
+
+static void buffer_shift_cursors_batch(Buffer *b, const BufferEdit *e, size_t n) {
+    shift_sorted(&b->cursor, 1, e, n);
+    shift_sorted(b->carets, b->ncarets, e, n);
+    carets_dedupe(b);
+}
+
+// Apply edits sorted by pos and not overlapping in a single pass: the rope
+// or piece tree is cut and rejoined once per edit. New pieces point at the
+// old text and at the inserted strings, so no copy of the document is made.
+// Returns 0 when out of memory (nothing changed).
+static int buffer_apply_edits(Buffer *b, const BufferEdit *e, size_t n) {
+    if (!b || n == 0) return 1;
+    b->version++;
+    if (b->engine == ENGINE_ROPE) {
+        RopeNode *out = NULL, *rest = b->rope, *l, *mid;
+        size_t consumed = 0;
+        for (size_t i = 0; i < n; ++i) {
+            rope_split(rest, e[i].pos - consumed, &l, &rest);
+            rope_split(rest, e[i].rlen, &mid, &rest);
+            rope_release(mid);
+            out = rope_join(out, l);
+            if (e[i].ilen) out = rope_join(out, rope_build(e[i].ins, e[i].ilen));
+            consumed = e[i].pos + e[i].rlen;
+        }
+        b->rope = rope_join(out, rest);
+        b->length = rope_bytes(b->rope);
+        buffer_shift_cursors_batch(b, e, n);
+        return 1;
+    }
+
+    // copy the inserted strings first, so running out of memory changes nothing
+    const char **texts = (const char **)malloc(sizeof(const char *) * n);
+    if (!texts) return 0;
+    for (size_t i = 0; i < n; ++i) {
+        texts[i] = e[i].ilen ? add_buffer_append(b, e[i].ins, e[i].ilen) : NULL;
+        if (e[i].ilen && !texts[i]) { free(texts); return 0; }
+    }
+    PieceNode *out = NULL, *rest = b->pieces, *l, *mid;
+    size_t consumed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        pieces_split(rest, e[i].pos - consumed, &l, &rest);
+        pieces_split(rest, e[i].rlen, &mid, &rest);
+        piece_release(mid);
+        out = pieces_concat(out, l);
+        if (e[i].ilen) out = pieces_concat(out, piece_leaf(texts[i], e[i].ilen));
+        consumed = e[i].pos + e[i].rlen;
+    }
+    free(texts);
+    b->pieces = pieces_concat(out, rest);
+    b->length = piece_bytes(b->pieces);
+    buffer_shift_cursors_batch(b, e, n);
+    return 1;
+}
+
+
+// Document state. In one-shot mode it lives for a single command; with
+// --serve it stays resident between commands. buf is the text the current
+// thread works on: the active document's buffer, or for a reader with
+// --listen, a frozen version of it.
+static THREAD_LOCAL Buffer *buf;
+static int serve_mode = 0;
+static int binary_mode = 0;     // serve the binary framed protocol
+
+// Thread pool. parallel_for() runs fn(ctx, i, worker) for every i in
+// [0, count) on the pool's threads plus the calling one. Each worker starts
+// with an equal slice of the range; a worker that runs dry steals the upper
+// half of the largest slice it finds, so uneven tasks still balance. Only
+// one parallel_for runs at a time, and it returns once every task is done.
+typedef void (*TaskFn)(void *ctx, size_t i, int worker);
+
+typedef struct PoolWorker {
+    Thread thread;
+    CRITICAL_SECTION lock;  // guards lo and hi
+    size_t lo, hi;          // tasks not yet taken
+} PoolWorker;
+
+static int pool_threads = 0;        // --threads=N; 0 means one per CPU
+static int pool_size = 0;           // workers including the caller
+static PoolWorker *pool_workers;
+static CRITICAL_SECTION pool_lock;
+static CONDITION_VARIABLE pool_wake, pool_done;
+static unsigned long pool_gen;      // bumped for every job
+static int pool_busy;               // helper threads still working on the job
+static int pool_stopping;
+static TaskFn pool_fn;
+static void *pool_ctx;
+
+static int pool_take(PoolWorker *w, size_t *i) {
+    int ok = 0;
+    EnterCriticalSection(&w->lock);
+    if (w->lo < w->hi) { *i = w->lo++; ok = 1; }
+    LeaveCriticalSection(&w->lock);
+    return ok;
+}
+
+// move the upper half of the fullest other slice into w's
+static int pool_steal(int self) {
+    int victim = -1;
+    size_t most = 0;
+    for (int v = 0; v < pool_size; ++v) {
+        if (v == self) continue;
+        EnterCriticalSection(&pool_workers[v].lock);
+        size_t left = pool_workers[v].hi - pool_workers[v].lo;
+        LeaveCriticalSection(&pool_workers[v].lock);
+        if (left > most) { most = left; victim = v; }
+    }
+    if (victim < 0) return 0;
+    PoolWorker *v = &pool_workers[victim];
+    size_t lo = 0, hi = 0;
+    EnterCriticalSection(&v->lock);
+    if (v->lo < v->hi) {
+        hi = v->hi;
+        lo = v->hi - (v->hi - v->lo + 1) / 2;
+        v->hi = lo;
+    }
+    LeaveCriticalSection(&v->lock);
+    if (lo == hi) return 1;     // emptied meanwhile; look again
+    PoolWorker *w = &pool_workers[self];
+    EnterCriticalSection(&w->lock);
+    w->lo = lo;
+    w->hi = hi;
+    LeaveCriticalSection(&w->lock);
+    return 1;
+}
+
+static void pool_run(int self) {
+    size_t i;
+    for (;;) {
+        while (pool_take(&pool_workers[self], &i)) pool_fn(pool_ctx, i, self);
+        if (!pool_steal(self)) break;
+    }
+}
+
+static DWORD WINAPI pool_main(LPVOID arg) {
+    int self = (int)(size_t)arg;
+    unsigned long seen = 0;
+    EnterCriticalSection(&pool_lock);
+    for (;;) {
+        while (pool_gen == seen && !pool_stopping) SleepConditionVariableCS(&pool_wake, &pool_lock, INFINITE);
+        if (pool_stopping) break;
+        seen = pool_gen;
+        LeaveCriticalSection(&pool_lock);
+        pool_run(self);
+        EnterCriticalSection(&pool_lock);
+        if (--pool_busy == 0) WakeAllConditionVariable(&pool_done);
+    }
+    LeaveCriticalSection(&pool_lock);
+    return 0;
+}
+
+static void pool_start() {
+    int n = pool_threads;
+    if (n <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        n = (int)si.dwNumberOfProcessors;
+    }
+    if (n < 1) n = 1;
+    if (n > 256) n = 256;
+    pool_workers = (PoolWorker *)calloc((size_t)n, sizeof(PoolWorker));
+    if (!pool_workers) { pool_size = 1; return; }
+    InitializeCriticalSection(&pool_lock);
+    InitializeConditionVariable(&pool_wake);
+    InitializeConditionVariable(&pool_done);
+    pool_size = 1;
+    InitializeCriticalSection(&pool_workers[0].lock);
+    for (int i = 1; i < n; ++i) {
+        InitializeCriticalSection(&pool_workers[i].lock);
+        pool_workers[i].thread = thread_start(pool_main, (LPVOID)(size_t)i);
+        if (!pool_workers[i].thread) { DeleteCriticalSection(&pool_workers[i].lock); break; }
+        pool_size++;
+    }
+}
+
+static void parallel_for(size_t count, TaskFn fn, void *ctx) {
+    if (!pool_size) pool_start();
+    if (pool_size == 1 || count < 2) {
+        for (size_t i = 0; i < count; ++i) fn(ctx, i, 0);
+        return;
+    }
+    pool_fn = fn;
+    pool_ctx = ctx;
+    for (int w = 0; w < pool_size; ++w) {
+        pool_workers[w].lo = count * (size_t)w / (size_t)pool_size;
+        pool_workers[w].hi = count * (size_t)(w + 1) / (size_t)pool_size;
+    }
+    EnterCriticalSection(&pool_lock);
+    pool_busy = pool_size - 1;
+    pool_gen++;
+    WakeAllConditionVariable(&pool_wake);
+    LeaveCriticalSection(&pool_lock);
+    pool_run(0);
+    EnterCriticalSection(&pool_lock);
+    while (pool_busy > 0) SleepConditionVariableCS(&pool_done, &pool_lock, INFINITE);
+    LeaveCriticalSection(&pool_lock);
+}
+
+static void pool_stop() {
+    if (pool_size <= 1 && !pool_workers) return;
+    if (pool_size > 1) {
+        EnterCriticalSection(&pool_lock);
+        pool_stopping = 1;
+        WakeAllConditionVariable(&pool_wake);
+        LeaveCriticalSection(&pool_lock);
+        for (int i = 1; i < pool_size; ++i) thread_join(pool_workers[i].thread);
+    }
+    for (int i = 0; i < pool_size; ++i) DeleteCriticalSection(&pool_workers[i].lock);
+    DeleteCriticalSection(&pool_lock);
+    free(pool_workers);
+    pool_workers = NULL;
+    pool_size = 0;
+}
+
+// Tokenizer. A word is a maximal run of ASCII letters and digits (isalnum in
+// the C locale). The text is classified 64 bytes at a time into a bitmask of
+// word bytes, with AVX2 or SSE2 when the CPU has them (picked at first use)
+// and a scalar loop otherwise; word starts and ends are then the bit
+// transitions of the mask.
+typedef void (*TokenFn)(void *ctx, const char *word, size_t len, size_t off);
+
+static int ctz64(unsigned long long x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+static unsigned long long word_mask_scalar(const char *p, size_t n) {
+    unsigned long long m = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (isalnum((unsigned char)p[i])) m |= 1ULL << i;
+    return m;
+}
+
+#ifdef HAVE_X86_SIMD
+// bytes in [lo, lo+span) compare below lo's bias after shifting the range
+// down to -128, which sidesteps the lack of unsigned byte compares
+static __m128i sse2_in_range(__m128i v, char lo, char span) {
+    __m128i t = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - lo)));
+    return _mm_cmplt_epi8(t, _mm_set1_epi8((char)(0x80 + span)));
+}
+
+static unsigned long long word_mask_sse2(const char *p) {
+    unsigned long long m = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i digit = sse2_in_range(v, '0', 10);
+        __m128i alpha = sse2_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 26);
+        m |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_or_si128(digit, alpha)) << i;
+    }
+    return m;
+}
+
+TARGET_AVX2 static __m256i avx2_in_range(__m256i v, char lo, char span) {
+    __m256i t = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - lo)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + span)), t);
+}
+
+TARGET_AVX2 static unsigned long long word_mask_avx2(const char *p) {
+    unsigned long long m = 0;
+    for (int i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i digit = avx2_in_range(v, '0', 10);
+        __m256i alpha = avx2_in_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 26);
+        m |= (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) << i;
+    }
+    return m;
+}
+
+static int cpu_has_avx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    // the OS must save the ymm registers
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifndef HAVE_X86_SIMD
+static unsigned long long word_mask_scalar64(const char *p) {
+    return word_mask_scalar(p, 64);
+}
+#endif
+
+static unsigned long long (*word_mask64)(const char *p);
+
+static void tokenizer_init() {
+#ifdef HAVE_X86_SIMD
+    word_mask64 = cpu_has_avx2() ? word_mask_avx2 : word_mask_sse2;
+#else
+    word_mask64 = word_mask_scalar64;
+#endif
+}
+
+// call fn for every word of text[0, n), in order
+static void tokenize(const char *text, size_t n, TokenFn fn, void *ctx) {
+    if (!word_mask64) tokenizer_init();
+    unsigned long long carry = 0;   // 1 if the previous block ended inside a word
+    size_t start = 0;
+    for (size_t base = 0; base < n; base += 64) {
+        unsigned long long m = n - base >= 64 ? word_mask64(text + base)
+                                              : word_mask_scalar(text + base, n - base);
+        unsigned long long prev = (m << 1) | carry;
+        unsigned long long edges = m ^ prev;    // starts and ends alternate
+        while (edges) {
+            int bit = ctz64(edges);
+            edges &= edges - 1;
+            if (m >> bit & 1) start = base + bit;
+            else fn(ctx, text + start, base + bit - start, start);
+        }
+        carry = m >> 63;
+    }
+    if (carry) fn(ctx, text + start, n - start, start);
+}
+
+// Word index. The document is split into segments of roughly
+// INDEX_SEGMENT_BYTES that end just after a non-word character, so no word
+// crosses a segment boundary. Each segment keeps its tokens as offsets
+// relative to its own start, which means an edit only invalidates the
+// segments it touches and shifts the start of the ones after it; dirty
+// segments are retokenized the next time the index is queried.
+//
+// Distinct words are entries in a flat array, found through an
+// open-addressing hash table; tokens refer to them by id. Word strings,
+// the per-word segment lists and the sorted tree all live in one arena that
+// is dropped as a whole when the index is rebuilt.
+#define INDEX_SEGMENT_BYTES 8192
+
+struct IndexSegment;
+
+typedef struct IndexRef {
+    struct IndexSegment *seg;
+    int word;               // entry in seg->words
+} IndexRef;
+
+typedef struct WordEntry {
+    const char *word;       // interned in the index arena
+    unsigned int len;
+    unsigned int hash;
+    int pos_count;          // occurrences in the whole document
+    int ref_count, ref_cap;
+    IndexRef *refs;         // segments holding the word
+} WordEntry;
+
+typedef struct IndexToken {
+    unsigned int word;
+    unsigned int off;
+} IndexToken;
+
+typedef struct SegWord {
+    unsigned int word;
+    int count;
+    int slot;               // entry in the word's refs pointing back here
+} SegWord;
+
+typedef struct IndexSegment {
+    size_t len;
+    int idx;                // position in word_index.segs
+    int dirty;
+    IndexToken *toks;
+    int tok_count, tok_cap;
+    SegWord *words;         // distinct words of the segment
+    int word_count, word_cap;
+} IndexSegment;
+
+typedef struct WordIndex {
+    Arena arena;
+    WordEntry *words;
+    unsigned int word_count, word_cap;
+    unsigned int live;      // entries that still occur somewhere
+    unsigned int *table;    // entry id + 1, 0 when empty
+    size_t table_cap;       // power of two
+    AVLNode *root;
+    IndexSegment **segs;
+    size_t *starts;         // document offset of each segment
+    int count, cap;
+    int dirty;              // some segment needs retokenizing
+    int failed;             // ran out of memory while tokenizing
+    unsigned long long version;     // text version of the last full refresh
+} WordIndex;
+
+static WordIndex word_index;
+
+static int is_word_char(char c) {
+    return isalnum((unsigned char)c) != 0;
+}
+
+// FNV-1a
+static unsigned int word_hash(const char *w, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char)w[i]) * 16777619u;
+    return h;
+}
+
+static int index_grow_table() {
+    WordIndex *ix = &word_index;
+    size_t cap = ix->table_cap ? ix->table_cap * 2 : 1024;
+    unsigned int *table = (unsigned int *)calloc(cap, sizeof(unsigned int));
+    if (!table) return 0;
+    for (unsigned int id = 0; id < ix->word_count; ++id) {
+        size_t i = ix->words[id].hash & (cap - 1);
+        while (table[i]) i = (i + 1) & (cap - 1);
+        table[i] = id + 1;
+    }
+    free(ix->table);
+    ix->table = table;
+    ix->table_cap = cap;
+    return 1;
+}
+
+// slot of the table that holds the word, or the empty slot it would take
+static size_t index_probe(const char *w, size_t len, unsigned int h) {
+    WordIndex *ix = &word_index;
+    size_t mask = ix->table_cap - 1;
+    size_t i = h & mask;
+    while (ix->table[i]) {
+        WordEntry *e = &ix->words[ix->table[i] - 1];
+        if (e->hash == h && e->len == len && memcmp(e->word, w, len) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// id of the word's entry, adding it if needed; -1 when out of memory
+static long index_intern_hashed(const char *w, size_t len, unsigned int h) {
+    WordIndex *ix = &word_index;
+    if ((size_t)ix->word_count * 2 >= ix->table_cap && !index_grow_table()) return -1;
+    size_t slot = index_probe(w, len, h);
+    if (ix->table[slot]) return (long)ix->table[slot] - 1;
+
+    if (ix->word_count == ix->word_cap) {
+        unsigned int cap = ix->word_cap ? ix->word_cap * 2 : 1024;
+        WordEntry *tmp = (WordEntry *)realloc(ix->words, sizeof(WordEntry) * cap);
+        if (!tmp) return -1;
+        ix->words = tmp;
+        ix->word_cap = cap;
+    }
+    char *copy = (char *)arena_alloc(&ix->arena, len + 1);
+    if (!copy) return -1;
+    memcpy(copy, w, len);
+    copy[len] = '\0';
+    unsigned int id = ix->word_count;
+    AVLNode *root = insert(&ix->arena, ix->root, copy, len, id);
+    if (!root) return -1;
+    ix->root = root;
+    WordEntry *e = &ix->words[id];
+    memset(e, 0, sizeof(*e));
+    e->word = copy;
+    e->len = (unsigned int)len;
+    e->hash = h;
+    ix->table[slot] = id + 1;
+    ix->word_count++;
+    stat_add(STAT_INDEX_WORDS, 1);
+    return id;
+}
+
+static long index_intern(const char *w, size_t len) {
+    return index_intern_hashed(w, len, word_hash(w, len));
+}
+
+// id of a word already in the index, or -1
+static long index_find(const char *w, size_t len) {
+    WordIndex *ix = &word_index;
+    if (!ix->table_cap) return -1;
+    size_t slot = index_probe(w, len, word_hash(w, len));
+    return ix->table[slot] ? (long)ix->table[slot] - 1 : -1;
+}
+
+// drop a segment's tokens from the word counts
+static void index_retract(IndexSegment *seg) {
+    for (int i = 0; i < seg->word_count; ++i) {
+        SegWord *w = &seg->words[i];
+        WordEntry *e = &word_index.words[w->word];
+        e->pos_count -= w->count;
+        if (e->pos_count == 0) word_index.live--;
+        IndexRef last = e->refs[--e->ref_count];
+        if (w->slot != e->ref_count) {
+            e->refs[w->slot] = last;
+            last.seg->words[last.word].slot = w->slot;
+        }
+    }
+    seg->word_count = 0;
+    seg->tok_count = 0;
+}
+
+static void index_segment_free(IndexSegment *seg) {
+    if (!seg) return;
+    free(seg->toks);
+    free(seg->words);
+    free(seg);
+}
+
+// add seg->words[k] to its entry's list of segments
+static int index_link(IndexSegment *seg, int k) {
+    SegWord *w = &seg->words[k];
+    WordEntry *e = &word_index.words[w->word];
+    if (e->ref_count == e->ref_cap) {
+        // the old list stays in the arena until the next rebuild
+        int cap = e->ref_cap ? e->ref_cap * 2 : 2;
+        IndexRef *tmp = (IndexRef *)arena_alloc(&word_index.arena, sizeof(IndexRef) * cap);
+        if (!tmp) return 0;
+        if (e->ref_count) memcpy(tmp, e->refs, sizeof(IndexRef) * e->ref_count);
+        e->refs = tmp;
+        e->ref_cap = cap;
+    }
+    w->slot = e->ref_count;
+    e->refs[e->ref_count].seg = seg;
+    e->refs[e->ref_count].word = k;
+    e->ref_count++;
+    if (e->pos_count == 0) word_index.live++;
+    e->pos_count += w->count;
+    return 1;
+}
+
+static int seg_push_word(IndexSegment *seg, unsigned int word) {
+    if (seg->word_count == seg->word_cap) {
+        int cap = seg->word_cap ? seg->word_cap * 2 : 32;
+        SegWord *tmp = (SegWord *)realloc(seg->words, sizeof(SegWord) * cap);
+        if (!tmp) return 0;
+        seg->words = tmp;
+        seg->word_cap = cap;
+    }
+    SegWord *w = &seg->words[seg->word_count++];
+    w->word = word;
+    w->count = 1;
+    w->slot = -1;
+    return 1;
+}
+
+static int seg_push_token(IndexSegment *seg, unsigned int word, size_t off) {
+    if (seg->tok_count == seg->tok_cap) {
+        int cap = seg->tok_cap ? seg->tok_cap * 2 : 64;
+        IndexToken *tmp = (IndexToken *)realloc(seg->toks, sizeof(IndexToken) * cap);
+        if (!tmp) return 0;
+        seg->toks = tmp;
+        seg->tok_cap = cap;
+    }
+    seg->toks[seg->tok_count].word = word;
+    seg->toks[seg->tok_count].off = (unsigned int)off;
+    seg->tok_count++;
+    return 1;
+}
+
+static int index_add_token(IndexSegment *seg, const char *word, size_t len, size_t off) {
+    long id = index_intern(word, len);
+    if (id < 0) return 0;
+    WordEntry *e = &word_index.words[id];
+    // tokens of one segment are added together, so a repeated word is
+    // always the entry's newest ref
+    if (e->ref_count > 0 && e->refs[e->ref_count - 1].seg == seg) {
+        seg->words[e->refs[e->ref_count - 1].word].count++;
+        e->pos_count++;
+    } else {
+        if (!seg_push_word(seg, (unsigned int)id)) return 0;
+        if (!index_link(seg, seg->word_count - 1)) { seg->word_count--; return 0; }
+    }
+    return seg_push_token(seg, (unsigned int)id, off);
+}
+
+static void index_token(void *ctx, const char *word, size_t len, size_t off) {
+    if (!index_add_token((IndexSegment *)ctx, word, len, off)) word_index.failed = 1;
+}
+
+// Runs of at least PARALLEL_INDEX_BYTES are tokenized on the thread pool.
+// Workers index whole segments against private vocabularies; the caller
+// then interns each private word once, the workers rewrite their tokens to
+// the shared ids, and the caller links the segments into the word entries.
+#define PARALLEL_INDEX_BYTES (1024 * 1024)
+
+typedef struct LocalWord {
+    const char *word;       // points into the run's text
+    unsigned int len;
+    unsigned int hash;
+    size_t stamp;           // segment that last saw the word, plus one
+    int slot;               // its entry in that segment's words
+} LocalWord;
+
+typedef struct LocalVocab {
+    LocalWord *words;
+    unsigned int count, cap;
+    unsigned int *table;    // word id + 1, 0 when empty
+    size_t table_cap;
+    long *global;           // shared id of each word
+    int failed;
+} LocalVocab;
+
+typedef struct IndexRun {
+    IndexSegment **segs;
+    const char *text;
+    const size_t *offs;     // where each segment starts in text
+    int *owner;             // worker that tokenized each segment
+    LocalVocab *vocab;      // one per worker
+} IndexRun;
+
+typedef struct LocalTokenCtx {
+    IndexSegment *seg;
+    LocalVocab *v;
+    size_t stamp;
+} LocalTokenCtx;
+
+static long local_intern(LocalVocab *v, const char *w, size_t len) {
+    if ((size_t)v->count * 2 >= v->table_cap) {
+        size_t cap = v->table_cap ? v->table_cap * 2 : 1024;
+        unsigned int *table = (unsigned int *)calloc(cap, sizeof(unsigned int));
+        if (!table) return -1;
+        for (unsigned int id = 0; id < v->count; ++id) {
+            size_t i = v->words[id].hash & (cap - 1);
+            while (table[i]) i = (i + 1) & (cap - 1);
+            table[i] = id + 1;
+        }
+        free(v->table);
+        v->table = table;
+        v->table_cap = cap;
+    }
+    unsigned int h = word_hash(w, len);
+    size_t mask = v->table_cap - 1, i = h & mask;
+    while (v->table[i]) {
+        LocalWord *lw = &v->words[v->table[i] - 1];
+        if (lw->hash == h && lw->len == len && memcmp(lw->word, w, len) == 0) return (long)v->table[i] - 1;
+        i = (i + 1) & mask;
+    }
+    if (v->count == v->cap) {
+        unsigned int cap = v->cap ? v->cap * 2 : 1024;
+        LocalWord *tmp = (LocalWord *)realloc(v->words, sizeof(LocalWord) * cap);
+        if (!tmp) return -1;
+        v->words = tmp;
+        v->cap = cap;
+    }
+    LocalWord *lw = &v->words[v->count];
+    lw->word = w;
+    lw->len = (unsigned int)len;
+    lw->hash = h;
+    lw->stamp = 0;
+    lw->slot = -1;
+    v->table[i] = v->count + 1;
+    return v->count++;
+}
+
+static void local_token(void *arg, const char *word, size_t len, size_t off) {
+    LocalTokenCtx *c = (LocalTokenCtx *)arg;
+    long id = local_intern(c->v, word, len);
+    if (id < 0) { c->v->failed = 1; return; }
+    LocalWord *lw = &c->v->words[id];
+    if (lw->stamp == c->stamp) {
+        c->seg->words[lw->slot].count++;
+    } else {
+        if (!seg_push_word(c->seg, (unsigned int)id)) { c->v->failed = 1; return; }
+        lw->stamp = c->stamp;
+        lw->slot = c->seg->word_count - 1;
+    }
+    if (!seg_push_token(c->seg, (unsigned int)id, off)) c->v->failed = 1;
+}
+
+static void run_tokenize_task(void *arg, size_t i, int worker) {
+    IndexRun *run = (IndexRun *)arg;
+    LocalTokenCtx c = { run->segs[i], &run->vocab[worker], i + 1 };
+    run->owner[i] = worker;
+    tokenize(run->text + run->offs[i], run->segs[i]->len, local_token, &c);
+}
+
+static void run_remap_task(void *arg, size_t i, int worker) {
+    IndexRun *run = (IndexRun *)arg;
+    IndexSegment *seg = run->segs[i];
+    const long *global = run->vocab[run->owner[i]].global;
+    (void)worker;
+    for (int t = 0; t < seg->tok_count; ++t) seg->toks[t].word = (unsigned int)global[seg->toks[t].word];
+    for (int k = 0; k < seg->word_count; ++k) seg->words[k].word = (unsigned int)global[seg->words[k].word];
+}
+
+// returns 0 when out of memory; the segments are then left unlinked
+static int index_tokenize_parallel(IndexSegment **segs, int count, const char *text, const size_t *offs) {
+    if (!pool_size) pool_start();
+    int ok = 1;
+    IndexRun run = { segs, text, offs, NULL, NULL };
+    run.owner = (int *)malloc(sizeof(int) * (size_t)count);
+    run.vocab = (LocalVocab *)calloc((size_t)pool_size, sizeof(LocalVocab));
+    if (!run.owner || !run.vocab) ok = 0;
+    if (ok) parallel_for((size_t)count, run_tokenize_task, &run);
+    for (int w = 0; ok && w < pool_size; ++w) {
+        LocalVocab *v = &run.vocab[w];
+        if (v->failed || !(v->global = (long *)malloc(sizeof(long) * (v->count + 1)))) { ok = 0; break; }
+        for (unsigned int id = 0; id < v->count && ok; ++id) {
+            v->global[id] = index_intern_hashed(v->words[id].word, v->words[id].len, v->words[id].hash);
+            if (v->global[id] < 0) ok = 0;
+        }
+    }
+    if (ok) parallel_for((size_t)count, run_remap_task, &run);
+    for (int i = 0; i < count; ++i) {
+        if (!ok) { segs[i]->word_count = 0; continue; }
+        for (int k = 0; k < segs[i]->word_count && ok; ++k) {
+            if (!index_link(segs[i], k)) {
+                segs[i]->word_count = k;
+                ok = 0;
+            }
+        }
+    }
+    for (int w = 0; run.vocab && w < pool_size; ++w) {
+        free(run.vocab[w].words);
+        free(run.vocab[w].table);
+        free(run.vocab[w].global);
+    }
+    free(run.vocab);
+    free(run.owner);
+    return ok;
+}
+
+// index the run text[0, n) already cut into segs; 0 when out of memory
+static int index_tokenize_run(IndexSegment **segs, int count, const char *text, const size_t *offs, size_t n) {
+    if (n >= PARALLEL_INDEX_BYTES && count > 1) {
+        if (!pool_size) pool_start();
+        if (pool_size > 1) return index_tokenize_parallel(segs, count, text, offs);
+    }
+    word_index.failed = 0;
+    for (int i = 0; i < count && !word_index.failed; ++i)
+        tokenize(text + offs[i], segs[i]->len, index_token, segs[i]);
+    return !word_index.failed;
+}
+
+// replace segs[at, at+remove) with ins[0, n) and renumber what follows
+static int index_splice(int at, int remove, IndexSegment **ins, int n) {
+    WordIndex *ix = &word_index;
+    int count = ix->count - remove + n;
+    if (count > ix->cap) {
+        int cap = ix->cap ? ix->cap : 16;
+        while (cap < count) cap *= 2;
+        IndexSegment **segs = (IndexSegment **)realloc(ix->segs, sizeof(IndexSegment *) * cap);
+        if (!segs) return 0;
+        ix->segs = segs;
+        size_t *starts = (size_t *)realloc(ix->starts, sizeof(size_t) * cap);
+        if (!starts) return 0;
+        ix->starts = starts;
+        ix->cap = cap;
+    }
+    size_t start = at < ix->count ? ix->starts[at] : 0;
+    if (at >= ix->count && at > 0) start = ix->starts[at - 1] + ix->segs[at - 1]->len;
+    memmove(ix->segs + at + n, ix->segs + at + remove, sizeof(IndexSegment *) * (ix->count - at - remove));
+    if (n) memcpy(ix->segs + at, ins, sizeof(IndexSegment *) * n);
+    ix->count = count;
+    for (int i = at; i < count; ++i) {
+        ix->starts[i] = start;
+        ix->segs[i]->idx = i;
+        start += ix->segs[i]->len;
+    }
+    return 1;
+}
+
+// segment holding offset pos; the end of the document belongs to the last one
+static int index_segment_at(size_t pos) {
+    int lo = 0, hi = word_index.count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (word_index.starts[mid] <= pos) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+static IndexSegment *index_segment_new(size_t len) {
+    IndexSegment *seg = (IndexSegment *)calloc(1, sizeof(IndexSegment));
+    if (seg) {
+        seg->len = len;
+        seg->dirty = 1;
+    }
+    return seg;
+}
+
+// forget everything and index the whole document on the next query
+static void index_reset() {
+    WordIndex *ix = &word_index;
+    for (int i = 0; i < ix->count; ++i) index_segment_free(ix->segs[i]);
+    arena_release(&ix->arena);
+    free(ix->table);
+    ix->table = NULL;
+    ix->table_cap = 0;
+    ix->word_count = ix->live = 0;
+    ix->root = NULL;
+    ix->count = 0;
+    IndexSegment *seg = index_segment_new(buf ? buffer_length(buf) : 0);
+    if (seg) index_splice(0, 0, &seg, 1);
+    ix->dirty = 1;
+}
+
+static void index_free() {
+    WordIndex *ix = &word_index;
+    for (int i = 0; i < ix->count; ++i) index_segment_free(ix->segs[i]);
+    arena_release(&ix->arena);
+    free(ix->table);
+    free(ix->words);
+    free(ix->segs);
+    free(ix->starts);
+    memset(ix, 0, sizeof(*ix));
+}
+
+// the text at [pos, pos+rlen) was replaced by ilen bytes
+static void index_edit(size_t pos, size_t rlen, size_t ilen) {
+    WordIndex *ix = &word_index;
+    if (ix->count == 0) {
+        IndexSegment *seg = index_segment_new(0);
+        if (!seg || !index_splice(0, 0, &seg, 1)) { index_segment_free(seg); return; }
+    }
+    int i = index_segment_at(pos);
+    int k = rlen ? index_segment_at(pos + rlen - 1) : i;
+    IndexSegment *seg = ix->segs[i];
+    index_retract(seg);
+    // a removal that spans segments folds them into the first one
+    for (int j = i + 1; j <= k; ++j) {
+        seg->len += ix->segs[j]->len;
+        index_retract(ix->segs[j]);
+        index_segment_free(ix->segs[j]);
+    }
+    if (k > i) index_splice(i + 1, k - i, NULL, 0);
+    seg->len = seg->len + ilen - rlen;
+    seg->dirty = 1;
+    ix->dirty = 1;
+    for (int j = i + 1; j < ix->count; ++j) ix->starts[j] = ix->starts[j] + ilen - rlen;
+}
+
+// Retokenize dirty segments, resplitting each dirty run into fresh
+// segments, until about budget bytes are done. A run longer than what is
+// left of the budget is indexed up to a word boundary and the rest stays
+// dirty, so the background worker never holds the index for long.
+static void index_retokenize(size_t budget) {
+    WordIndex *ix = &word_index;
+    // words that no longer occur are only dropped by a rebuild
+    if (ix->word_count > 65536 && ix->live < ix->word_count / 4) index_reset();
+    ix->dirty = 0;
+    int i = 0;
+    size_t done = 0;
+    while (i < ix->count) {
+        if (done >= budget) { ix->dirty = 1; return; }
+        if (!ix->segs[i]->dirty) { i++; continue; }
+        int end = i;
+        size_t start = ix->starts[i];
+        size_t stop = start + ix->segs[i]->len;
+        // extend over following dirty segments, and over clean ones while the
+        // run would end inside a word
+        while (end + 1 < ix->count
+               && (ix->segs[end + 1]->dirty || (stop > start && is_word_char(buffer_char_at(buf, stop - 1))))) {
+            end++;
+            if (!ix->segs[end]->dirty) index_retract(ix->segs[end]);
+            stop += ix->segs[end]->len;
+        }
+        size_t n = stop - start, rest = 0;
+        if (n > budget - done) {
+            size_t cut = start + (budget - done);
+            while (cut < stop && is_word_char(buffer_char_at(buf, cut - 1))) cut++;
+            rest = stop - cut;
+            n = cut - start;
+        }
+        char *text = (char *)malloc(n + 1);
+        if (!text) { ix->dirty = 1; return; }
+        buffer_copy_range(buf, start, n, text);
+
+        // segments never hold fewer than INDEX_SEGMENT_BYTES except the last
+        // of a run; the unindexed rest of the run follows as one dirty segment
+        int cap = (int)(n / INDEX_SEGMENT_BYTES) + 2, made = 0;
+        IndexSegment **fresh = (IndexSegment **)malloc(sizeof(IndexSegment *) * cap);
+        size_t *offs = (size_t *)malloc(sizeof(size_t) * cap);
+        size_t at = 0;
+        while (fresh && offs && at < n) {
+            size_t cut = at + INDEX_SEGMENT_BYTES;
+            if (cut >= n) cut = n;
+            else while (cut < n && is_word_char(text[cut - 1])) cut++;
+            IndexSegment *seg = index_segment_new(cut - at);
+            if (!seg) break;
+            seg->dirty = 0;
+            offs[made] = at;
+            fresh[made++] = seg;
+            at = cut;
+        }
+        int ok = fresh && offs && at >= n && index_tokenize_run(fresh, made, text, offs, n);
+        IndexSegment *tail = ok && rest ? index_segment_new(rest) : NULL;
+        if (rest && !tail) ok = 0;
+        free(text);
+        free(offs);
+        if (!ok) {
+            // out of memory: leave the run dirty for the next query
+            for (int j = 0; j < made; ++j) { index_retract(fresh[j]); index_segment_free(fresh[j]); }
+            free(fresh);
+            ix->dirty = 1;
+            return;
+        }
+        for (int j = i; j <= end; ++j) index_segment_free(ix->segs[j]);
+        if (tail) {
+            fresh[made] = tail;
+            ix->dirty = 1;
+        }
+        index_splice(i, end - i + 1, fresh, made + (tail ? 1 : 0));
+        int tokens = 0;
+        for (int j = 0; j < made; ++j) tokens += fresh[j]->tok_count;
+        stat_add(STAT_INDEX_TOKENS, tokens);
+        stat_add(STAT_INDEX_BYTES, n);
+        free(fresh);
+        i += made;
+        done += n;
+    }
+    if (!ix->dirty) ix->version = buf->version;
+}
+
+static void index_refresh_some(size_t budget) {
+    if (!word_index.dirty) return;
+    StatTimer timer = stats_start(TIMER_INDEX_REFRESH);
+    index_retokenize(budget);
+    stats_stop(&timer, NULL);
+}
+
+static void index_refresh() {
+    index_refresh_some((size_t)-1);
+}
+
+// the text version the index is complete for
+static unsigned long long index_version() {
+    return word_index.dirty ? word_index.version : buf->version;
+}
+
+// entry for a word that occurs in the document, or NULL
+static WordEntry *index_lookup(const char *word, size_t len) {
+    index_refresh();
+    long id = index_find(word, len);
+    WordEntry *e = id >= 0 ? &word_index.words[id] : NULL;
+    return e && e->pos_count > 0 ? e : NULL;
+}
+
+static int cmp_ref_seg(const void *a, const void *b) {
+    int x = ((const IndexRef *)a)->seg->idx, y = ((const IndexRef *)b)->seg->idx;
+    return x < y ? -1 : x > y;
+}
+
+// Occurrences of frequent words are collected on the thread pool: with the
+// segment lists in document order and each segment's count known, every
+// task writes its own slice of the result.
+#define PARALLEL_POSITIONS 65536
+
+typedef struct PositionsJob {
+    IndexRef *refs;
+    size_t *first;          // where each ref's positions go
+    size_t *pos;
+    unsigned int id;
+} PositionsJob;
+
+static void positions_task(void *arg, size_t r, int worker) {
+    PositionsJob *job = (PositionsJob *)arg;
+    IndexSegment *seg = job->refs[r].seg;
+    int want = seg->words[job->refs[r].word].count;
+    size_t base = word_index.starts[seg->idx];
+    size_t *out = job->pos + job->first[r];
+    (void)worker;
+    for (int t = 0; t < seg->tok_count && want > 0; ++t) {
+        if (seg->toks[t].word != job->id) continue;
+        *out++ = base + seg->toks[t].off;
+        want--;
+    }
+}
+
+// sorted document offsets of every occurrence of e's word; caller frees
+static size_t *index_positions(WordEntry *e, size_t *count) {
+    PositionsJob job;
+    size_t n = 0;
+    job.id = (unsigned int)(e - word_index.words);
+    job.pos = (size_t *)malloc(sizeof(size_t) * (e->pos_count + 1));
+    job.refs = (IndexRef *)malloc(sizeof(IndexRef) * (e->ref_count + 1));
+    job.first = (size_t *)malloc(sizeof(size_t) * (e->ref_count + 1));
+    if (!job.pos || !job.refs || !job.first) {
+        free(job.pos);
+        free(job.refs);
+        free(job.first);
+        *count = 0;
+        return NULL;
+    }
+    memcpy(job.refs, e->refs, sizeof(IndexRef) * e->ref_count);
+    qsort(job.refs, e->ref_count, sizeof(IndexRef), cmp_ref_seg);
+    for (int r = 0; r < e->ref_count; ++r) {
+        job.first[r] = n;
+        n += (size_t)job.refs[r].seg->words[job.refs[r].word].count;
+    }
+    if (n >= PARALLEL_POSITIONS) parallel_for((size_t)e->ref_count, positions_task, &job);
+    else for (int r = 0; r < e->ref_count; ++r) positions_task(&job, (size_t)r, 0);
+    free(job.refs);
+    free(job.first);
+    *count = n;
+    return job.pos;
+}
+
+// Word queries. A pattern may use * (any run) and ? (any one character)
+// and is matched against whole words; only the range of the sorted tree
+// that shares the pattern's literal prefix is looked at.
+typedef struct WordHit {
+    size_t pos;
+    size_t len;
+} WordHit;
+
+static int glob_match(const char *pat, size_t plen, const char *w, size_t wlen, int fold) {
+    size_t p = 0, i = 0, star = (size_t)-1, mark = 0;
+    while (i < wlen) {
+        if (p < plen && (pat[p] == '?' || (fold ? tolower((unsigned char)pat[p]) == tolower((unsigned char)w[i])
+                                                : pat[p] == w[i]))) {
+            p++;
+            i++;
+        } else if (p < plen && pat[p] == '*') {
+            star = p++;
+            mark = i;
+        } else if (star != (size_t)-1) {
+            p = star + 1;
+            i = ++mark;
+        } else {
+            return 0;
+        }
+    }
+    while (p < plen && pat[p] == '*') p++;
+    return p == plen;
+}
+
+typedef struct WordQuery {
+    const char *pat;
+    size_t plen;
+    int fold;
+    WordHit *hits;
+    size_t count, cap;
+    int failed;
+} WordQuery;
+
+static void query_add(WordQuery *q, WordEntry *e) {
+    size_t n = 0;
+    size_t *pos = index_positions(e, &n);
+    if (q->count + n > q->cap) {
+        size_t cap = (q->count + n) * 2;
+        WordHit *tmp = (WordHit *)realloc(q->hits, sizeof(WordHit) * cap);
+        if (!tmp) { q->failed = 1; free(pos); return; }
+        q->hits = tmp;
+        q->cap = cap;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        q->hits[q->count + i].pos = pos[i];
+        q->hits[q->count + i].len = e->len;
+    }
+    q->count += n;
+    free(pos);
+}
+
+static void query_visit(void *arg, AVLNode *node) {
+    WordQuery *q = (WordQuery *)arg;
+    WordEntry *e = &word_index.words[node->id];
+    if (e->pos_count > 0 && !q->failed && glob_match(q->pat, q->plen, e->word, e->len, q->fold)) query_add(q, e);
+}
+
+static int cmp_hit_pos(const void *a, const void *b) {
+    size_t x = ((const WordHit *)a)->pos, y = ((const WordHit *)b)->pos;
+    return x < y ? -1 : x > y;
+}
+
+// every occurrence of every word matching pat, in document order; caller
+// frees. Returns NULL with *count 0 when nothing matches.
+static WordHit *index_match(const char *pat, size_t plen, int fold, size_t *count) {
+    StatTimer timer = stats_start(TIMER_INDEX_QUERY);
+    WordQuery q = { pat, plen, fold, NULL, 0, 0, 0 };
+    size_t lit = 0;
+    while (lit < plen && pat[lit] != '*' && pat[lit] != '?') lit++;
+    if (lit == plen && !fold) {
+        // plain word: straight from the hash table
+        WordEntry *e = index_lookup(pat, plen);
+        if (e) query_add(&q, e);
+    } else {
+        index_refresh();
+        avl_prefix_walk(word_index.root, pat, lit, query_visit, &q);
+        if (q.count > 0) qsort(q.hits, q.count, sizeof(WordHit), cmp_hit_pos);
+    }
+    if (q.failed || q.count == 0) { free(q.hits); q.hits = NULL; q.count = 0; }
+    *count = q.count;
+    stats_stop(&timer, NULL);
+    return q.hits;
+}
+
+// Autocomplete: the most frequent words starting with prefix (any case),
+// best first; ties keep alphabetical order
+typedef struct Completion {
+    AVLNode **best;
+    int count, limit;
+} Completion;
+
+static void completion_visit(void *arg, AVLNode *node) {
+    Completion *c = (Completion *)arg;
+    int freq = word_index.words[node->id].pos_count;
+    if (freq == 0) return;
+    int at = c->count;
+    while (at > 0 && word_index.words[c->best[at - 1]->id].pos_count < freq) at--;
+    if (at >= c->limit) return;
+    int last = c->count < c->limit ? c->count : c->limit - 1;
+    memmove(c->best + at + 1, c->best + at, sizeof(AVLNode *) * (last - at));
+    c->best[at] = node;
+    if (c->count < c->limit) c->count++;
+}
+
+// Editing through the history. history_begin() opens an undo unit (or keeps
+// extending the previous one while the user is just typing), doc_edit()
+// applies one change to the buffer and records it.
+static int typing_open = 0;     // cleared by any command that is not an edit
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void history_push_group(int kind, size_t cursor) {
+    memstack_clear(&redo_stack);
+    EditGroup g = { NULL, 0, 0, kind, cursor };
+    memstack_push(&undo_stack, &g);
+    if (journal && !journal_replaying) {
+        OutBuf o = {0};
+        put_u8(&o, (unsigned int)kind);
+        put_u64(&o, cursor);
+        journal_append(REC_BEGIN, &o);
+        out_free(&o);
+    }
+}
+
+static void history_begin(int kind) {
+    memstack_clear(&redo_stack);
+    EditGroup *top = memstack_top(&undo_stack);
+    if (kind != EDIT_OTHER && typing_open && top && top->kind == kind) return;
+    history_push_group(kind, buffer_cursor(buf));
+    typing_open = kind != EDIT_OTHER;
+}
+
+// try to fold a keystroke into the last op of the open typing group
+static int history_merge(size_t pos, const char *removed, size_t rlen,
+                         const char *inserted, size_t ilen) {
+    EditGroup *g = memstack_top(&undo_stack);
+    if (!typing_open || !g || g->count == 0) return 0;
+    EditOp *op = &g->ops[g->count - 1];
+    if (g->kind == EDIT_TYPING && rlen == 0 && op->rlen == 0 && op->pos + op->ilen == pos) {
+        // a new word after whitespace starts a new undo unit
+        if (op->ilen && is_space(op->inserted[op->ilen - 1]) && ilen && !is_space(inserted[0])) return 0;
+        char *tmp = arena_grow(&g->bytes, op->inserted, op->ilen, ilen);
+        if (!tmp) return 0;
+        memcpy(tmp + op->ilen, inserted, ilen);
+        op->inserted = tmp;
+        op->ilen += ilen;
+        op->inserted[op->ilen] = '\0';
+        return 1;
+    }
+    if (g->kind == EDIT_BACKSPACE && ilen == 0 && op->ilen == 0 && pos + rlen == op->pos) {
+        char *tmp = arena_grow(&g->bytes, op->removed, op->rlen, rlen);
+        if (!tmp) return 0;
+        memmove(tmp + rlen, tmp, op->rlen);
+        memcpy(tmp, removed, rlen);
+        tmp[op->rlen + rlen] = '\0';
+        op->removed = tmp;
+        op->rlen += rlen;
+        op->pos = pos;
+        return 1;
+    }
+    return 0;
+}
+
+static void history_record(size_t cursor_before, size_t pos, const char *removed, size_t rlen,
+                           const char *inserted, size_t ilen) {
+    EditGroup *g = memstack_top(&undo_stack);
+    // replayed journals already say where every unit begins
+    if (journal_replaying) {
+        if (g) edit_group_add(g, pos, removed, rlen, inserted, ilen);
+        return;
+    }
+    if (history_merge(pos, removed, rlen, inserted, ilen)) return;
+    if (g && g->count > 0 && g->kind != EDIT_OTHER) {
+        // the typing unit was closed by a word boundary: start a fresh one
+        history_push_group(g->kind, cursor_before);
+        g = memstack_top(&undo_stack);
+    }
+    if (g) edit_group_add(g, pos, removed, rlen, inserted, ilen);
+}
+
+// replace rlen bytes at pos with ins[0, ilen) and record it for undo
+static void doc_edit(size_t pos, size_t rlen, const char *ins, size_t ilen) {
+    size_t cursor_before = buffer_cursor(buf);
+    ArenaMark mark = arena_mark(&scratch);
+    char *removed = (char *)arena_take(&scratch, rlen + 1, 1);
+    if (!removed) return;
+    rlen = buffer_copy_range(buf, pos, rlen, removed);
+    if (rlen) buffer_delete_range(buf, pos, rlen);
+    if (ilen) buffer_insert_at(buf, pos, ins, ilen);
+    index_edit(pos, rlen, ilen);
+    history_record(cursor_before, pos, removed, rlen, ins, ilen);
+    journal_edit(pos, removed, rlen, ins, ilen);
+    arena_rewind(&scratch, mark);
+}
+
+// Groups with many ops (replace-all) are applied as one batch of buffer
+// edits; this needs ops that move strictly left to right.
+#define BULK_APPLY_OPS 64
+
+static int group_is_monotone(EditGroup *g) {
+    for (int i = 1; i < g->count; ++i)
+        if (g->ops[i].pos < g->ops[i-1].pos + g->ops[i-1].ilen) return 0;
+    return 1;
+}
+
+static void group_apply_bulk(EditGroup *g, int undo) {
+    BufferEdit *edits = (BufferEdit *)malloc(sizeof(BufferEdit) * g->count);
+    if (!edits) return;
+    long long shift = 0;    // redo: how far op positions moved past the source
+    for (int i = 0; i < g->count; ++i) {
+        EditOp *op = &g->ops[i];
+        if (undo) {
+            edits[i].pos = op->pos;
+            edits[i].rlen = op->ilen;
+            edits[i].ins = op->removed;
+            edits[i].ilen = op->rlen;
+        } else {
+            edits[i].pos = (size_t)((long long)op->pos - shift);
+            edits[i].rlen = op->rlen;
+            edits[i].ins = op->inserted;
+            edits[i].ilen = op->ilen;
+            shift += (long long)op->ilen - (long long)op->rlen;
+        }
+    }
+    buffer_apply_edits(buf, edits, (size_t)g->count);
+    free(edits);
+}
+
+static void group_apply(EditGroup *g, int undo) {
+    if (undo) {
+        for (int i = g->count - 1; i >= 0; --i) index_edit(g->ops[i].pos, g->ops[i].ilen, g->ops[i].rlen);
+    } else {
+        for (int i = 0; i < g->count; ++i) index_edit(g->ops[i].pos, g->ops[i].rlen, g->ops[i].ilen);
+    }
+    if (g->count > BULK_APPLY_OPS && group_is_monotone(g)) {
+        group_apply_bulk(g, undo);
+        return;
+    }
+    if (undo) {
+        for (int i = g->count - 1; i >= 0; --i) {
+            EditOp *op = &g->ops[i];
+            if (op->ilen) buffer_delete_range(buf, op->pos, op->ilen);
+            if (op->rlen) buffer_insert_at(buf, op->pos, op->removed, op->rlen);
+        }
+    } else {
+        for (int i = 0; i < g->count; ++i) {
+            EditOp *op = &g->ops[i];
+            if (op->rlen) buffer_delete_range(buf, op->pos, op->rlen);
+            if (op->ilen) buffer_insert_at(buf, op->pos, op->inserted, op->ilen);
+        }
+    }
+}
+
+// move one unit between the stacks; returns 0 if there was nothing to move
+static int history_step(MemStack *from, MemStack *to, int undo) {
+    EditGroup g;
+    if (!memstack_pop(from, &g)) return 0;
+    group_apply(&g, undo);
+    if (undo) {
+        buffer_set_cursor(buf, g.cursor);
+    } else if (g.count > 0) {
+        EditOp *last = &g.ops[g.count - 1];
+        buffer_set_cursor(buf, last->pos + last->ilen);
+    }
+    memstack_push(to, &g);
+    typing_open = 0;
+    journal_mark(undo ? REC_UNDO : REC_REDO);
+    return 1;
+}
+
+// Recovery and compaction
+
+static void put_group(OutBuf *o, EditGroup *g) {
+    put_u8(o, (unsigned int)g->kind);
+    put_u64(o, g->cursor);
+    put_u32(o, (unsigned long)g->count);
+    for (int i = 0; i < g->count; ++i) {
+        EditOp *op = &g->ops[i];
+        put_u64(o, op->pos);
+        put_u64(o, op->rlen);
+        put_u64(o, op->ilen);
+        out_write(o, op->removed, op->rlen);
+        out_write(o, op->inserted, op->ilen);
+    }
+}
+
+static int get_group(ByteReader *r, EditGroup *g) {
+    EditGroup empty = { NULL, 0, 0, EDIT_OTHER, 0 };
+    *g = empty;
+    g->kind = (int)get_uint(r, 1);
+    g->cursor = (size_t)get_uint(r, 8);
+    unsigned long count = (unsigned long)get_uint(r, 4);
+    for (unsigned long i = 0; i < count && r->ok; ++i) {
+        size_t pos = (size_t)get_uint(r, 8);
+        size_t rlen = (size_t)get_uint(r, 8);
+        size_t ilen = (size_t)get_uint(r, 8);
+        const char *removed = get_bytes(r, rlen);
+        const char *inserted = get_bytes(r, ilen);
+        if (r->ok) edit_group_add(g, pos, removed, rlen, inserted, ilen);
+    }
+    if (!r->ok) edit_group_free(g);
+    return r->ok;
+}
+
+static void journal_ops(EditGroup *g) {
+    if (!journal || journal_replaying) return;
+    OutBuf o = {0};
+    put_group(&o, g);
+    journal_append(REC_OPS, &o);
+    out_free(&o);
+}
+
+// cursor set: count, primary cursor, carets
+static void put_cursors(OutBuf *o) {
+    put_u32(o, (unsigned long)(buf->ncarets + 1));
+    put_u64(o, buf->cursor);
+    for (size_t i = 0; i < buf->ncarets; ++i) put_u64(o, buf->carets[i]);
+}
+
+static void get_cursors(ByteReader *r) {
+    unsigned long count = (unsigned long)get_uint(r, 4);
+    size_t primary = (size_t)get_uint(r, 8);
+    if (!r->ok || count == 0) return;
+    buffer_clear_carets(buf);
+    buffer_set_cursor(buf, primary);
+    for (unsigned long i = 1; i < count; ++i) {
+        size_t pos = (size_t)get_uint(r, 8);
+        if (!r->ok) break;
+        buffer_add_caret(buf, pos);
+    }
+}
+
+// End of a command: record where the cursors are if anything could have
+// moved them, then sync. Replaying the journal thus restores the cursors
+// along with the text, and a burst of edits costs one cursor record.
+static void journal_cursors() {
+    if (journal && cursor_dirty) {
+        OutBuf o = {0};
+        put_cursors(&o);
+        journal_append(REC_CURSOR, &o);
+        out_free(&o);
+        cursor_dirty = 0;
+    }
+}
+
+static int journal_commit() {
+    journal_cursors();
+    return journal_sync();
+}
+
+// edits that cannot be journaled are refused rather than lost on a crash
+static int edits_refused() {
+    if (!journal_failed) return 0;
+    out_puts(&reply, "Journal write failed; edits are disabled.");
+    return 1;
+}
+
+static void apply_record(int type, ByteReader *r) {
+    if (type == REC_BEGIN) {
+        int kind = (int)get_uint(r, 1);
+        size_t cursor = (size_t)get_uint(r, 8);
+        if (r->ok) history_push_group(kind, cursor);
+    } else if (type == REC_EDIT) {
+        size_t pos = (size_t)get_uint(r, 8);
+        size_t rlen = (size_t)get_uint(r, 8);
+        size_t ilen = (size_t)get_uint(r, 8);
+        get_bytes(r, rlen);
+        const char *inserted = get_bytes(r, ilen);
+        if (r->ok) doc_edit(pos, rlen, inserted, ilen);
+    } else if (type == REC_OPS) {
+        EditGroup g;
+        EditGroup *top = memstack_top(&undo_stack);
+        if (get_group(r, &g) && top) {
+            group_apply(&g, 0);
+            for (int i = 0; i < g.count; ++i) {
+                EditOp *op = &g.ops[i];
+                edit_group_add(top, op->pos, op->removed, op->rlen, op->inserted, op->ilen);
+            }
+        }
+        edit_group_free(&g);
+    } else if (type == REC_UNDO) {
+        history_step(&undo_stack, &redo_stack, 1);
+    } else if (type == REC_REDO) {
+        history_step(&redo_stack, &undo_stack, 0);
+    } else if (type == REC_CURSOR) {
+        get_cursors(r);
+    }
+}
+
+// returns -1 if the journal does not exist, 0 if it ends in a torn or
+// corrupt record, 1 if every record applied cleanly
+static int journal_replay(const char *path) {
+    size_t size = 0;
+    char *data = read_whole_file(path, &size);
+    if (!data) return -1;
+    ByteReader r = { data, data + size, 1 };
+    int clean = 1;
+    journal_replaying = 1;
+    while (r.p < r.end) {
+        int type = (int)get_uint(&r, 1);
+        size_t len = (size_t)get_uint(&r, 4);
+        unsigned int crc = (unsigned int)get_uint(&r, 4);
+        const char *payload = get_bytes(&r, len);
+        if (!r.ok || crc32_bytes(payload, len) != crc) { clean = 0; break; }
+        ByteReader pr = { payload, payload + len, 1 };
+        apply_record(type, &pr);
+    }
+    journal_replaying = 0;
+    free(data);
+    return clean;
+}
+
+// Block compression. A block stream holds bytes cut into BLOCK_BYTES
+// blocks, each compressed on its own (LZ4's block format: a token with
+// literal and match length nibbles, literals, a 16-bit back offset), or
+// stored as is when that does not make it smaller:
+//   raw length (u64) | block count (u32) | per block: stored size (u32,
+//   BLOCK_STORED set when not compressed) and crc32 of its decoded bytes
+//   (u32) | the blocks
+// The table up front gives every block's place without reading the others,
+// so blocks decode and are checked independently and in parallel. Streams
+// from MWPSNAP3 snapshots have sizes alone in the table.
+#define BLOCK_BYTES (64 * 1024)
+#define BLOCK_STORED 0x80000000u
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5      // a block always ends in this many literals
+#define LZ_MATCH_LIMIT 12       // no match starts closer to the end
+
+static unsigned int lz_hash(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// bytes at a and b that match, up to (not including) a_end
+static size_t lz_match_len(const unsigned char *a, const unsigned char *b, const unsigned char *a_end) {
+    const unsigned char *start = a;
+    while (a_end - a >= 8) {
+        unsigned long long x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y) break;      // the bytes below find where
+        a += 8;
+        b += 8;
+    }
+    while (a < a_end && *a == *b) { a++; b++; }
+    return (size_t)(a - start);
+}
+
+static int lz_put_length(unsigned char **op, unsigned char *oend, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (*op >= oend) return 0;
+        *(*op)++ = 255;
+    }
+    if (*op >= oend) return 0;
+    *(*op)++ = (unsigned char)n;
+    return 1;
+}
+
+// one sequence: lit literals, then a match of len bytes at offset back
+// (len 0: the closing literals)
+static int lz_emit(unsigned char **op, unsigned char *oend, const unsigned char *lit, size_t nlit,
+                   size_t offset, size_t len) {
+    if (*op >= oend) return 0;
+    unsigned char *token = (*op)++;
+    *token = (unsigned char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !lz_put_length(op, oend, nlit - 15)) return 0;
+    if ((size_t)(oend - *op) < nlit) return 0;
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+    if (!len) return 1;
+    if (oend - *op < 2) return 0;
+    *(*op)++ = (unsigned char)(offset & 0xFF);
+    *(*op)++ = (unsigned char)(offset >> 8);
+    len -= LZ_MIN_MATCH;
+    *token |= (unsigned char)(len < 15 ? len : 15);
+    return len < 15 || lz_put_length(op, oend, len - 15);
+}
+
+// compress src[0, n) (n <= BLOCK_BYTES) into dst; 0 if it takes more than cap
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    unsigned int table[1 << LZ_HASH_BITS];     // position + 1
+    memset(table, 0, sizeof(table));
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    const unsigned char *limit = n > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : src;
+    unsigned char *op = dst, *oend = dst + cap;
+    size_t misses = 0;
+    while (ip < limit) {
+        unsigned int h = lz_hash(ip);
+        const unsigned char *ref = table[h] ? src + table[h] - 1 : NULL;
+        table[h] = (unsigned int)(ip - src) + 1;
+        if (!ref || ip - ref > 0xFFFF || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            // skip faster through text that does not compress
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) { ip--; ref--; }
+        size_t len = LZ_MIN_MATCH + lz_match_len(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH,
+                                                 end - LZ_LAST_LITERALS);
+        if (!lz_emit(&op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), len)) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    if (!lz_emit(&op, oend, anchor, (size_t)(end - anchor), 0, 0)) return 0;
+    return (size_t)(op - dst);
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *n) {
+    unsigned char c;
+    do {
+        if (*ip >= iend) return 0;
+        c = *(*ip)++;
+        *n += c;
+    } while (c == 255);
+    return 1;
+}
+
+// decode src[0, n) into exactly want bytes at dst; 0 on malformed input
+static int lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t want) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + want;
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !lz_get_length(&ip, iend, &nlit)) return 0;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return 0;
+        if (nlit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);     // short runs: one fixed copy, overshoot rewritten later
+        } else {
+            memcpy(op, ip, nlit);
+        }
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break;      // the closing literals
+        if (iend - ip < 2) return 0;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && !lz_get_length(&ip, iend, &len)) return 0;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < len) return 0;
+        const unsigned char *ref = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= len + 8) {
+            for (size_t k = 0; k < len; k += 8) memcpy(op + k, ref + k, 8);
+        } else if (offset >= len) {
+            memcpy(op, ref, len);
+        } else {
+            for (size_t k = 0; k < len; ++k) op[k] = ref[k];     // overlapping run
+        }
+        op += len;
+    }
+    return op == oend;
+}
+
+// append s[0, n) to o as a block stream
+static int put_blocks(OutBuf *o, const char *s, size_t n) {
+    unsigned long count = (unsigned long)((n + BLOCK_BYTES - 1) / BLOCK_BYTES);
+    put_u64(o, n);
+    put_u32(o, count);
+    size_t table = o->len;
+    for (unsigned long i = 0; i < 2 * count; ++i) put_u32(o, 0);
+    if (o->len != table + 8 * (size_t)count) return 0;
+    for (unsigned long i = 0; i < count; ++i) {
+        size_t at = (size_t)i * BLOCK_BYTES;
+        size_t len = n - at < BLOCK_BYTES ? n - at : BLOCK_BYTES;
+        if (!out_reserve(o, len)) return 0;
+        size_t packed = lz_compress((const unsigned char *)s + at, len,
+                                    (unsigned char *)o->data + o->len, len - 1);
+        unsigned long entry = (unsigned long)packed;
+        if (!packed) {
+            memcpy(o->data + o->len, s + at, len);
+            packed = len;
+            entry = (unsigned long)len | BLOCK_STORED;
+        }
+        o->len += packed;
+        unsigned long crc = crc32_bytes(s + at, len);
+        for (int k = 0; k < 4; ++k) {
+            o->data[table + 8 * i + k] = (char)((entry >> (8 * k)) & 0xFF);
+            o->data[table + 8 * i + 4 + k] = (char)((crc >> (8 * k)) & 0xFF);
+        }
+    }
+    if (o->data) o->data[o->len] = '\0';
+    return 1;
+}
+
+typedef struct BlockStream {
+    size_t raw;             // decoded length
+    size_t count;
+    const char *table;      // u32 size, then u32 crc32 if checked, per block
+    int checked;
+    size_t *starts;         // offset of each block in data
+    const char *data;
+    char *out;
+    volatile int failed;
+} BlockStream;
+
+static void block_decode_task(void *ctx, size_t i, int worker) {
+    BlockStream *bs = (BlockStream *)ctx;
+    (void)worker;
+    size_t at = i * BLOCK_BYTES;
+    size_t len = bs->raw - at < BLOCK_BYTES ? bs->raw - at : BLOCK_BYTES;
+    int width = bs->checked ? 8 : 4;
+    ByteReader r = { bs->table + width * i, bs->table + width * (i + 1), 1 };
+    unsigned long entry = (unsigned long)get_uint(&r, 4);
+    unsigned int crc = (unsigned int)get_uint(&r, 4);
+    size_t stored = entry & ~BLOCK_STORED;
+    const char *src = bs->data + bs->starts[i];
+    if (entry & BLOCK_STORED) {
+        if (stored != len) bs->failed = 1;
+        else memcpy(bs->out + at, src, len);
+    } else if (!lz_decompress((const unsigned char *)src, stored, (unsigned char *)bs->out + at, len)) {
+        bs->failed = 1;
+    }
+    if (bs->checked && !bs->failed && crc32_bytes(bs->out + at, len) != crc) bs->failed = 1;
+}
+
+// decode the block stream at r into a malloc'd, NUL-terminated copy; the
+// blocks are spread over the thread pool. NULL if it is malformed or, when
+// checked, a block does not match its checksum.
+static char *get_blocks(ByteReader *r, size_t *out_len, int checked) {
+    BlockStream bs;
+    memset(&bs, 0, sizeof(bs));
+    bs.checked = checked;
+    int width = checked ? 8 : 4;
+    bs.raw = (size_t)get_uint(r, 8);
+    bs.count = (size_t)get_uint(r, 4);
+    if (!r->ok || bs.count != (bs.raw + BLOCK_BYTES - 1) / BLOCK_BYTES) return NULL;
+    bs.table = get_bytes(r, width * bs.count);
+    bs.starts = (size_t *)malloc(sizeof(size_t) * (bs.count + 1));
+    if (!r->ok || !bs.starts) { free(bs.starts); return NULL; }
+    ByteReader t = { bs.table, bs.table + width * bs.count, 1 };
+    size_t total = 0;
+    for (size_t i = 0; i < bs.count; ++i) {
+        bs.starts[i] = total;
+        total += (size_t)(get_uint(&t, 4) & ~BLOCK_STORED);
+        if (checked) get_uint(&t, 4);
+    }
+    bs.data = get_bytes(r, total);
+    bs.out = r->ok ? (char *)malloc(bs.raw + 1) : NULL;
+    if (bs.out) {
+        parallel_for(bs.count, block_decode_task, &bs);
+        bs.out[bs.raw] = '\0';
+        if (bs.failed) { free(bs.out); bs.out = NULL; }
+    }
+    free(bs.starts);
+    if (bs.out && out_len) *out_len = bs.raw;
+    return bs.out;
+}
+
+// Snapshot layout: magic, generation of the journal that follows it,
+// history length, undo groups, redo groups, cursors, crc32 of everything so
+// far, text length, text. Snapshots written before cursors were kept end the
+// history section after the redo groups. The text comes last so a load can map it in place; a
+// snapshot only becomes visible by rename after it is synced, so there is no
+// torn text to detect.
+//
+// With --compress snapshots are written packed instead: magic
+// SNAPSHOT_PACKED_MAGIC, generation, length of the history stream, the
+// history as a block stream, crc32 of everything so far, the text as a
+// block stream. History is already stored as deltas (the edits of each
+// undo unit), so packing it squeezes the removed and inserted bytes. A
+// packed snapshot is decoded into memory on load rather than mapped, and
+// each block is checked against its crc32 on the way.
+static void snapshot_serialize(OutBuf *o, unsigned long gen) {
+    out_write(o, SNAPSHOT_MAGIC, 8);
+    put_u64(o, gen);
+    size_t hist_at = o->len;
+    put_u64(o, 0);
+    put_u32(o, (unsigned long)undo_stack.size);
+    for (int i = 0; i < undo_stack.size; ++i) put_group(o, &undo_stack.items[i]);
+    put_u32(o, (unsigned long)redo_stack.size);
+    for (int i = 0; i < redo_stack.size; ++i) put_group(o, &redo_stack.items[i]);
+    put_cursors(o);
+    unsigned long long hist_len = o->len - hist_at - 8;
+    for (int i = 0; i < 8; ++i) o->data[hist_at + i] = (char)((hist_len >> (8 * i)) & 0xFF);
+    put_u32(o, crc32_bytes(o->data, o->len));
+    size_t n = buffer_length(buf);
+    put_u64(o, n);
+    if (out_reserve(o, n)) {
+        o->len += buffer_copy_range(buf, 0, n, o->data + o->len);
+        o->data[o->len] = '\0';
+    }
+}
+
+static int snapshot_compress = 0;      // --compress
+
+// turn a serialized snapshot into its packed form; runs on the compaction
+// thread, so the lock is not held while compressing
+static int snapshot_pack(const OutBuf *in, OutBuf *o) {
+    ByteReader r = { in->data, in->data + in->len, 1 };
+    get_bytes(&r, 8);
+    unsigned long long gen = get_uint(&r, 8);
+    size_t hist_len = (size_t)get_uint(&r, 8);
+    const char *hist = get_bytes(&r, hist_len);
+    get_uint(&r, 4);
+    size_t n = (size_t)get_uint(&r, 8);
+    const char *text = get_bytes(&r, n);
+    if (!r.ok) return 0;
+    out_write(o, SNAPSHOT_PACKED_MAGIC, 8);
+    put_u64(o, gen);
+    size_t hist_at = o->len;
+    put_u64(o, 0);
+    if (o->len != hist_at + 8 || !put_blocks(o, hist, hist_len)) return 0;
+    unsigned long long stream_len = o->len - hist_at - 8;
+    for (int i = 0; i < 8; ++i) o->data[hist_at + i] = (char)((stream_len >> (8 * i)) & 0xFF);
+    put_u32(o, crc32_bytes(o->data, o->len));
+    return put_blocks(o, text, n);
+}
+
+static int load_stack(ByteReader *r, MemStack *s) {
+    unsigned long count = (unsigned long)get_uint(r, 4);
+    for (unsigned long i = 0; i < count && r->ok; ++i) {
+        EditGroup g;
+        if (get_group(r, &g)) memstack_push(s, &g);
+    }
+    return r->ok;
+}
+
+// 1 and *gen from snapshot.cur, 0 if there is none, -1 if it is damaged
+static int read_snapshot_gen(unsigned long *gen) {
+    char path[DOC_PATH_MAX];
+    doc_path(path, sizeof(path), SNAPSHOT_CURRENT);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int ok = fscanf(f, "%lu", gen) == 1;
+    fclose(f);
+    return ok ? 1 : -1;
+}
+
+// map the live snapshot and make its text the buffer's original text;
+// returns 1 and fills *gen on success, 0 if there is no snapshot and -1
+// if snapshot.cur names one that is missing or damaged
+static int snapshot_load(unsigned long *gen) {
+    char path[DOC_PATH_MAX];
+    int found = read_snapshot_gen(gen);
+    if (found <= 0) return found;
+    snapshot_path(path, sizeof(path), *gen);
+    FileMap *m = map_file(path);
+    if (!m) return -1;
+    ByteReader r = { m->data, m->data + m->size, 1 };
+    const char *magic = get_bytes(&r, 8);
+    int checked = magic && memcmp(magic, SNAPSHOT_PACKED_MAGIC, 8) == 0;
+    int packed = checked || (magic && memcmp(magic, SNAPSHOT_PACKED3_MAGIC, 8) == 0);
+    if (!magic || (!packed && memcmp(magic, SNAPSHOT_MAGIC, 8) != 0)) { unmap_file(m); return -1; }
+    get_uint(&r, 8);
+    size_t hist_len = (size_t)get_uint(&r, 8);
+    const char *hist = get_bytes(&r, hist_len);
+    unsigned int crc = (unsigned int)get_uint(&r, 4);
+    if (!r.ok || crc != crc32_bytes(m->data, (size_t)(hist + hist_len - m->data))) { unmap_file(m); return -1; }
+    char *history = NULL;
+    if (packed) {
+        // decode both streams; the file is not needed after that
+        ByteReader sr = { hist, hist + hist_len, 1 };
+        size_t n = 0;
+        history = get_blocks(&sr, &hist_len, checked);
+        char *text = history ? get_blocks(&r, &n, checked) : NULL;
+        unmap_file(m);
+        if (!text) { free(history); return -1; }
+        hist = history;
+        buf = buffer_create_owned(text, n);
+    } else {
+        size_t n = (size_t)get_uint(&r, 8);
+        const char *text = get_bytes(&r, n);
+        if (!r.ok) { unmap_file(m); return -1; }
+        if (buffer_engine == ENGINE_ROPE) {
+            // the rope copies the text and unmaps the file, history and all
+            history = (char *)malloc(hist_len ? hist_len : 1);
+            if (!history) { unmap_file(m); return -1; }
+            memcpy(history, hist, hist_len);
+            hist = history;
+        }
+        buf = buffer_create_mapped(m, text, n);
+    }
+    ByteReader hr = { hist, hist + hist_len, 1 };
+    load_stack(&hr, &undo_stack);
+    load_stack(&hr, &redo_stack);
+    if (buf && hr.ok && hr.p < hr.end) get_cursors(&hr);
+    free(history);
+    return 1;
+}
+
+// rename the finished file tmp over path; with sync the rename itself is
+// made durable too
+static int replace_file(const char *tmp, const char *path, int sync) {
+#ifdef _WIN32
+    DWORD flags = MOVEFILE_REPLACE_EXISTING | (sync ? MOVEFILE_WRITE_THROUGH : 0);
+    return MoveFileExA(tmp, path, flags) != 0;
+#else
+    if (rename(tmp, path) != 0) return 0;
+    if (!sync) return 1;
+    // the rename is only durable once the directory is synced
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    else snprintf(dir, sizeof(dir), ".");
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return 0;
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+// write a file under a temp name, sync it and rename it over path
+static int write_file_synced(const char *tmp, const char *path, const char *data, size_t n) {
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return 0;
+    int ok = fwrite(data, 1, n, f) == n;
+    ok = fflush(f) == 0 && ok;
+    ok = file_sync(file_fd(f)) == 0 && ok;
+    fclose(f);
+    return ok && replace_file(tmp, path, 1);
+}
+
+typedef struct CompactJob {
+    OutBuf blob;
+    unsigned long first_gen;    // journals [first_gen, new_gen) become obsolete
+    unsigned long new_gen;
+    int compress;               // write it packed
+} CompactJob;
+
+static Thread compact_thread;
+static volatile LONG compact_running;
+static unsigned long journal_first_gen;
+
+static DWORD WINAPI compact_main(LPVOID arg) {
+    CompactJob *job = (CompactJob *)arg;
+    char path[DOC_PATH_MAX], tmp[DOC_PATH_MAX], cur[DOC_PATH_MAX], gen[32];
+    StatTimer timer = stats_start(TIMER_SNAPSHOT_WRITE);
+    snapshot_path(path, sizeof(path), job->new_gen);
+    doc_path(tmp, sizeof(tmp), SNAPSHOT_TMP);
+    if (job->compress) {
+        OutBuf packed = {0};
+        if (snapshot_pack(&job->blob, &packed)) {
+            out_free(&job->blob);
+            job->blob = packed;
+        } else {
+            out_free(&packed);      // keep the plain form
+        }
+    }
+    int ok = write_file_synced(tmp, path, job->blob.data, job->blob.len);
+    if (ok) {
+        int n = snprintf(gen, sizeof(gen), "%lu", job->new_gen);
+        doc_path(tmp, sizeof(tmp), SNAPSHOT_CURRENT ".tmp");
+        doc_path(cur, sizeof(cur), SNAPSHOT_CURRENT);
+        ok = write_file_synced(tmp, cur, gen, (size_t)n);
+    }
+    if (ok) {
+        // a snapshot still mapped by this process stays until exit
+        for (unsigned long g = job->first_gen; g < job->new_gen; ++g) {
+            journal_path(path, sizeof(path), g);
+            remove(path);
+            snapshot_path(path, sizeof(path), g);
+            remove(path);
+        }
+    }
+    stats_stop(&timer, NULL);
+    out_free(&job->blob);
+    free(job);
+    InterlockedExchange(&compact_running, 0);
+    return 0;
+}
+
+static void compact_wait() {
+    if (!compact_thread) return;
+    thread_join(compact_thread);
+    compact_thread = NULL;
+}
+
+// Fold the journal into a fresh snapshot. The state is serialized here, new
+// records go to the next journal generation right away, and the snapshot
+// write + sync + rename runs on a worker thread when background is set.
+static void journal_compact(int background) {
+    if (background && compact_running) return;
+    compact_wait();
+    journal_sync();
+    CompactJob *job = (CompactJob *)calloc(1, sizeof(CompactJob));
+    if (!job) return;
+    job->first_gen = journal_first_gen;
+    job->new_gen = journal_gen + 1;
+    job->compress = snapshot_compress;
+    StatTimer timer = stats_start(TIMER_SNAPSHOT);
+    snapshot_serialize(&job->blob, job->new_gen);
+    stats_stop(&timer, NULL);
+
+    char path[DOC_PATH_MAX];
+    journal_path(path, sizeof(path), job->new_gen);
+    FILE *next = fopen(path, "wb");
+    if (!next) { out_free(&job->blob); free(job); return; }
+    if (journal) fclose(journal);
+    journal = next;
+    journal_gen = job->new_gen;
+    journal_bytes = 0;
+    journal_first_gen = job->new_gen;
+
+    compact_running = 1;
+    if (background) compact_thread = thread_start(compact_main, job);
+    if (!compact_thread) compact_main(job);
+}
+
+static void journal_maybe_compact() {
+    if (!journal_failed && journal_bytes > JOURNAL_COMPACT_BYTES && journal_bytes > buffer_length(buf))
+        journal_compact(serve_mode);
+}
+
+static unsigned long loaded_snapshot_gen;
+
+static void journal_close() {
+    journal_commit();
+    compact_wait();
+    if (journal) fclose(journal);
+    journal = NULL;
+}
+
+// called once the buffer is gone and nothing maps the startup snapshot
+static void remove_stale_snapshot() {
+    unsigned long gen;
+    char path[DOC_PATH_MAX];
+    if (read_snapshot_gen(&gen) > 0 && gen != loaded_snapshot_gen) {
+        snapshot_path(path, sizeof(path), loaded_snapshot_gen);
+        remove(path);
+    }
+}
+
+// Map the live snapshot (or, for the default document, the legacy
+// current.txt), replay the journals that follow it and reopen the newest
+// one for appending. If the live snapshot is missing or damaged the
+// document comes up empty and read-only, and its files are left alone.
+static void load_document() {
+    StatTimer timer = stats_start(TIMER_LOAD);
+    unsigned long gen = 0;
+    int loaded = snapshot_load(&gen);
+    if (loaded < 0) {
+        fprintf(stderr, "backend: the snapshot of %s is missing or damaged; "
+                        "the document is read-only\n", doc_dir);
+        buf = buffer_create_from_string("");
+        index_reset();
+        loaded_snapshot_gen = gen;
+        journal_first_gen = journal_gen = gen;
+        typing_open = 0;
+        cursor_dirty = 0;
+        journal = NULL;
+        journal_bytes = 0;
+        journal_failed = 1;
+        stats_stop(&timer, NULL);
+        return;
+    }
+    if (!loaded) {
+        gen = 0;
+        FileMap *m = strcmp(doc_dir, DATA_DIR) == 0 ? map_file(CURRENT_FILE) : NULL;
+        buf = m ? buffer_create_mapped(m, m->data, m->size) : buffer_create_from_string("");
+    }
+    index_reset();
+    loaded_snapshot_gen = gen;
+    char path[DOC_PATH_MAX];
+    // older generations are leftovers of an interrupted cleanup
+    for (unsigned long g = gen; g-- > 0; ) {
+        journal_path(path, sizeof(path), g);
+        int gone = remove(path) == 0;
+        snapshot_path(path, sizeof(path), g);
+        gone = (remove(path) == 0) || gone;
+        if (!gone) break;
+    }
+    journal_first_gen = gen;
+    unsigned long last = gen;
+    int torn = 0;
+    for (unsigned long g = gen; ; ++g) {
+        journal_path(path, sizeof(path), g);
+        int r = journal_replay(path);
+        if (r < 0) break;
+        last = g;
+        if (r == 0) { torn = 1; break; }
+    }
+    typing_open = 0;
+    cursor_dirty = 0;
+    journal_failed = 0;
+    journal_gen = last;
+    journal_path(path, sizeof(path), last);
+    journal = fopen(path, "ab");
+    journal_bytes = 0;
+    if (journal) {
+        fseek(journal, 0, SEEK_END);
+        journal_bytes = (size_t)ftell(journal);
+    }
+    // never append after a damaged tail: start over from a clean snapshot
+    if (torn) journal_compact(0);
+    // with no journal to append to, an edit could not reach the disk
+    if (!journal) journal_failed = 1;
+    stats_stop(&timer, NULL);
+}
+
+// Replacing words. Every occurrence comes from the word index, so the
+// ops are known (and sized) before anything changes, and they are applied
+// as one batch; no rewritten copy of the document is ever built.
+typedef struct ReplacePair {
+    const char *oldw;
+    size_t oldlen;
+    const char *neww;
+    size_t newlen;
+} ReplacePair;
+
+typedef struct ReplaceHit {
+    size_t pos;
+    int pair;
+} ReplaceHit;
+
+static int cmp_hit(const void *a, const void *b) {
+    size_t x = ((const ReplaceHit *)a)->pos, y = ((const ReplaceHit *)b)->pos;
+    return x < y ? -1 : x > y;
+}
+
+// replace every whole-word occurrence of each pair's old word as one undo
+// unit; an old word listed twice uses its first pair. Returns the number of
+// words replaced.
+static size_t replace_words(const ReplacePair *pairs, int npairs) {
+    StatTimer timer = stats_start(TIMER_REPLACE);
+    ReplaceHit *hits = NULL;
+    size_t count = 0, cap = 0;
+    int sorted = 1;
+    for (int p = 0; p < npairs; ++p) {
+        int dup = 0;
+        for (int q = 0; q < p && !dup; ++q)
+            dup = pairs[q].oldlen == pairs[p].oldlen && memcmp(pairs[q].oldw, pairs[p].oldw, pairs[p].oldlen) == 0;
+        WordEntry *e = dup ? NULL : index_lookup(pairs[p].oldw, pairs[p].oldlen);
+        if (!e) continue;
+        size_t n = 0;
+        size_t *pos = index_positions(e, &n);
+        if (count + n > cap) {
+            size_t newcap = (count + n) * 2;
+            ReplaceHit *tmp = (ReplaceHit *)realloc(hits, sizeof(ReplaceHit) * newcap);
+            if (!tmp) { free(pos); continue; }
+            hits = tmp;
+            cap = newcap;
+        }
+        if (count > 0) sorted = 0;
+        for (size_t i = 0; i < n; ++i) {
+            hits[count + i].pos = pos[i];
+            hits[count + i].pair = p;
+        }
+        count += n;
+        free(pos);
+    }
+    if (count == 0) {
+        free(hits);
+        stats_stop(&timer, NULL);
+        return 0;
+    }
+    if (!sorted) qsort(hits, count, sizeof(ReplaceHit), cmp_hit);
+
+    history_begin(EDIT_OTHER);
+    long long delta = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const ReplacePair *rp = &pairs[hits[i].pair];
+        size_t at = (size_t)((long long)hits[i].pos + delta);
+        history_record(at, at, rp->oldw, rp->oldlen, rp->neww, rp->newlen);
+        delta += (long long)rp->newlen - (long long)rp->oldlen;
+    }
+    free(hits);
+    EditGroup *top = memstack_top(&undo_stack);
+    group_apply(top, 0);
+    journal_ops(top);
+    buffer_set_cursor(buf, buffer_length(buf));
+    stats_stop(&timer, NULL);
+    return count;
+}
+
+// Multi-pattern search. The patterns are compiled into an Aho-Corasick
+// automaton with full transitions, over byte classes so the table only has
+// a column per byte that occurs in some pattern, and the document is run
+// through it once, in place. Every occurrence of every pattern is reported,
+// overlapping ones included. Folding ASCII case costs nothing: both cases
+// of a letter share a column.
+#define AC_MAX_TABLE_BYTES (256u * 1024 * 1024)
+
+typedef struct AcAutomaton {
+    unsigned char cls[256];     // byte -> column; 0 for bytes in no pattern
+    int classes;
+    int states;
+    int *next;                  // states x classes
+    int *out;                   // first pattern ending in the state, or -1
+    int *link;                  // nearest suffix state with an output, or -1
+    int *same;                  // next pattern with the same text, or -1
+    const size_t *lens;
+} AcAutomaton;
+
+static void ac_free(AcAutomaton *ac) {
+    free(ac->next);
+    free(ac->out);
+    free(ac->link);
+    free(ac->same);
+}
+
+// empty patterns never match; returns 0 when the table would be too large
+static int ac_build(AcAutomaton *ac, const char **pats, const size_t *lens, int n, int fold) {
+    memset(ac, 0, sizeof(*ac));
+    ac->lens = lens;
+    size_t total = 1;
+    int k = 1;
+    for (int p = 0; p < n; ++p) {
+        total += lens[p];
+        for (size_t i = 0; i < lens[p]; ++i) {
+            unsigned char c = (unsigned char)pats[p][i];
+            if (ac->cls[c]) continue;
+            if (fold && (c | 0x20) >= 'a' && (c | 0x20) <= 'z') ac->cls[c ^ 0x20] = (unsigned char)k;
+            ac->cls[c] = (unsigned char)k++;
+        }
+    }
+    if ((double)total * k * sizeof(int) > AC_MAX_TABLE_BYTES) return 0;
+    ac->classes = k;
+    ac->next = (int *)malloc(sizeof(int) * total * k);
+    ac->out = (int *)malloc(sizeof(int) * total);
+    ac->link = (int *)malloc(sizeof(int) * total);
+    ac->same = (int *)malloc(sizeof(int) * (n + 1));
+    int *fail = (int *)malloc(sizeof(int) * total);
+    int *queue = (int *)malloc(sizeof(int) * total);
+    if (!ac->next || !ac->out || !ac->link || !ac->same || !fail || !queue) {
+        free(fail);
+        free(queue);
+        ac_free(ac);
+        return 0;
+    }
+    memset(ac->next, 0xFF, sizeof(int) * total * k);
+    ac->states = 1;
+    ac->out[0] = -1;
+    for (int p = 0; p < n; ++p) {
+        ac->same[p] = -1;
+        if (lens[p] == 0) continue;
+        int s = 0;
+        for (size_t i = 0; i < lens[p]; ++i) {
+            int *t = &ac->next[s * k + ac->cls[(unsigned char)pats[p][i]]];
+            if (*t < 0) {
+                *t = ac->states++;
+                ac->out[*t] = -1;
+            }
+            s = *t;
+        }
+        ac->same[p] = ac->out[s];
+        ac->out[s] = p;
+    }
+    // breadth first: fill the missing transitions from the fail state
+    int head = 0, tail = 0;
+    fail[0] = 0;
+    ac->link[0] = -1;
+    for (int a = 0; a < k; ++a) {
+        int t = ac->next[a];
+        if (t < 0) ac->next[a] = 0;
+        else { fail[t] = 0; ac->link[t] = -1; queue[tail++] = t; }
+    }
+    while (head < tail) {
+        int s = queue[head++];
+        for (int a = 0; a < k; ++a) {
+            int *t = &ac->next[s * k + a];
+            int f = ac->next[fail[s] * k + a];
+            if (*t < 0) { *t = f; continue; }
+            fail[*t] = f;
+            ac->link[*t] = ac->out[f] >= 0 ? f : ac->link[f];
+            queue[tail++] = *t;
+        }
+    }
+    free(fail);
+    free(queue);
+    return 1;
+}
+
+typedef struct AcScan {
+    AcAutomaton *ac;
+    int state;
+    size_t base;                // document offset of the current chunk
+    size_t matches;
+} AcScan;
+
+static int ac_scan_chunk(void *arg, const char *p, size_t n) {
+    AcScan *sc = (AcScan *)arg;
+    AcAutomaton *ac = sc->ac;
+    int s = sc->state, k = ac->classes;
+    for (size_t i = 0; i < n; ++i) {
+        s = ac->next[s * k + ac->cls[(unsigned char)p[i]]];
+        for (int t = ac->out[s] >= 0 ? s : ac->link[s]; t >= 0; t = ac->link[t]) {
+            for (int id = ac->out[t]; id >= 0; id = ac->same[id]) {
+                size_t end = sc->base + i + 1;
+                out_printf(&reply, "%d %zu %zu\n", id, end - ac->lens[id], ac->lens[id]);
+                sc->matches++;
+            }
+        }
+    }
+    sc->state = s;
+    sc->base += n;
+    return 1;
+}
+
+// find:pat1\npat2... replies with one "pattern offset length" line per
+// match, ordered by where the match ends; offsets are bytes and patterns
+// count from 0. ifind: is the same ignoring ASCII case.
+static void find_patterns(const char *arg, int fold) {
+    const char **pats = NULL;
+    size_t *lens = NULL;
+    int n = 0, cap = 0;
+    const char *p = arg;
+    while (*p) {
+        const char *eol = strchr(p, '\n');
+        if (!eol) eol = p + strlen(p);
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            const char **tp = (const char **)realloc(pats, sizeof(char *) * cap);
+            if (tp) pats = tp;
+            size_t *tl = (size_t *)realloc(lens, sizeof(size_t) * cap);
+            if (tl) lens = tl;
+            if (!tp || !tl) { n = -1; break; }
+        }
+        pats[n] = p;
+        lens[n++] = (size_t)(eol - p);
+        p = *eol ? eol + 1 : eol;
+    }
+    AcAutomaton ac;
+    if (n == 0) {
+        out_puts(&reply, "Pattern empty.");
+    } else if (n < 0 || !ac_build(&ac, pats, lens, n, fold)) {
+        out_puts(&reply, "Too many patterns.");
+    } else {
+        AcScan sc = { &ac, 0, 0, 0 };
+        buffer_chunks(buf, 0, buffer_length(buf), ac_scan_chunk, &sc);
+        if (sc.matches == 0) out_puts(&reply, "Word not found!");
+        ac_free(&ac);
+    }
+    free(pats);
+    free(lens);
+}
+
+// Regular expressions. The pattern is parsed into a tree, compiled into a
+// Thompson NFA and matched by a DFA that is built lazily, one transition at
+// a time, from sets of NFA states. The DFA cache is bounded: when it fills
+// up it is flushed and rebuilt from the state being matched, so matching
+// never backtracks and stays linear in the text.
+// Syntax: literal bytes, . (any byte but newline), [...] and [^...] with
+// ranges, \d \w \s \D \W \S, escapes \n \t \r and \<punct>, (...), | and
+// the * + ? repeats. Matches are leftmost-longest and do not overlap;
+// empty matches are not reported.
+typedef struct ByteSet {
+    unsigned int bits[8];
+} ByteSet;
+
+static void byteset_add(ByteSet *s, int c) {
+    s->bits[c >> 5] |= 1u << (c & 31);
+}
+
+static int byteset_has(const ByteSet *s, int c) {
+    return (s->bits[c >> 5] >> (c & 31)) & 1;
+}
+
+static void byteset_invert(ByteSet *s) {
+    for (int i = 0; i < 8; ++i) s->bits[i] = ~s->bits[i];
+}
+
+enum { RX_SET, RX_CAT, RX_ALT, RX_STAR, RX_PLUS, RX_QUEST, RX_EMPTY };
+
+typedef struct RxNode {
+    int type;
+    ByteSet set;                // RX_SET
+    struct RxNode *a, *b;       // operands
+} RxNode;
+
+#define RX_MAX_DEPTH 256
+#define RX_MAX_PATTERN 16384
+
+typedef struct RxParser {
+    const char *p, *end;
+    RxNode *nodes;              // pool sized from the pattern length
+    int count;
+    int depth;
+    const char *error;
+} RxParser;
+
+static RxNode *rx_node(RxParser *ps, int type, RxNode *a, RxNode *b) {
+    RxNode *n = &ps->nodes[ps->count++];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+// \d \w \s and friends into s; returns 0 for a plain escaped byte
+static int rx_class_escape(char c, ByteSet *s) {
+    int lower = c | 0x20;
+    if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+    memset(s, 0, sizeof(*s));
+    for (int b = 0; b < 256; ++b) {
+        int in = lower == 'd' ? isdigit(b)
+               : lower == 'w' ? (isalnum(b) || b == '_')
+               : (b == ' ' || (b >= '\t' && b <= '\r'));
+        if (b >= 128) in = 0;
+        if (in) byteset_add(s, b);
+    }
+    if (c != lower) byteset_invert(s);
+    return 1;
+}
+
+static int rx_escape_byte(char c) {
+    switch (c) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    default: return (unsigned char)c;
+    }
+}
+
+static RxNode *rx_alt(RxParser *ps);
+
+static RxNode *rx_class(RxParser *ps) {
+    RxNode *n = rx_node(ps, RX_SET, NULL, NULL);
+    int negate = 0;
+    if (ps->p < ps->end && *ps->p == '^') { negate = 1; ps->p++; }
+    int first = 1;
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        first = 0;
+        int lo;
+        if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+            ByteSet esc;
+            if (rx_class_escape(ps->p[1], &esc)) {
+                for (int i = 0; i < 8; ++i) n->set.bits[i] |= esc.bits[i];
+                ps->p += 2;
+                continue;
+            }
+            lo = rx_escape_byte(ps->p[1]);
+            ps->p += 2;
+        } else {
+            lo = (unsigned char)*ps->p++;
+        }
+        int hi = lo;
+        if (ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']') {
+            ps->p++;
+            if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+                hi = rx_escape_byte(ps->p[1]);
+                ps->p += 2;
+            } else {
+                hi = (unsigned char)*ps->p++;
+            }
+            if (hi < lo) { ps->error = "bad range"; return NULL; }
+        }
+        for (int c = lo; c <= hi; ++c) byteset_add(&n->set, c);
+    }
+    if (ps->p >= ps->end) { ps->error = "missing ]"; return NULL; }
+    ps->p++;
+    if (negate) byteset_invert(&n->set);
+    return n;
+}
+
+static RxNode *rx_atom(RxParser *ps) {
+    char c = *ps->p++;
+    RxNode *n;
+    switch (c) {
+    case '(':
+        if (++ps->depth > RX_MAX_DEPTH) { ps->error = "nested too deeply"; return NULL; }
+        n = rx_alt(ps);
+        ps->depth--;
+        if (!n) return NULL;
+        if (ps->p >= ps->end || *ps->p != ')') { ps->error = "missing )"; return NULL; }
+        ps->p++;
+        return n;
+    case '[':
+        return rx_class(ps);
+    case '.':
+        n = rx_node(ps, RX_SET, NULL, NULL);
+        byteset_add(&n->set, '\n');
+        byteset_invert(&n->set);
+        return n;
+    case '*': case '+': case '?':
+        ps->error = "nothing to repeat";
+        return NULL;
+    case '^': case '$':
+        ps->error = "anchors are not supported";
+        return NULL;
+    case '\\':
+        if (ps->p >= ps->end) { ps->error = "trailing \\"; return NULL; }
+        n = rx_node(ps, RX_SET, NULL, NULL);
+        c = *ps->p++;
+        if (!rx_class_escape(c, &n->set)) byteset_add(&n->set, rx_escape_byte(c));
+        return n;
+    default:
+        n = rx_node(ps, RX_SET, NULL, NULL);
+        byteset_add(&n->set, (unsigned char)c);
+        return n;
+    }
+}
+
+static RxNode *rx_repeat(RxParser *ps) {
+    RxNode *n = rx_atom(ps);
+    while (n && ps->p < ps->end && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+        char op = *ps->p++;
+        n = rx_node(ps, op == '*' ? RX_STAR : op == '+' ? RX_PLUS : RX_QUEST, n, NULL);
+    }
+    return n;
+}
+
+static RxNode *rx_cat(RxParser *ps) {
+    RxNode *n = NULL;
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        RxNode *r = rx_repeat(ps);
+        if (!r) return NULL;
+        n = n ? rx_node(ps, RX_CAT, n, r) : r;
+    }
+    return n ? n : rx_node(ps, RX_EMPTY, NULL, NULL);
+}
+
+static RxNode *rx_alt(RxParser *ps) {
+    RxNode *n = rx_cat(ps);
+    while (n && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        RxNode *r = rx_cat(ps);
+        if (!r) return NULL;
+        n = rx_node(ps, RX_ALT, n, r);
+    }
+    return n;
+}
+
+// the literal bytes every match starts with, at most cap of them
+static size_t rx_literal_prefix(RxNode *n, char *out, size_t cap, int *stop) {
+    if (*stop) return 0;
+    if (n->type == RX_CAT) {
+        size_t k = rx_literal_prefix(n->a, out, cap, stop);
+        return k + rx_literal_prefix(n->b, out + k, cap - k, stop);
+    }
+    *stop = 1;
+    if (n->type != RX_SET || cap == 0) return 0;
+    int only = -1;
+    for (int c = 0; c < 256; ++c) {
+        if (!byteset_has(&n->set, c)) continue;
+        if (only >= 0) return 0;
+        only = c;
+    }
+    if (only < 0) return 0;
+    *stop = 0;
+    out[0] = (char)only;
+    return 1;
+}
+
+enum { NFA_SET, NFA_SPLIT, NFA_MATCH };
+
+typedef struct NfaState {
+    int type;
+    int out, out1;
+    ByteSet set;
+} NfaState;
+
+typedef struct Nfa {
+    NfaState *states;
+    int count;
+    int start;
+} Nfa;
+
+static int nfa_state(Nfa *nfa, int type, int out, int out1) {
+    NfaState *s = &nfa->states[nfa->count];
+    memset(s, 0, sizeof(*s));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return nfa->count++;
+}
+
+// compile n in front of the state next; reverse builds the NFA of the
+// reversed language, which finds where matches start
+static int nfa_compile(Nfa *nfa, RxNode *n, int next, int reverse) {
+    int s;
+    switch (n->type) {
+    case RX_SET:
+        s = nfa_state(nfa, NFA_SET, next, -1);
+        nfa->states[s].set = n->set;
+        return s;
+    case RX_CAT:
+        if (reverse) return nfa_compile(nfa, n->b, nfa_compile(nfa, n->a, next, reverse), reverse);
+        return nfa_compile(nfa, n->a, nfa_compile(nfa, n->b, next, reverse), reverse);
+    case RX_ALT:
+        s = nfa_compile(nfa, n->a, next, reverse);
+        return nfa_state(nfa, NFA_SPLIT, s, nfa_compile(nfa, n->b, next, reverse));
+    case RX_STAR:
+        s = nfa_state(nfa, NFA_SPLIT, -1, next);
+        nfa->states[s].out = nfa_compile(nfa, n->a, s, reverse);
+        return s;
+    case RX_PLUS:
+        s = nfa_state(nfa, NFA_SPLIT, -1, next);
+        return nfa->states[s].out = nfa_compile(nfa, n->a, s, reverse);
+    case RX_QUEST:
+        return nfa_state(nfa, NFA_SPLIT, nfa_compile(nfa, n->a, next, reverse), next);
+    default:
+        return next;
+    }
+}
+
+static int nfa_build(Nfa *nfa, RxNode *root, int nodes, int reverse) {
+    nfa->states = (NfaState *)malloc(sizeof(NfaState) * (nodes + 1));
+    if (!nfa->states) return 0;
+    nfa->count = 0;
+    nfa->start = nfa_compile(nfa, root, nfa_state(nfa, NFA_MATCH, -1, -1), reverse);
+    return 1;
+}
+
+// Lazy DFA. A state is a sorted set of NFA SET/MATCH states; transitions
+// are filled in on first use. An unanchored DFA restarts the NFA at every
+// byte, as if the pattern were prefixed with .*
+#define DFA_CACHE_BYTES (8u * 1024 * 1024)
+
+typedef struct DfaState {
+    int next[256];              // -1 until computed
+    int accept;
+    int n;
+    int keep;                   // new id + 1 while a flush keeps it
+    int set[];
+} DfaState;
+
+typedef struct Dfa {
+    Nfa *nfa;
+    int unanchored;
+    DfaState **states;
+    int count, cap;
+    size_t bytes;
+    int *table;                 // hash of sets, state id + 1
+    int table_cap;
+    int *work, *stack;          // scratch, one slot per NFA state
+    unsigned *mark;
+    unsigned gen;
+    int start;
+    int *pins;                  // ids the caller still holds; a flush keeps
+    int npins;                  // them and rewrites them in place
+    unsigned flushes;
+} Dfa;
+
+static unsigned dfa_hash(const int *set, int n) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < n; ++i) h = (h ^ (unsigned)set[i]) * 16777619u;
+    return h;
+}
+
+static void dfa_clear(Dfa *d) {
+    for (int i = 0; i < d->count; ++i) free(d->states[i]);
+    d->count = 0;
+    d->bytes = 0;
+    memset(d->table, 0, sizeof(int) * d->table_cap);
+}
+
+// drop every state but the start state and the pinned ones, which are
+// renumbered from 0 with their transitions forgotten
+static void dfa_flush(Dfa *d) {
+    int kept = 0, count = d->count;
+    d->states[d->start]->keep = 1;
+    for (int i = 0; i < d->npins; ++i) d->states[d->pins[i]]->keep = 1;
+    for (int i = 0; i < count; ++i)
+        if (d->states[i]->keep) d->states[i]->keep = ++kept;
+    d->start = d->states[d->start]->keep - 1;
+    for (int i = 0; i < d->npins; ++i) d->pins[i] = d->states[d->pins[i]]->keep - 1;
+    memset(d->table, 0, sizeof(int) * d->table_cap);
+    d->count = 0;
+    d->bytes = 0;
+    d->flushes++;
+    int mask = d->table_cap - 1;
+    for (int i = 0; i < count; ++i) {
+        DfaState *s = d->states[i];
+        if (!s->keep) { free(s); continue; }
+        s->keep = 0;
+        memset(s->next, 0xFF, sizeof(s->next));
+        int slot = (int)(dfa_hash(s->set, s->n) & (unsigned)mask);
+        while (d->table[slot]) slot = (slot + 1) & mask;
+        d->states[d->count] = s;
+        d->table[slot] = ++d->count;
+        d->bytes += sizeof(DfaState) + sizeof(int) * s->n;
+    }
+}
+
+// id of the state for set[0, n), -1 when the cache is full or out of memory
+static int dfa_intern(Dfa *d, const int *set, int n) {
+    unsigned h = dfa_hash(set, n);
+    int mask = d->table_cap - 1;
+    int slot = (int)(h & (unsigned)mask);
+    while (d->table[slot]) {
+        DfaState *s = d->states[d->table[slot] - 1];
+        if (s->n == n && memcmp(s->set, set, sizeof(int) * n) == 0) return d->table[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+    size_t size = sizeof(DfaState) + sizeof(int) * n;
+    if (d->bytes + size > DFA_CACHE_BYTES || d->count * 2 >= d->table_cap) return -1;
+    DfaState *s = (DfaState *)malloc(size);
+    if (!s) return -1;
+    memset(s->next, 0xFF, sizeof(s->next));
+    s->n = n;
+    s->accept = 0;
+    s->keep = 0;
+    for (int i = 0; i < n; ++i) {
+        s->set[i] = set[i];
+        if (d->nfa->states[set[i]].type == NFA_MATCH) s->accept = 1;
+    }
+    d->states[d->count] = s;
+    d->table[slot] = ++d->count;
+    d->bytes += size;
+    return d->count - 1;
+}
+
+// add the epsilon closure of NFA state s to d->work
+static int dfa_closure(Dfa *d, int s, int n) {
+    int top = 0;
+    d->stack[top++] = s;
+    while (top) {
+        s = d->stack[--top];
+        if (s < 0 || d->mark[s] == d->gen) continue;
+        d->mark[s] = d->gen;
+        NfaState *st = &d->nfa->states[s];
+        if (st->type == NFA_SPLIT) {
+            d->stack[top++] = st->out1;
+            d->stack[top++] = st->out;
+        } else {
+            d->work[n++] = s;
+        }
+    }
+    return n;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int dfa_init(Dfa *d, Nfa *nfa, int unanchored) {
+    memset(d, 0, sizeof(*d));
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->table_cap = 1;
+    while (d->table_cap < 2 * (int)(DFA_CACHE_BYTES / sizeof(DfaState))) d->table_cap <<= 1;
+    d->cap = d->table_cap / 2;
+    d->states = (DfaState **)malloc(sizeof(DfaState *) * d->cap);
+    d->table = (int *)calloc(d->table_cap, sizeof(int));
+    d->work = (int *)malloc(sizeof(int) * nfa->count);
+    d->stack = (int *)malloc(sizeof(int) * (nfa->count * 2 + 2));
+    d->mark = (unsigned *)calloc(nfa->count, sizeof(unsigned));
+    if (!d->states || !d->table || !d->work || !d->stack || !d->mark) return 0;
+    d->gen++;
+    int n = dfa_closure(d, nfa->start, 0);
+    qsort(d->work, n, sizeof(int), cmp_int);
+    d->start = dfa_intern(d, d->work, n);
+    return d->start >= 0;
+}
+
+static void dfa_free(Dfa *d) {
+    if (d->states) dfa_clear(d);
+    free(d->states);
+    free(d->table);
+    free(d->work);
+    free(d->stack);
+    free(d->mark);
+}
+
+// state after reading byte c in state id; -1 only when memory runs out.
+// A full cache is flushed, which invalidates every id but the result, the
+// start state and the pins.
+static int dfa_step(Dfa *d, int id, unsigned char c) {
+    DfaState *s = d->states[id];
+    if (s->next[c] >= 0) return s->next[c];
+    int n = 0;
+    d->gen++;
+    for (int i = 0; i < s->n; ++i) {
+        NfaState *st = &d->nfa->states[s->set[i]];
+        if (st->type == NFA_SET && byteset_has(&st->set, c)) n = dfa_closure(d, st->out, n);
+    }
+    if (d->unanchored) n = dfa_closure(d, d->nfa->start, n);
+    qsort(d->work, n, sizeof(int), cmp_int);
+    int next = dfa_intern(d, d->work, n);
+    if (next >= 0) {
+        s->next[c] = next;
+        return next;
+    }
+    dfa_flush(d);
+    return dfa_intern(d, d->work, n);
+}
+
+// Reverse pass: run the unanchored DFA of the reversed pattern from the
+// end of the document; it accepts exactly at the offsets where a match
+// starts, which are recorded in a bitmap.
+typedef struct RxStarts {
+    Dfa *dfa;
+    int state;
+    size_t at;                  // offset just past the current chunk
+    unsigned long long *bits;
+    int failed;
+} RxStarts;
+
+static int rx_starts_chunk(void *arg, const char *p, size_t n) {
+    RxStarts *r = (RxStarts *)arg;
+    size_t base = r->at - n;
+    int s = r->state;
+    for (size_t i = n; i-- > 0; ) {
+        s = dfa_step(r->dfa, s, (unsigned char)p[i]);
+        if (s < 0) { r->failed = 1; return 0; }
+        if (r->dfa->states[s]->accept) r->bits[(base + i) >> 6] |= 1ull << ((base + i) & 63);
+    }
+    r->state = s;
+    r->at = base;
+    return 1;
+}
+
+static size_t rx_next_start(const unsigned long long *bits, size_t from, size_t n) {
+    size_t w = from >> 6;
+    if (from > n) return (size_t)-1;
+    unsigned long long m = bits[w] & (~0ull << (from & 63));
+    while (!m) {
+        if (++w > n >> 6) return (size_t)-1;
+        m = bits[w];
+    }
+    return (w << 6) + (size_t)ctz64(m);
+}
+
+// Forward pass: one scan of the anchored DFA from every start at once.
+// Runs that reach the same DFA state share their future, so they are
+// merged into one group and every byte costs one step per distinct live
+// state, however far the runs go past the match they end up reporting.
+// A run's match end is then the last accept of its group chain after it
+// joined. Candidates are the offsets marked in the start bitmap; one left
+// of the current match's end so far is dropped, and a match is reported
+// once its run is over.
+typedef struct RxGroup {
+    int parent;                 // group it merged into, -1 for none
+    int alive;
+    size_t accept;              // end of its last accept, 0 for none
+    size_t merged;              // offset where it merged into the parent
+} RxGroup;
+
+typedef struct RxCand {
+    size_t start;
+    size_t end;                 // its match end before joining the group
+    size_t joined;
+    int group;
+} RxCand;
+
+typedef struct RxScan {
+    Dfa *dfa;
+    const unsigned long long *bits;
+    size_t at;                  // offset of the next byte
+    RxGroup *groups;
+    int ngroups, group_cap;
+    int *live, *live_state;     // live groups and their DFA states
+    int nlive, live_cap;
+    unsigned *stamp;            // per DFA state: dedup generation
+    int *owner;                 // per DFA state: live group holding it
+    unsigned gen;
+    RxCand *cands;
+    size_t head, ncands, cand_cap;
+    size_t floor;               // no match starts before this offset
+    size_t matches;
+    int failed;
+} RxScan;
+
+// match end of candidate c, and whether its run is still going on
+static size_t rx_cand_end(RxScan *sc, const RxCand *c, int *running) {
+    size_t end = c->end, since = c->joined;
+    RxGroup *g = &sc->groups[c->group];
+    for (;;) {
+        // a merged parent is finished: fold it into g to keep chains short
+        while (g->parent >= 0 && sc->groups[g->parent].parent >= 0) {
+            RxGroup *p = &sc->groups[g->parent];
+            if (p->accept > g->merged) g->accept = p->accept;
+            g->merged = p->merged;
+            g->parent = p->parent;
+        }
+        if (g->accept > since) end = g->accept;
+        if (g->parent < 0) break;
+        since = g->merged;
+        g = &sc->groups[g->parent];
+    }
+    *running = g->alive;
+    return end;
+}
+
+// report the candidates whose runs are over, leftmost first
+static void rx_report(RxScan *sc) {
+    while (sc->head < sc->ncands) {
+        RxCand *c = &sc->cands[sc->head];
+        int running;
+        size_t end = rx_cand_end(sc, c, &running);
+        if (running) return;
+        sc->head++;
+        if (end > c->start) {
+            out_printf(&reply, "%zu %zu\n", c->start, end - c->start);
+            sc->matches++;
+            while (sc->head < sc->ncands && sc->cands[sc->head].start < end) sc->head++;
+        }
+    }
+    if (sc->nlive == 0) sc->head = sc->ncands = 0, sc->ngroups = 0;
+}
+
+// drop the groups that no live run or pending candidate refers to
+static int rx_gc_groups(RxScan *sc) {
+    int *map = (int *)malloc(sizeof(int) * sc->ngroups);
+    if (!map) return 0;
+    for (int i = 0; i < sc->ngroups; ++i) map[i] = -1;
+    for (int j = 0; j < sc->nlive; ++j) map[sc->live[j]] = 0;
+    for (size_t k = sc->head; k < sc->ncands; ++k)
+        for (int g = sc->cands[k].group; g >= 0 && map[g] < 0; g = sc->groups[g].parent) map[g] = 0;
+    int kept = 0;
+    for (int i = 0; i < sc->ngroups; ++i)
+        if (map[i] >= 0) {
+            map[i] = kept;
+            sc->groups[kept++] = sc->groups[i];
+        }
+    for (int i = 0; i < kept; ++i)
+        if (sc->groups[i].parent >= 0) sc->groups[i].parent = map[sc->groups[i].parent];
+    for (int j = 0; j < sc->nlive; ++j) sc->live[j] = map[sc->live[j]];
+    for (size_t k = sc->head; k < sc->ncands; ++k) sc->cands[k].group = map[sc->cands[k].group];
+    sc->ngroups = kept;
+    free(map);
+    return 1;
+}
+
+// whether a match may start at pos, given where the current one ends so far
+static int rx_wanted(RxScan *sc, size_t pos) {
+    if (pos < sc->floor) return 0;
+    if (sc->head == sc->ncands) return 1;
+    int running;
+    sc->floor = rx_cand_end(sc, &sc->cands[sc->head], &running);
+    if (pos < sc->floor) return 0;
+    // the candidates behind the head that start before it ends are out
+    size_t lo = sc->head + 1, hi = sc->ncands;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sc->cands[mid].start < sc->floor) lo = mid + 1; else hi = mid;
+    }
+    if (lo > sc->head + 1) {
+        memmove(sc->cands + sc->head + 1, sc->cands + lo, sizeof(RxCand) * (sc->ncands - lo));
+        sc->ncands -= lo - sc->head - 1;
+    }
+    return 1;
+}
+
+// a candidate starting at pos, in DFA state s after its first byte
+static int rx_add_cand(RxScan *sc, size_t pos, int s) {
+    if (sc->ngroups == sc->group_cap) {
+        if (!rx_gc_groups(sc)) return 0;
+        if (sc->ngroups >= sc->group_cap / 2) {
+            int cap = sc->group_cap ? sc->group_cap * 2 : 64;
+            RxGroup *g = (RxGroup *)realloc(sc->groups, sizeof(RxGroup) * cap);
+            if (!g) return 0;
+            sc->groups = g;
+            sc->group_cap = cap;
+        }
+    }
+    if (sc->nlive == sc->live_cap) {
+        int cap = sc->live_cap ? sc->live_cap * 2 : 16;
+        int *l = (int *)realloc(sc->live, sizeof(int) * cap);
+        if (!l) return 0;
+        sc->live = l;
+        l = (int *)realloc(sc->live_state, sizeof(int) * cap);
+        if (!l) return 0;
+        sc->live_state = l;
+        sc->live_cap = cap;
+    }
+    if (sc->ncands == sc->cand_cap) {
+        if (sc->head) {
+            memmove(sc->cands, sc->cands + sc->head, sizeof(RxCand) * (sc->ncands - sc->head));
+            sc->ncands -= sc->head;
+            sc->head = 0;
+        }
+        if (sc->ncands >= sc->cand_cap / 2) {
+            size_t cap = sc->cand_cap ? sc->cand_cap * 2 : 64;
+            RxCand *c = (RxCand *)realloc(sc->cands, sizeof(RxCand) * cap);
+            if (!c) return 0;
+            sc->cands = c;
+            sc->cand_cap = cap;
+        }
+    }
+    RxGroup *g = &sc->groups[sc->ngroups];
+    g->parent = -1;
+    g->alive = 1;
+    g->accept = sc->dfa->states[s]->accept ? pos + 1 : 0;
+    g->merged = 0;
+    RxCand *c = &sc->cands[sc->ncands++];
+    c->start = c->end = c->joined = pos;
+    c->group = sc->ngroups;
+    if (sc->stamp[s] == sc->gen) {
+        // some run is already in that state
+        g->alive = 0;
+        g->parent = sc->owner[s];
+        g->merged = pos + 1;
+    } else {
+        sc->stamp[s] = sc->gen;
+        sc->owner[s] = sc->ngroups;
+        sc->live[sc->nlive] = sc->ngroups;
+        sc->live_state[sc->nlive++] = s;
+    }
+    sc->ngroups++;
+    return 1;
+}
+
+static int rx_scan_chunk(void *arg, const char *p, size_t n) {
+    RxScan *sc = (RxScan *)arg;
+    Dfa *d = sc->dfa;
+    for (size_t i = 0; i < n; ++i) {
+        if (sc->nlive == 0) {
+            // nothing running: skip ahead to the next start
+            size_t next = rx_next_start(sc->bits, sc->at + i, sc->at + n - 1);
+            if (next == (size_t)-1 || next >= sc->at + n) break;
+            i = next - sc->at;
+        }
+        size_t pos = sc->at + i;
+        unsigned char c = (unsigned char)p[i];
+        int start = (sc->bits[pos >> 6] >> (pos & 63) & 1) && pos >= sc->floor;
+        // the states are pinned so that a flush midway renumbers them
+        d->pins = sc->live_state;
+        d->npins = sc->nlive;
+        for (int j = 0; j < sc->nlive; ++j) {
+            int s = d->states[sc->live_state[j]]->next[c];
+            if (s < 0 && (s = dfa_step(d, sc->live_state[j], c)) < 0) { sc->failed = 1; return 0; }
+            sc->live_state[j] = s;
+        }
+        if (sc->nlive == 1 && d->states[sc->live_state[0]]->n) {
+            // a lone run has nothing to merge with, and any candidate has
+            // it as its run
+            if (d->states[sc->live_state[0]]->accept) {
+                sc->groups[sc->live[0]].accept = pos + 1;
+                if (sc->head < sc->ncands) sc->floor = pos + 1;
+            }
+            if (!start || pos < sc->floor) {
+                d->npins = 0;
+                continue;
+            }
+        }
+        int kept = 0, died = 0;
+        sc->gen++;
+        for (int j = 0; j < sc->nlive; ++j) {
+            int s = sc->live_state[j];
+            RxGroup *g = &sc->groups[sc->live[j]];
+            DfaState *st = d->states[s];
+            if (st->n == 0) {
+                g->alive = 0;
+                died = 1;
+                continue;
+            }
+            if (st->accept) g->accept = pos + 1;
+            if (sc->stamp[s] == sc->gen) {
+                g->alive = 0;
+                g->parent = sc->owner[s];
+                g->merged = pos + 1;
+                continue;
+            }
+            sc->stamp[s] = sc->gen;
+            sc->owner[s] = sc->live[j];
+            sc->live[kept] = sc->live[j];
+            sc->live_state[kept++] = s;
+        }
+        sc->nlive = kept;
+        // a new run only once the byte has told whether the current match
+        // goes past it
+        if (start && rx_wanted(sc, pos)) {
+            d->npins = sc->nlive;
+            unsigned flushes = d->flushes;
+            int s = dfa_step(d, d->start, c);
+            if (d->flushes != flushes) {
+                // the live states were renumbered
+                sc->gen++;
+                for (int j = 0; j < sc->nlive; ++j) {
+                    sc->stamp[sc->live_state[j]] = sc->gen;
+                    sc->owner[sc->live_state[j]] = sc->live[j];
+                }
+            }
+            if (s < 0 || (d->states[s]->n && !rx_add_cand(sc, pos, s))) {
+                sc->failed = 1;
+                return 0;
+            }
+        }
+        d->npins = 0;
+        if (died) rx_report(sc);
+    }
+    sc->at += n;
+    return 1;
+}
+
+// Literal prefilter: when every match starts with the same bytes, the
+// start bitmap just marks their occurrences, found with memchr, and the
+// reverse pass is skipped
+typedef struct RxLiteral {
+    const char *lit;
+    size_t len;
+    size_t at;                  // offset of the current chunk
+    unsigned long long *bits;
+} RxLiteral;
+
+static int rx_literal_chunk(void *arg, const char *p, size_t n) {
+    RxLiteral *l = (RxLiteral *)arg;
+    const char *q = p, *end = p + n;
+    while ((q = (const char *)memchr(q, l->lit[0], (size_t)(end - q))) != NULL) {
+        size_t off = l->at + (size_t)(q - p);
+        int hit;
+        if ((size_t)(end - q) >= l->len) {
+            hit = memcmp(q, l->lit, l->len) == 0;
+        } else {
+            // the literal runs into the next chunk
+            char tmp[64];
+            hit = buffer_copy_range(buf, off, l->len, tmp) == l->len
+                && memcmp(tmp, l->lit, l->len) == 0;
+        }
+        if (hit) l->bits[off >> 6] |= 1ull << (off & 63);
+        q++;
+    }
+    l->at += n;
+    return 1;
+}
+
+// regex:pattern replies with one "offset length" line per match
+static void regex_search(const char *pat) {
+    size_t plen = strlen(pat);
+    if (plen == 0) { out_puts(&reply, "Pattern empty."); return; }
+    RxParser ps = { pat, pat + plen, NULL, 0, 0, NULL };
+    // the tree is compiled recursively, so keep it shallow enough
+    if (plen > RX_MAX_PATTERN) { out_puts(&reply, "Pattern too long."); return; }
+    int max_nodes = (int)(3 * plen + 2);
+    ps.nodes = (RxNode *)malloc(sizeof(RxNode) * max_nodes);
+    if (!ps.nodes) { out_puts(&reply, "Internal error"); return; }
+    RxNode *root = rx_alt(&ps);
+    if (root && ps.p < ps.end) ps.error = "unmatched )";
+    if (!root || ps.error) {
+        out_printf(&reply, "Invalid regex: %s", ps.error ? ps.error : "syntax error");
+        free(ps.nodes);
+        return;
+    }
+    char lit[64];
+    int stop = 0;
+    size_t litlen = rx_literal_prefix(root, lit, sizeof(lit), &stop);
+
+    Nfa fwd = { NULL, 0, 0 }, rev = { NULL, 0, 0 };
+    Dfa df, dr;
+    memset(&df, 0, sizeof(df));
+    memset(&dr, 0, sizeof(dr));
+    RxScan sc;
+    memset(&sc, 0, sizeof(sc));
+    size_t n = buffer_length(buf);
+    unsigned long long *bits = (unsigned long long *)calloc((n >> 6) + 1, sizeof(unsigned long long));
+    int ok = bits && nfa_build(&fwd, root, ps.count, 0) && dfa_init(&df, &fwd, 0);
+    if (ok && litlen) {
+        RxLiteral l = { lit, litlen, 0, bits };
+        buffer_chunks(buf, 0, n, rx_literal_chunk, &l);
+    } else if (ok) {
+        ok = nfa_build(&rev, root, ps.count, 1) && dfa_init(&dr, &rev, 1);
+        if (ok) {
+            RxStarts r = { &dr, dr.start, n, bits, 0 };
+            buffer_chunks_reverse(buf, rx_starts_chunk, &r);
+            ok = !r.failed;
+        }
+        dfa_free(&dr);
+        free(rev.states);
+    }
+    if (ok) {
+        sc.dfa = &df;
+        sc.bits = bits;
+        sc.stamp = (unsigned *)calloc(df.cap, sizeof(unsigned));
+        sc.owner = (int *)malloc(sizeof(int) * df.cap);
+        ok = sc.stamp && sc.owner;
+    }
+    if (ok) {
+        buffer_chunks(buf, 0, n, rx_scan_chunk, &sc);
+        ok = !sc.failed;
+        // runs still going at the end of the document are over too
+        for (int j = 0; j < sc.nlive; ++j) sc.groups[sc.live[j]].alive = 0;
+        sc.nlive = 0;
+        if (ok) rx_report(&sc);
+    }
+    size_t matches = sc.matches;
+    if (!ok) {
+        out_reset(&reply);
+        out_puts(&reply, "Internal error");
+    } else if (matches == 0) {
+        out_puts(&reply, "Word not found!");
+    }
+    free(bits);
+    free(sc.groups);
+    free(sc.live);
+    free(sc.live_state);
+    free(sc.cands);
+    free(sc.stamp);
+    free(sc.owner);
+    dfa_free(&df);
+    free(fwd.states);
+    free(ps.nodes);
+}
+
+// Cursor motions. Each maps one cursor position to where the motion takes
+// it; line motions go through the line index, so they cost a few O(log n)
+// lookups however large the document is.
+static size_t move_left(Buffer *b, size_t pos) {
+    (void)b;
+    return pos > 0 ? pos - 1 : 0;
+}
+
+static size_t move_right(Buffer *b, size_t pos) {
+    return pos < buffer_length(b) ? pos + 1 : pos;
+}
+
+// to the start of this word or the previous one
+static size_t move_word_left(Buffer *b, size_t pos) {
+    while (pos > 0 && !is_word_char(buffer_char_at(b, pos - 1))) pos--;
+    while (pos > 0 && is_word_char(buffer_char_at(b, pos - 1))) pos--;
+    return pos;
+}
+
+// to the end of this word or the next one
+static size_t move_word_right(Buffer *b, size_t pos) {
+    size_t n = buffer_length(b);
+    while (pos < n && !is_word_char(buffer_char_at(b, pos))) pos++;
+    while (pos < n && is_word_char(buffer_char_at(b, pos))) pos++;
+    return pos;
+}
+
+// offset of the end of line (from 0), before its '\n'
+static size_t line_end(Buffer *b, size_t line) {
+    return line < buffer_newlines(b) ? buffer_line_start(b, line + 1) - 1 : buffer_length(b);
+}
+
+// col bytes into line, or the end of the line if it is shorter
+static size_t column_on_line(Buffer *b, size_t line, size_t col) {
+    size_t start = buffer_line_start(b, line);
+    size_t end = line_end(b, line);
+    return col < end - start ? start + col : end;
+}
+
+static size_t move_home(Buffer *b, size_t pos) {
+    return buffer_line_start(b, buffer_line_of(b, pos));
+}
+
+static size_t move_end(Buffer *b, size_t pos) {
+    return line_end(b, buffer_line_of(b, pos));
+}
+
+static size_t move_up(Buffer *b, size_t pos) {
+    size_t line = buffer_line_of(b, pos);
+    if (line == 0) return 0;
+    return column_on_line(b, line - 1, pos - buffer_line_start(b, line));
+}
+
+static size_t move_down(Buffer *b, size_t pos) {
+    size_t line = buffer_line_of(b, pos);
+    if (line == buffer_newlines(b)) return buffer_length(b);
+    return column_on_line(b, line + 1, pos - buffer_line_start(b, line));
+}
+
+static size_t move_top(Buffer *b, size_t pos) {
+    (void)b; (void)pos;
+    return 0;
+}
+
+static size_t move_bottom(Buffer *b, size_t pos) {
+    (void)pos;
+    return buffer_length(b);
+}
+
+static const struct {
+    const char *name;
+    CursorMoveFn fn;
+} cursor_motions[] = {
+    { "left", move_left }, { "right", move_right },
+    { "wordleft", move_word_left }, { "wordright", move_word_right },
+    { "home", move_home }, { "end", move_end },
+    { "up", move_up }, { "down", move_down },
+    { "top", move_top }, { "bottom", move_bottom },
+};
+
+// A position is a byte offset ("120") or a line and column counted from 1
+// ("7:3"); a column past the end of its line lands on the line's end.
+static int parse_position(const char *arg, size_t *pos) {
+    char *end;
+    unsigned long long a = strtoull(arg, &end, 10);
+    if (end == arg) return 0;
+    if (*end != ':') {
+        if (*end || a > buffer_length(buf)) return 0;
+        *pos = (size_t)a;
+        return 1;
+    }
+    const char *cs = end + 1;
+    unsigned long long col = strtoull(cs, &end, 10);
+    if (end == cs || *end || a == 0 || col == 0 || a > buffer_line_count(buf)) return 0;
+    *pos = column_on_line(buf, (size_t)a - 1, (size_t)col - 1);
+    return 1;
+}
+
+// append [pos, pos+n) of the document to o without an intermediate copy
+static int out_range(OutBuf *o, Buffer *b, size_t pos, size_t n) {
+    if (!out_reserve(o, n)) return 0;
+    o->len += buffer_copy_range(b, pos, n, o->data + o->len);
+    o->data[o->len] = '\0';
+    return 1;
+}
+
+static void out_buffer(OutBuf *o, Buffer *b) {
+    out_range(o, b, 0, buffer_length(b));
+}
+
+// Viewport. Once a client sets a height with view:N, edits and cursor
+// moves reply with the lines on screen instead of the whole document:
+//   lines <first>-<last> of <total>\n<text of those lines>
+// Lines count from 1 here; the view scrolls just enough to keep the
+// cursor's line on screen.
+static size_t view_height = 0;  // 0: replies carry the whole document
+static size_t view_top = 0;     // first line shown, from 0
+
+static void reply_view(int with_cursor) {
+    size_t total = buffer_line_count(buf);
+    size_t cur = buffer_cursor(buf);
+    size_t line = buffer_line_of(buf, cur);
+    if (line < view_top) view_top = line;
+    if (line >= view_top + view_height) view_top = line - view_height + 1;
+    size_t last = view_top + view_height < total ? view_top + view_height : total;
+    out_printf(&reply, "lines %zu-%zu of %zu\n", view_top + 1, last, total);
+    size_t start = buffer_line_start(buf, view_top);
+    size_t end = buffer_line_start(buf, last);
+    if (!with_cursor) {
+        out_range(&reply, buf, start, end - start);
+        return;
+    }
+    if (!out_reserve(&reply, end - start + 1)) return;
+    out_range(&reply, buf, start, cur - start);
+    out_puts(&reply, "|");
+    out_range(&reply, buf, cur, end - cur);
+}
+
+// reply for commands that change the text
+static void reply_document() {
+    if (view_height) reply_view(0);
+    else out_buffer(&reply, buf);
+}
+
+// reply for commands that move the cursor
+static void reply_cursor() {
+    if (view_height) {
+        reply_view(1);
+        return;
+    }
+    char *out = buffer_to_string_with_cursor(buf);
+    out_puts(&reply, out);
+    free(out);
+}
+
+// cursor:<motion> moves every cursor, cursor:add:<position> adds a caret
+// and cursor:single drops all carets
+static void cursor_command(const char *arg) {
+    if (strncmp(arg, "add:", 4) == 0) {
+        size_t pos;
+        if (!parse_position(arg + 4, &pos)) {
+            out_puts(&reply, "Position out of range.");
+            return;
+        }
+        if (!buffer_add_caret(buf, pos)) {
+            out_puts(&reply, "Internal error");
+            return;
+        }
+    } else if (strcmp(arg, "single") == 0) {
+        buffer_clear_carets(buf);
+    } else {
+        size_t i = 0, n = sizeof(cursor_motions) / sizeof(cursor_motions[0]);
+        while (i < n && strcmp(arg, cursor_motions[i].name) != 0) i++;
+        if (i == n) {
+            out_puts(&reply, "Invalid command.");
+            return;
+        }
+        buffer_move_cursors(buf, cursor_motions[i].fn);
+    }
+    cursor_dirty = 1;
+    reply_cursor();
+}
+
+// goto:<position> moves the primary cursor there and drops the carets
+static void goto_position(const char *arg) {
+    size_t pos;
+    if (!parse_position(arg, &pos)) {
+        out_puts(&reply, "Position out of range.");
+        return;
+    }
+    buffer_clear_carets(buf);
+    buffer_set_cursor(buf, pos);
+    cursor_dirty = 1;
+    reply_cursor();
+}
+
+static void out_cursor(OutBuf *o, size_t pos) {
+    size_t line = buffer_line_of(buf, pos);
+    out_printf(o, "%zu %zu:%zu\n", pos, line + 1, pos - buffer_line_start(buf, line) + 1);
+}
+
+// cursors replies with "offset line:column" per cursor, the primary first
+static void list_cursors() {
+    out_cursor(&reply, buffer_cursor(buf));
+    for (size_t i = 0; i < buf->ncarets; ++i) out_cursor(&reply, buf->carets[i]);
+}
+
+// Typing and backspace with carets: every cursor edits, as one undo unit.
+// The cursors are edited right to left so the positions still to be
+// edited stay valid. With n == 0 this deletes before every cursor.
+static int edit_at_cursors(const char *s, size_t n) {
+    size_t count = buf->ncarets + 1;
+    size_t *at = (size_t *)malloc(sizeof(size_t) * count);
+    if (!at) return 0;
+    at[0] = buffer_cursor(buf);
+    memcpy(at + 1, buf->carets, sizeof(size_t) * buf->ncarets);
+    qsort(at, count, sizeof(size_t), cmp_size);
+    int edited = 0;
+    for (size_t i = count; i-- > 0; ) {
+        if (n == 0 && at[i] == 0) continue;
+        if (!edited) history_begin(EDIT_OTHER);
+        if (n) doc_edit(at[i], 0, s, n);
+        else doc_edit(at[i] - 1, 1, NULL, 0);
+        edited = 1;
+    }
+    free(at);
+    return edited;
+}
+
+// lines:first[::count] replies with those lines (from 1), newlines included
+static void reply_lines(const char *arg) {
+    char *end;
+    unsigned long long first = strtoull(arg, &end, 10), count = 1;
+    if (end != arg && strncmp(end, "::", 2) == 0) {
+        const char *cs = end + 2;
+        count = strtoull(cs, &end, 10);
+        if (end == cs) end = (char *)arg;
+    }
+    if (end == arg || *end) {
+        out_puts(&reply, "Invalid lines format. Use lines:first::count");
+        return;
+    }
+    size_t total = buffer_line_count(buf);
+    if (first == 0 || first > total) {
+        out_puts(&reply, "Line out of range.");
+        return;
+    }
+    if (count > total - (first - 1)) count = total - (first - 1);
+    size_t start = buffer_line_start(buf, (size_t)first - 1);
+    out_range(&reply, buf, start, buffer_line_start(buf, (size_t)(first - 1 + count)) - start);
+}
+
+// range:pos::len replies with those bytes
+static void reply_range(const char *arg) {
+    char *end;
+    unsigned long long pos = strtoull(arg, &end, 10), n = 0;
+    if (end != arg && strncmp(end, "::", 2) == 0) {
+        const char *ns = end + 2;
+        n = strtoull(ns, &end, 10);
+        if (end == ns) end = (char *)arg;
+    } else {
+        end = (char *)arg;
+    }
+    if (end == arg || *end) {
+        out_puts(&reply, "Invalid range format. Use range:offset::length");
+        return;
+    }
+    size_t len = buffer_length(buf);
+    if (pos > len) {
+        out_puts(&reply, "Offset out of range.");
+        return;
+    }
+    if (n > len - pos) n = len - pos;
+    out_range(&reply, buf, (size_t)pos, (size_t)n);
+}
+
+// Print the document with every hit highlighted; search_and_print gets the
+// whole-word occurrences from the index
+static void print_hits(WordHit *hits, size_t count) {
+    if (!hits) { out_puts(&reply, "Word not found!"); return; }
+
+    const char *pre = "[HIGHLIGHT]";
+    const char *post = "[/HIGHLIGHT]";
+    size_t n = buffer_length(buf);
+    if (!out_reserve(&reply, n + count * (strlen(pre) + strlen(post)))) {
+        free(hits);
+        out_puts(&reply, "Internal error");
+        return;
+    }
+    size_t at = 0;
+    for (size_t i = 0; i < count; ++i) {
+        reply.len += buffer_copy_range(buf, at, hits[i].pos - at, reply.data + reply.len);
+        out_puts(&reply, pre);
+        reply.len += buffer_copy_range(buf, hits[i].pos, hits[i].len, reply.data + reply.len);
+        out_puts(&reply, post);
+        at = hits[i].pos + hits[i].len;
+    }
+    reply.len += buffer_copy_range(buf, at, n - at, reply.data + reply.len);
+    reply.data[reply.len] = '\0';
+    free(hits);
+}
+
+static void search_and_print(const char *pat, int fold) {
+    size_t m = strlen(pat);
+    if (m == 0) { out_puts(&reply, "Pattern empty."); return; }
+    size_t count = 0;
+    WordHit *hits = index_match(pat, m, fold, &count);
+    print_hits(hits, count);
+}
+
+// complete:prefix[::limit] replies with "word count" lines
+static void complete_word(const char *arg) {
+    const char *sep = strstr(arg, "::");
+    size_t plen = sep ? (size_t)(sep - arg) : strlen(arg);
+    int limit = sep ? atoi(sep + 2) : 10;
+    if (limit <= 0) limit = 10;
+    if (limit > 1000) limit = 1000;
+    Completion c = { (AVLNode **)malloc(sizeof(AVLNode *) * limit), 0, limit };
+    if (!c.best) { out_puts(&reply, "Internal error"); return; }
+    index_refresh();
+    avl_prefix_walk(word_index.root, arg, plen, completion_visit, &c);
+    for (int i = 0; i < c.count; ++i)
+        out_printf(&reply, "%s %d\n", c.best[i]->word, word_index.words[c.best[i]->id].pos_count);
+    if (c.count == 0) out_puts(&reply, "No suggestions.");
+    free(c.best);
+}
+
+// Matching a document against a full new text (the legacy save: form),
+// run by run, so the document is not copied out to compare it.
+typedef struct TextMatch {
+    const char *s;
+    size_t n;           // bytes of s left to compare
+    size_t matched;
+    size_t limit;
+} TextMatch;
+
+static int prefix_chunk(void *ctx, const char *p, size_t n) {
+    TextMatch *m = (TextMatch *)ctx;
+    size_t k = 0;
+    while (k < n && k < m->n && p[k] == m->s[m->matched + k]) k++;
+    m->matched += k;
+    m->n -= k;
+    return k == n;
+}
+
+static int suffix_chunk(void *ctx, const char *p, size_t n) {
+    TextMatch *m = (TextMatch *)ctx;
+    size_t k = 0;
+    while (k < n && m->matched + k < m->limit && p[n - 1 - k] == m->s[m->n - 1 - m->matched - k]) k++;
+    m->matched += k;
+    return k == n;
+}
+
+// bytes at the start of b that equal the start of s[0, n)
+static size_t common_prefix(Buffer *b, const char *s, size_t n) {
+    TextMatch m = { s, n, 0, n };
+    buffer_chunks(b, 0, buffer_length(b), prefix_chunk, &m);
+    return m.matched;
+}
+
+// bytes at the end of b that equal the end of s[0, n), at most limit
+static size_t common_suffix(Buffer *b, const char *s, size_t n, size_t limit) {
+    TextMatch m = { s, n, 0, limit };
+    buffer_chunks_reverse(b, suffix_chunk, &m);
+    return m.matched;
+}
+
+// Saving. The document is written under a temporary name next to the
+// target and renamed over it, so a save that fails or is cut short leaves
+// the old file whole. The text goes out straight from the engine's pieces
+// or leaves, gathered into writev batches, with no flat copy of the
+// document. --save-sync sets how far a save is flushed before it is
+// reported: none, data (fdatasync, the default) or full (fsync of the file
+// and of its directory). --save-direct writes around the page cache
+// (O_DIRECT) through a small aligned staging buffer where the file system
+// supports it.
+enum { SAVE_SYNC_NONE, SAVE_SYNC_DATA, SAVE_SYNC_FULL };
+static int save_sync = SAVE_SYNC_DATA;
+static int save_direct = 0;
+
+#define SAVE_IOV_MAX 512                    // runs per writev
+#define SAVE_DIRECT_BYTES (1024 * 1024)     // staging buffer of direct saves
+#define SAVE_DIRECT_ALIGN 4096
+
+typedef struct SaveFile {
+    int ok;
+#ifdef _WIN32
+    FILE *f;
+#else
+    int fd;
+    struct iovec iov[SAVE_IOV_MAX];
+    int niov;
+    char *stage;        // direct saves: aligned staging buffer, else NULL
+    char *stage_mem;
+    size_t staged;
+    size_t written;
+#endif
+} SaveFile;
+
+#ifdef _WIN32
+static int save_open(SaveFile *s, const char *tmp, const char *path) {
+    (void)path;
+    s->f = fopen(tmp, "wb");
+    s->ok = s->f != NULL;
+    return s->ok;
+}
+
+static int save_chunk(void *ctx, const char *p, size_t n) {
+    SaveFile *s = (SaveFile *)ctx;
+    s->ok = s->ok && fwrite(p, 1, n, s->f) == n;
+    return s->ok;
+}
+
+static int save_close(SaveFile *s) {
+    s->ok = fflush(s->f) == 0 && s->ok;
+    if (save_sync != SAVE_SYNC_NONE) s->ok = file_sync(file_fd(s->f)) == 0 && s->ok;
+    s->ok = fclose(s->f) == 0 && s->ok;
+    return s->ok;
+}
+#else
+// write all of iov[0, n), resuming after short writes
+static int write_iov(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return 0;
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 1;
+}
+
+static int save_open(SaveFile *s, const char *tmp, const char *path) {
+    memset(s, 0, sizeof(*s));
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    s->fd = -1;
+#ifdef O_DIRECT
+    if (save_direct) {
+        s->stage_mem = (char *)malloc(SAVE_DIRECT_BYTES + SAVE_DIRECT_ALIGN);
+        s->fd = s->stage_mem ? open(tmp, flags | O_DIRECT, 0666) : -1;
+        if (s->fd < 0) {
+            // not supported here (tmpfs, some network file systems)
+            free(s->stage_mem);
+            s->stage_mem = NULL;
+        } else {
+            uintptr_t at = ((uintptr_t)s->stage_mem + SAVE_DIRECT_ALIGN - 1)
+                         & ~(uintptr_t)(SAVE_DIRECT_ALIGN - 1);
+            s->stage = (char *)at;
+        }
+    }
+#endif
+    if (s->fd < 0) s->fd = open(tmp, flags, 0666);
+    s->ok = s->fd >= 0;
+    // a replaced file keeps its permissions
+    struct stat st;
+    if (s->ok && stat(path, &st) == 0) fchmod(s->fd, st.st_mode & 07777);
+    return s->ok;
+}
+
+static void save_flush(SaveFile *s) {
+    if (s->niov && s->ok) s->ok = write_iov(s->fd, s->iov, s->niov);
+    s->niov = 0;
+}
+
+static void save_stage_flush(SaveFile *s, size_t n) {
+    struct iovec one = { s->stage, n };
+    if (s->ok) s->ok = write_iov(s->fd, &one, 1);
+    s->staged = 0;
+}
+
+static int save_chunk(void *ctx, const char *p, size_t n) {
+    SaveFile *s = (SaveFile *)ctx;
+    s->written += n;
+    if (!s->stage) {
+        s->iov[s->niov].iov_base = (void *)p;
+        s->iov[s->niov].iov_len = n;
+        if (++s->niov == SAVE_IOV_MAX) save_flush(s);
+        return s->ok;
+    }
+    stat_add(STAT_TEXT_COPIED, n);
+    while (n > 0 && s->ok) {
+        size_t take = SAVE_DIRECT_BYTES - s->staged;
+        if (take > n) take = n;
+        memcpy(s->stage + s->staged, p, take);
+        s->staged += take;
+        p += take;
+        n -= take;
+        if (s->staged == SAVE_DIRECT_BYTES) save_stage_flush(s, SAVE_DIRECT_BYTES);
+    }
+    return s->ok;
+}
+
+static int save_close(SaveFile *s) {
+    save_flush(s);
+    if (s->stage && s->staged) {
+        // direct writes go in whole blocks; cut the padding off again
+        size_t n = (s->staged + SAVE_DIRECT_ALIGN - 1) & ~(size_t)(SAVE_DIRECT_ALIGN - 1);
+        memset(s->stage + s->staged, 0, n - s->staged);
+        save_stage_flush(s, n);
+        s->ok = s->ok && ftruncate(s->fd, (off_t)s->written) == 0;
+    }
+    if (save_sync == SAVE_SYNC_DATA) s->ok = s->ok && fdatasync(s->fd) == 0;
+    if (save_sync == SAVE_SYNC_FULL) s->ok = s->ok && fsync(s->fd) == 0;
+    if (s->fd >= 0) s->ok = close(s->fd) == 0 && s->ok;
+    free(s->stage_mem);
+    return s->ok;
+}
+#endif
+
+// write b to path through a temp file; the old file stays if this fails
+static int save_buffer(Buffer *b, const char *path) {
+    char tmp[600];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return 0;
+    SaveFile s;
+    if (!save_open(&s, tmp, path)) return 0;
+    buffer_chunks(b, 0, buffer_length(b), save_chunk, &s);
+    int ok = save_close(&s) && replace_file(tmp, path, save_sync == SAVE_SYNC_FULL);
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+// write the document to filename; the journal is synced first, so the
+// edits behind an explicit save are on disk as well
+static int save_document(const char *filename) {
+    StatTimer timer = stats_start(TIMER_SAVE);
+    journal_sync();
+    int ok = save_buffer(buf, filename);
+    if (!ok) {
+        out_printf(&reply, "Failed to save to %s", filename);
+    } else {
+        out_printf(&reply, "Saved to %s.", filename);
+    }
+    stats_stop(&timer, NULL);
+    return ok;
+}
+
+// Sessions. The backend holds any number of documents, keyed by id. The
+// active document's state lives in the globals every command works on
+// (buf, the undo/redo stacks, the word index, the journal, the viewport);
+// switching documents parks that state in its Document and brings the
+// other one's back. When the parked documents take more than the memory
+// budget, the least recently used ones are evicted: their journal is synced
+// and closed and their memory freed. An evicted document is loaded again
+// from its snapshot and journal the next time it is opened.
+#define DEFAULT_DOC "default"   // lives directly in DATA_DIR
+
+// A frozen version of the active document's text that readers on other
+// threads work on while the document keeps changing. The newest one is
+// kept as published and handed out until the text changes again.
+typedef struct DocVersion {
+    int refs;
+    Buffer *text;
+} DocVersion;
+
+static DocVersion *published;
+
+static void version_release(DocVersion *v) {
+    if (!v || --v->refs > 0) return;
+    buffer_free(v->text);
+    free(v);
+}
+
+// the active document as it is now; NULL when out of memory
+static DocVersion *version_acquire() {
+    if (!buf) return NULL;
+    if (published && published->text->version != buf->version) {
+        version_release(published);
+        published = NULL;
+    }
+    if (!published) {
+        DocVersion *v = (DocVersion *)malloc(sizeof(DocVersion));
+        StatTimer timer = stats_start(TIMER_FREEZE);
+        Buffer *text = v ? buffer_freeze(buf) : NULL;
+        stats_stop(&timer, NULL);
+        if (!text) { free(v); return NULL; }
+        v->refs = 1;
+        v->text = text;
+        published = v;
+    }
+    published->refs++;
+    return published;
+}
+
+typedef struct Document {
+    char id[DOC_ID_MAX + 1];
+    char dir[DOC_DIR_MAX];
+    int loaded;
+    unsigned long long last_used;   // LRU clock
+    size_t footprint;               // bytes held when it was parked
+    Buffer *buf;
+    MemStack undo, redo;
+    WordIndex index;
+    int typing_open, cursor_dirty;
+    FILE *journal;
+    unsigned long journal_gen, journal_first_gen, loaded_snapshot_gen;
+    size_t journal_bytes;
+    int journal_pending, journal_failed;
+    int syncing;                    // the worker is syncing its journal unlocked
+    size_t view_height, view_top;
+    DocVersion *published;
+} Document;
+
+static Document **docs;
+static int doc_count, doc_cap;
+static Document *active;
+static unsigned long long lru_clock;
+static size_t memory_budget = (size_t)512 * 1024 * 1024;   // --memory=MB
+
+// ids name directories, so they are kept to a safe alphabet
+static int valid_doc_id(const char *id) {
+    size_t n = strlen(id);
+    if (n == 0 || n > DOC_ID_MAX || id[0] == '.') return 0;
+    for (size_t i = 0; i < n; ++i)
+        if (!isalnum((unsigned char)id[i]) && id[i] != '-' && id[i] != '_' && id[i] != '.') return 0;
+    return 1;
+}
+
+// rough bytes held by the active document: text, history and index
+static size_t doc_footprint() {
+    size_t bytes = buffer_length(buf);
+    MemStack *stacks[2] = { &undo_stack, &redo_stack };
+    for (int k = 0; k < 2; ++k)
+        for (int i = 0; i < stacks[k]->size; ++i) {
+            EditGroup *g = &stacks[k]->items[i];
+            bytes += sizeof(EditGroup) + sizeof(EditOp) * (size_t)g->cap;
+            for (int j = 0; j < g->count; ++j) bytes += g->ops[j].rlen + g->ops[j].ilen + 2;
+        }
+    WordIndex *ix = &word_index;
+    bytes += sizeof(WordEntry) * ix->word_cap + sizeof(unsigned int) * ix->table_cap;
+    for (int i = 0; i < ix->count; ++i) {
+        IndexSegment *seg = ix->segs[i];
+        bytes += sizeof(IndexToken) * (size_t)seg->tok_cap + sizeof(SegWord) * (size_t)seg->word_cap;
+    }
+    return bytes;
+}
+
+// move the active document's state out of the globals into d
+static void doc_park(Document *d) {
+    compact_wait();
+    d->footprint = doc_footprint();
+    d->buf = buf; buf = NULL;
+    d->undo = undo_stack; memstack_init(&undo_stack);
+    d->redo = redo_stack; memstack_init(&redo_stack);
+    d->index = word_index; memset(&word_index, 0, sizeof(word_index));
+    d->typing_open = typing_open; typing_open = 0;
+    d->cursor_dirty = cursor_dirty; cursor_dirty = 0;
+    d->journal = journal; journal = NULL;
+    d->journal_gen = journal_gen;
+    d->journal_first_gen = journal_first_gen;
+    d->loaded_snapshot_gen = loaded_snapshot_gen;
+    d->journal_bytes = journal_bytes;
+    d->journal_pending = journal_pending; journal_pending = 0;
+    d->journal_failed = journal_failed; journal_failed = 0;
+    d->view_height = view_height;
+    d->view_top = view_top;
+    d->published = published; published = NULL;
+}
+
+// make d's state the globals; they must be empty (parked or unloaded)
+static void doc_restore(Document *d) {
+    snprintf(doc_dir, sizeof(doc_dir), "%s", d->dir);
+    buf = d->buf; d->buf = NULL;
+    undo_stack = d->undo; memstack_init(&d->undo);
+    redo_stack = d->redo; memstack_init(&d->redo);
+    word_index = d->index; memset(&d->index, 0, sizeof(d->index));
+    typing_open = d->typing_open;
+    cursor_dirty = d->cursor_dirty;
+    journal = d->journal; d->journal = NULL;
+    journal_gen = d->journal_gen;
+    journal_first_gen = d->journal_first_gen;
+    loaded_snapshot_gen = d->loaded_snapshot_gen;
+    journal_bytes = d->journal_bytes;
+    journal_pending = d->journal_pending;
+    journal_failed = d->journal_failed;
+    view_height = d->view_height;
+    view_top = d->view_top;
+    published = d->published; d->published = NULL;
+}
+
+// sync and free everything the globals hold for the active document
+static void doc_unload() {
+    version_release(published);
+    published = NULL;
+    journal_close();
+    index_free();
+    buffer_free(buf);
+    buf = NULL;
+    remove_stale_snapshot();
+    memstack_free(&undo_stack);
+    memstack_free(&redo_stack);
+    typing_open = cursor_dirty = 0;
+}
+
+// evict the parked document d: swap it in, unload it, swap back
+static void doc_evict(Document *d) {
+    if (!d->loaded || d == active) return;
+    Document *cur = active;
+    doc_park(cur);
+    doc_restore(d);
+    doc_unload();
+    d->loaded = 0;
+    doc_park(d);
+    doc_restore(cur);
+}
+
+// evict least recently used documents until the parked ones fit the budget
+static void session_trim() {
+    for (;;) {
+        size_t total = 0;
+        Document *lru = NULL;
+        for (int i = 0; i < doc_count; ++i) {
+            Document *d = docs[i];
+            // one whose journal failed holds the only copy of its edits
+            if (!d->loaded || d == active || d->journal_failed) continue;
+            total += d->footprint;
+            if (!lru || d->last_used < lru->last_used) lru = d;
+        }
+        if (!lru || total <= memory_budget) return;
+        doc_evict(lru);
+    }
+}
+
+static Document *doc_find(const char *id) {
+    for (int i = 0; i < doc_count; ++i)
+        if (strcmp(docs[i]->id, id) == 0) return docs[i];
+    return NULL;
+}
+
+static Document *doc_new(const char *id) {
+    if (doc_count == doc_cap) {
+        int newcap = doc_cap ? doc_cap * 2 : 8;
+        Document **tmp = (Document **)realloc(docs, sizeof(Document *) * newcap);
+        if (!tmp) return NULL;
+        docs = tmp;
+        doc_cap = newcap;
+    }
+    Document *d = (Document *)calloc(1, sizeof(Document));
+    if (!d) return NULL;
+    snprintf(d->id, sizeof(d->id), "%s", id);
+    if (strcmp(id, DEFAULT_DOC) == 0) {
+        snprintf(d->dir, sizeof(d->dir), "%s", DATA_DIR);
+    } else {
+        snprintf(d->dir, sizeof(d->dir), "%s/%s", DOCS_DIR, id);
+        MKDIR(DOCS_DIR);
+        MKDIR(d->dir);
+    }
+    memstack_init(&d->undo);
+    memstack_init(&d->redo);
+    docs[doc_count++] = d;
+    return d;
+}
+
+// make the document with this id active, loading it if it is not in
+// memory; returns 0 for a bad id or when out of memory
+static int session_open(const char *id) {
+    if (!valid_doc_id(id)) return 0;
+    Document *d = doc_find(id);
+    if (!d) d = doc_new(id);
+    if (!d) return 0;
+    d->last_used = ++lru_clock;
+    if (d == active) return 1;
+    if (active) {
+        journal_commit();
+        doc_park(active);
+    }
+    doc_restore(d);
+    if (!d->loaded) {
+        load_document();
+        d->loaded = 1;
+    }
+    active = d;
+    session_trim();
+    return 1;
+}
+
+// whether an earlier session left a document with this id on disk
+static int doc_stored(const char *id) {
+    char dir[DOC_DIR_MAX];
+    struct stat st;
+    snprintf(dir, sizeof(dir), "%s/%s", DOCS_DIR, id);
+    return stat(dir, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+static void doc_sync_wait();
+
+// drop a document and its storage; the default document cannot go.
+// Returns -1 when there is no such document, in memory or on disk.
+static int session_close(const char *id) {
+    if (!valid_doc_id(id) || strcmp(id, DEFAULT_DOC) == 0) return 0;
+    Document *d = doc_find(id);
+    // the worker holds on to a document it is syncing; wait for it, then
+    // look the document up again, as another request may have closed it
+    while (d && d->syncing) {
+        doc_sync_wait();
+        d = doc_find(id);
+    }
+    if (!d && !doc_stored(id)) return -1;
+    if (!d) d = doc_new(id);
+    if (!d) return 0;
+    if (d == active) {
+        if (!session_open(DEFAULT_DOC)) return 0;
+    }
+    doc_evict(d);
+    // with the document unloaded its files can go; they are in its own
+    // directory, under the names load_document() looks for
+    Document *cur = active;
+    doc_park(cur);
+    doc_restore(d);
+    char path[DOC_PATH_MAX];
+    unsigned long gen = 0;
+    read_snapshot_gen(&gen);
+    snapshot_path(path, sizeof(path), gen);
+    remove(path);
+    for (unsigned long g = gen; ; ++g) {
+        journal_path(path, sizeof(path), g);
+        int gone = remove(path) == 0;
+        snapshot_path(path, sizeof(path), g + 1);
+        gone = (remove(path) == 0) || gone;
+        if (!gone) break;
+    }
+    const char *names[] = { SNAPSHOT_CURRENT, SNAPSHOT_CURRENT ".tmp", SNAPSHOT_TMP };
+    for (int i = 0; i < 3; ++i) {
+        doc_path(path, sizeof(path), names[i]);
+        remove(path);
+    }
+    RMDIR(d->dir);
+    doc_park(d);
+    doc_restore(cur);
+    for (int i = 0; i < doc_count; ++i) {
+        if (docs[i] != d) continue;
+        memmove(&docs[i], &docs[i + 1], sizeof(Document *) * (size_t)(doc_count - i - 1));
+        doc_count--;
+        break;
+    }
+    free(d);
+    return 1;
+}
+
+// unload every document at exit
+static void session_shutdown() {
+    if (active) {
+        doc_unload();
+        active->loaded = 0;
+        doc_park(active);
+    }
+    for (int i = 0; i < doc_count; ++i) {
+        Document *d = docs[i];
+        if (d->loaded) {
+            doc_restore(d);
+            doc_unload();
+            doc_park(d);
+        }
+        free(d);
+    }
+    free(docs);
+    docs = NULL;
+    doc_count = doc_cap = 0;
+    active = NULL;
+}
+
+// docs replies with "id state bytes" per document, the active one first
+static void list_docs() {
+    out_printf(&reply, "%s active %zu\n", active->id, doc_footprint());
+    for (int i = 0; i < doc_count; ++i) {
+        Document *d = docs[i];
+        if (d == active) continue;
+        out_printf(&reply, "%s %s %zu\n", d->id, d->loaded ? "parked" : "evicted", d->footprint);
+    }
+}
+
+// stats replies with the counters and timers as JSON:
+//   {"enabled":true,"counters":{"allocs":N,...},
+//    "timers":{"command":{"count":N,"total_ms":T,"max_ms":M},...}}
+static void stats_reply() {
+#ifdef WITH_STATS
+    out_puts(&reply, "{\"enabled\":true,\"counters\":{");
+    for (int i = 0; i < STAT_COUNT; ++i)
+        out_printf(&reply, "%s\"%s\":%llu", i ? "," : "", stat_names[i], ATOMIC_LOAD(&stat_counters[i]));
+    out_puts(&reply, "},\"timers\":{");
+    for (int i = 0; i < TIMER_COUNT; ++i) {
+        TimerTotals *t = &timer_totals[i];
+        out_printf(&reply, "%s\"%s\":{\"count\":%llu,\"total_ms\":%.3f,\"max_ms\":%.3f}",
+                   i ? "," : "", timer_names[i], ATOMIC_LOAD(&t->count),
+                   ATOMIC_LOAD(&t->total_ns) / 1e6, ATOMIC_LOAD(&t->max_ns) / 1e6);
+    }
+    out_puts(&reply, "}}");
+#else
+    out_puts(&reply, "{\"enabled\":false}");
+#endif
+}
+
+static void stats_reset() {
+#ifdef WITH_STATS
+    memset((void *)stat_counters, 0, sizeof(stat_counters));
+    memset(timer_totals, 0, sizeof(timer_totals));
+#endif
+}
+
+// wait:index[:<version>] replies once the word index covers that text
+// version (default: the current one). Rather than sleep until the
+// background worker gets there, the request does the rest itself.
+static void wait_index(const char *arg) {
+    unsigned long long want = buf->version;
+    if (*arg == ':') want = strtoull(arg + 1, NULL, 10);
+    else if (*arg) { out_puts(&reply, "Invalid command."); return; }
+    if (want > buf->version) {
+        out_printf(&reply, "Version not reached: text %llu", buf->version);
+        return;
+    }
+    if (index_version() < want) index_refresh();
+    out_printf(&reply, "index %llu", index_version());
+}
+
+// Commands that only read the text. With --listen they run on a frozen
+// version of the document, outside the document lock.
+static int is_read_command(const char *raw) {
+    return strcmp(raw, "show") == 0 || strncmp(raw, "range:", 6) == 0
+        || strncmp(raw, "lines:", 6) == 0 || strncmp(raw, "find:", 5) == 0
+        || strncmp(raw, "ifind:", 6) == 0 || strncmp(raw, "regex:", 6) == 0;
+}
+
+// commands that change the text; save:name::content replaces it before
+// saving
+static int is_edit_command(const char *raw) {
+    return strncmp(raw, "insert:", 7) == 0 || strcmp(raw, "delete") == 0
+        || strcmp(raw, "new") == 0 || strncmp(raw, "replace:", 8) == 0
+        || strncmp(raw, "batchreplace:", 13) == 0
+        || (strncmp(raw, "save:", 5) == 0 && strstr(raw + 5, "::"))
+        || strcmp(raw, "undo") == 0 || strcmp(raw, "redo") == 0;
+}
+
+static void run_command(const char *raw) {
+    StatTimer timer = stats_start(TIMER_COMMAND);
+    // anything but typing, backspace or reading ends the current typing
+    // undo unit
+    if (strncmp(raw, "insert:", 7) != 0 && strcmp(raw, "delete") != 0 && !is_read_command(raw))
+        typing_open = 0;
+
+    if (is_edit_command(raw) && edits_refused()) {
+        // the reply says why
+    }
+    else if (strcmp(raw, "undo") == 0) {
+        if (!history_step(&undo_stack, &redo_stack, 1)) {
+            out_puts(&reply, "Nothing to undo!");
+        } else {
+            reply_document();
+        }
+    }
+    else if (strncmp(raw, "search:", 7) == 0) {
+        search_and_print(raw + 7, 0);
+    }
+    else if (strncmp(raw, "isearch:", 8) == 0) {
+        search_and_print(raw + 8, 1);
+    }
+    else if (strncmp(raw, "complete:", 9) == 0) {
+        complete_word(raw + 9);
+    }
+    else if (strncmp(raw, "find:", 5) == 0 || strncmp(raw, "ifind:", 6) == 0) {
+        StatTimer timer = stats_start(TIMER_FIND);
+        int fold = raw[0] == 'i';
+        find_patterns(raw + 5 + fold, fold);
+        stats_stop(&timer, NULL);
+    }
+    else if (strncmp(raw, "regex:", 6) == 0) {
+        StatTimer timer = stats_start(TIMER_REGEX);
+        regex_search(raw + 6);
+        stats_stop(&timer, NULL);
+    }
+    else if (strncmp(raw, "insert:", 7) == 0) {
+        const char *s = raw + 7;
+        size_t n = strlen(s);
+        if (n && buf->ncarets) {
+            edit_at_cursors(s, n);
+        } else if (n) {
+            history_begin(EDIT_TYPING);
+            // insert at cursor
+            doc_edit(buffer_cursor(buf), 0, s, n);
+        }
+        reply_document();
+    }
+    else if (strcmp(raw, "delete") == 0) {
+        size_t cur = buffer_cursor(buf);
+        if (buf->ncarets) {
+            if (edit_at_cursors(NULL, 0)) reply_document();
+            else out_puts(&reply, "Nothing to delete");
+        } else if (cur > 0) {
+            history_begin(EDIT_BACKSPACE);
+            doc_edit(cur - 1, 1, NULL, 0);
+            reply_document();
+        } else {
+            out_puts(&reply, "Nothing to delete");
+        }
+    }
+    else if (strncmp(raw, "cursor:", 7) == 0) {
+        cursor_command(raw + 7);
+    }
+    else if (strncmp(raw, "goto:", 5) == 0) {
+        goto_position(raw + 5);
+    }
+    else if (strcmp(raw, "cursors") == 0) {
+        list_cursors();
+    }
+    else if (strncmp(raw, "open:", 5) == 0) {
+        if (!session_open(raw + 5)) out_puts(&reply, "Invalid document id.");
+        else reply_document();
+    }
+    else if (strncmp(raw, "close:", 6) == 0) {
+        int r = session_close(raw + 6);
+        if (r < 0) out_printf(&reply, "Document %s does not exist.", raw + 6);
+        else if (r == 0) out_puts(&reply, "Cannot close that document.");
+        else out_printf(&reply, "Closed %s.", raw + 6);
+    }
+    else if (strcmp(raw, "docs") == 0) {
+        list_docs();
+    }
+    else if (strcmp(raw, "showcursor") == 0) {
+        reply_cursor();
+    }
+    else if (strcmp(raw, "new") == 0) {
+        if (buffer_length(buf) > 0) {
+            history_begin(EDIT_OTHER);
+            doc_edit(0, buffer_length(buf), NULL, 0);
+        }
+    }
+
+    else if (strncmp(raw, "save:", 5) == 0) {
+
+        const char *p = raw + 5;
+        const char *sep = strstr(p, "::");
+        char filename[512];
+        const char *content;
+        if (sep) {
+            size_t fnlen = sep - p;
+            if (fnlen >= sizeof(filename)) fnlen = sizeof(filename)-1;
+            strncpy(filename, p, fnlen);
+            filename[fnlen] = '\0';
+            content = sep + 2;
+        } else {
+
+            strcpy(filename, "document.txt");
+            content = NULL;
+        }
+
+        if (content) {
+            // record only the span that differs from what we hold
+            size_t oldlen = buffer_length(buf);
+            size_t newlen = strlen(content);
+            size_t pre = common_prefix(buf, content, newlen);
+            size_t limit = (oldlen < newlen ? oldlen : newlen) - pre;
+            size_t suf = common_suffix(buf, content, newlen, limit);
+            if (pre != oldlen || pre != newlen) {
+                history_begin(EDIT_OTHER);
+                doc_edit(pre, oldlen - pre - suf, content + pre, newlen - pre - suf);
+                buffer_set_cursor(buf, buffer_length(buf));
+            }
+        }
+        save_document(filename);
+    }
+
+    else if (strncmp(raw, "replace:", 8) == 0) {
+        // format: replace:old::new
+        const char *p = raw + 8;
+        const char *sep = strstr(p, "::");
+        if (!sep) {
+            out_puts(&reply, "Invalid replace format. Use replace:old::new");
+        } else {
+            size_t oldlen = sep - p;
+            char oldw[512];
+            if (oldlen >= sizeof(oldw)) oldlen = sizeof(oldw)-1;
+            strncpy(oldw, p, oldlen); oldw[oldlen] = '\0';
+            const char *neww = sep + 2;
+
+            ReplacePair pair = { oldw, oldlen, neww, strlen(neww) };
+            if (!replace_words(&pair, 1)) {
+                out_puts(&reply, "Word not found!");
+            } else {
+                reply_document();
+            }
+        }
+    }
+
+    else if (strncmp(raw, "batchreplace:", 13) == 0) {
+        // format: batchreplace:old1::new1\nold2::new2...; all pairs are
+        // applied at once, so a replacement is never replaced again
+        const char *p = raw + 13;
+        ReplacePair *pairs = NULL;
+        int npairs = 0, cap = 0, bad = 0;
+        while (*p && !bad) {
+            const char *eol = strchr(p, '\n');
+            if (!eol) eol = p + strlen(p);
+            const char *sep = strstr(p, "::");
+            if (eol > p) {
+                if (!sep || sep > eol) { bad = 1; break; }
+                if (npairs == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    ReplacePair *tmp = (ReplacePair *)realloc(pairs, sizeof(ReplacePair) * cap);
+                    if (!tmp) { bad = 1; break; }
+                    pairs = tmp;
+                }
+                ReplacePair *rp = &pairs[npairs++];
+                rp->oldw = p;
+                rp->oldlen = (size_t)(sep - p);
+                rp->neww = sep + 2;
+                rp->newlen = (size_t)(eol - sep - 2);
+            }
+            p = *eol ? eol + 1 : eol;
+        }
+        if (bad || npairs == 0) {
+            out_puts(&reply, "Invalid batchreplace format. Use batchreplace:old::new, one pair per line");
+        } else if (!replace_words(pairs, npairs)) {
+            out_puts(&reply, "Word not found!");
+        } else {
+            reply_document();
+        }
+        free(pairs);
+    }
+
+    else if (strcmp(raw, "redo") == 0) {
+        if (!history_step(&redo_stack, &undo_stack, 0)) {
+            out_puts(&reply, "Nothing to redo!");
+        } else {
+            reply_document();
+        }
+    }
+
+    else if (strcmp(raw, "show") == 0) {
+        out_buffer(&reply, buf);
+    }
+    else if (strncmp(raw, "view:", 5) == 0) {
+        view_height = strtoul(raw + 5, NULL, 10);
+        reply_document();
+    }
+    else if (strncmp(raw, "lines:", 6) == 0) {
+        reply_lines(raw + 6);
+    }
+    else if (strncmp(raw, "range:", 6) == 0) {
+        reply_range(raw + 6);
+    }
+    else if (strcmp(raw, "flush") == 0) {
+        if (journal_commit()) out_puts(&reply, "Flushed.");
+        else out_puts(&reply, "Journal write failed.");
+    }
+    else if (strcmp(raw, "stats") == 0) {
+        stats_reply();
+    }
+    else if (strcmp(raw, "stats:reset") == 0) {
+        stats_reset();
+        out_puts(&reply, "Stats reset.");
+    }
+    else if (strcmp(raw, "version") == 0) {
+        out_printf(&reply, "text %llu index %llu", buf->version, index_version());
+    }
+    else if (strncmp(raw, "wait:index", 10) == 0) {
+        wait_index(raw + 10);
+    }
+    else {
+        out_puts(&reply, "Invalid command.");
+    }
+    stats_stop(&timer, raw);
+}
+
+// Serve mode: one process handles a stream of length-prefixed commands so
+// the document and undo/redo stacks stay in memory between actions.
+//   request:  <decimal byte count>\n<command bytes>
+//   response: <decimal byte count>\n<reply bytes>
+// The command "quit" (or EOF) ends the session after flushing to disk, and
+// so does a malformed header.
+#define FRAME_MAX_BYTES (1ul << 30)
+
+static char *read_frame(FILE *in, size_t *out_len) {
+    char header[32];
+    if (!fgets(header, sizeof(header), in)) return NULL;
+    // digits and the newline only: strtoul would also take spaces and a
+    // sign, turning -1 into ULONG_MAX
+    if (!isdigit((unsigned char)header[0])) return NULL;
+    char *end = NULL;
+    unsigned long n = strtoul(header, &end, 10);
+    // the cap also keeps n + 1 from wrapping (an overflow gives ULONG_MAX)
+    if (*end != '\n' || n > FRAME_MAX_BYTES) return NULL;
+    char *cmd = (char *)malloc(n + 1);
+    if (!cmd) return NULL;
+    if (fread(cmd, 1, n, in) != n) { free(cmd); return NULL; }
+    cmd[n] = '\0';
+    *out_len = n;
+    return cmd;
+}
+
+static void write_frame(FILE *out, const char *data, size_t n) {
+    StatTimer timer = stats_start(TIMER_REPLY_WRITE);
+    fprintf(out, "%lu\n", (unsigned long)n);
+    if (n) fwrite(data, 1, n, out);
+    fflush(out);
+    stat_add(STAT_REPLY_BYTES, n);
+    stats_stop(&timer, NULL);
+}
+
+// Binary mode (--binary): frames are length-prefixed, all integers little
+// endian, and a client may send many requests before reading any reply;
+// replies come back in request order.
+//   request:  u32 length | u8 opcode | u32 tag | payload
+//   response: u32 length | u8 status | u32 tag | payload
+// length counts the bytes after itself and tag is echoed back unchanged.
+// Requests that arrive together are answered together, after one journal
+// sync, so a burst of edits costs one sync and one write.
+enum {
+    OP_COMMAND = 1,     // payload: any text command; reply: its text reply
+    OP_EDIT = 2,        // u64 pos | u64 removed | inserted bytes; reply: u64 new length
+    OP_READ = 3,        // u64 pos | u64 length; reply: those bytes
+    OP_SAVE = 4,        // file name; reply: message
+    OP_UNDO = 5,        // reply: the document
+    OP_REDO = 6,        // reply: the document
+    OP_QUIT = 7,
+    OP_LINES = 8,       // u64 first line (from 1) | u64 count; reply: u64 offset | those lines
+    OP_OPEN = 9         // document id; reply: u64 length of that document
+};
+
+enum { STATUS_OK = 0, STATUS_ERROR = 1 };
+
+#define FRAME_HEADER_BYTES 9
+
+// run one binary request; returns the status and leaves the payload in reply
+static int run_binary(int op, const char *payload, size_t n) {
+    ByteReader r = { payload, payload + n, 1 };
+    if (op != OP_EDIT && op != OP_READ && op != OP_LINES && op != OP_COMMAND) typing_open = 0;
+    if ((op == OP_EDIT || op == OP_UNDO || op == OP_REDO) && edits_refused()) return STATUS_ERROR;
+    switch (op) {
+    case OP_COMMAND: {
+        char *cmd = arena_dup(&scratch, payload, n);
+        if (!cmd) { out_puts(&reply, "Internal error"); return STATUS_ERROR; }
+        int refused = journal_failed && is_edit_command(cmd);
+        run_command(cmd);
+        return refused ? STATUS_ERROR : STATUS_OK;
+    }
+    case OP_EDIT: {
+        unsigned long long pos = get_uint(&r, 8), rlen = get_uint(&r, 8);
+        size_t len = buffer_length(buf);
+        if (!r.ok || pos > len || rlen > len - pos) {
+            out_puts(&reply, "Edit out of range.");
+            return STATUS_ERROR;
+        }
+        size_t ilen = (size_t)(r.end - r.p);
+        if (rlen || ilen) {
+            // pure inserts and deletes group like typing and backspace
+            history_begin(rlen == 0 ? EDIT_TYPING : ilen == 0 ? EDIT_BACKSPACE : EDIT_OTHER);
+            buffer_set_cursor(buf, (size_t)(pos + rlen));
+            doc_edit((size_t)pos, (size_t)rlen, r.p, ilen);
+            buffer_set_cursor(buf, (size_t)pos + ilen);
+        }
+        put_u64(&reply, buffer_length(buf));
+        return STATUS_OK;
+    }
+    case OP_READ: {
+        unsigned long long pos = get_uint(&r, 8), count = get_uint(&r, 8);
+        size_t len = buffer_length(buf);
+        if (!r.ok || pos > len) {
+            out_puts(&reply, "Read out of range.");
+            return STATUS_ERROR;
+        }
+        if (count > len - pos) count = len - pos;
+        if (!out_range(&reply, buf, (size_t)pos, (size_t)count)) {
+            out_puts(&reply, "Internal error");
+            return STATUS_ERROR;
+        }
+        return STATUS_OK;
+    }
+    case OP_LINES: {
+        unsigned long long first = get_uint(&r, 8), count = get_uint(&r, 8);
+        size_t total = buffer_line_count(buf);
+        if (!r.ok || first == 0 || first > total) {
+            out_puts(&reply, "Line out of range.");
+            return STATUS_ERROR;
+        }
+        if (count > total - (first - 1)) count = total - (first - 1);
+        size_t start = buffer_line_start(buf, (size_t)first - 1);
+        size_t end = buffer_line_start(buf, (size_t)(first - 1 + count));
+        put_u64(&reply, start);
+        if (!out_range(&reply, buf, start, end - start)) {
+            out_reset(&reply);
+            out_puts(&reply, "Internal error");
+            return STATUS_ERROR;
+        }
+        return STATUS_OK;
+    }
+    case OP_SAVE: {
+        char filename[512];
+        if (n == 0 || n >= sizeof(filename) || memchr(payload, '\0', n)) {
+            out_puts(&reply, "Invalid file name.");
+            return STATUS_ERROR;
+        }
+        memcpy(filename, payload, n);
+        filename[n] = '\0';
+        return save_document(filename) ? STATUS_OK : STATUS_ERROR;
+    }
+    case OP_UNDO:
+    case OP_REDO:
+        if (op == OP_UNDO ? !history_step(&undo_stack, &redo_stack, 1)
+                          : !history_step(&redo_stack, &undo_stack, 0)) {
+            out_puts(&reply, op == OP_UNDO ? "Nothing to undo!" : "Nothing to redo!");
+            return STATUS_ERROR;
+        }
+        reply_document();
+        return STATUS_OK;
+    case OP_OPEN: {
+        char id[DOC_ID_MAX + 1];
+        if (n == 0 || n > DOC_ID_MAX || memchr(payload, '\0', n)) {
+            out_puts(&reply, "Invalid document id.");
+            return STATUS_ERROR;
+        }
+        memcpy(id, payload, n);
+        id[n] = '\0';
+        if (!session_open(id)) {
+            out_puts(&reply, "Invalid document id.");
+            return STATUS_ERROR;
+        }
+        put_u64(&reply, buffer_length(buf));
+        return STATUS_OK;
+    }
+    case OP_QUIT:
+        out_puts(&reply, "Bye.");
+        return STATUS_OK;
+    default:
+        out_puts(&reply, "Unknown opcode.");
+        return STATUS_ERROR;
+    }
+}
+
+static unsigned long read_u32(const char *p) {
+    ByteReader r = { p, p + 4, 1 };
+    return (unsigned long)get_uint(&r, 4);
+}
+
+// Many clients (--listen). Every connection speaks the binary protocol on
+// its own thread and has its own active document. Requests that change
+// anything run one at a time under doc_lock, against the shared document
+// state. Reads (OP_READ, OP_LINES and the read-only text commands) only
+// take the lock to grab the current frozen version of their document; the
+// scan itself runs outside it, so a long search never holds up an edit,
+// and it sees one consistent version however the text changes meanwhile.
+typedef struct Client {
+    SOCKET sock;                    // INVALID_SOCKET: stdin and stdout
+    char doc[DOC_ID_MAX + 1];       // document this client works on
+    int locked;                     // holds doc_lock
+} Client;
+
+static int listening = 0;
+static int doc_shared = 0;          // doc_lock guards the documents
+static CRITICAL_SECTION doc_lock;
+static Buffer *shared_buf;          // the active document's buffer while unlocked
+
+// from here on the documents are shared between threads (the clients and
+// the background worker) and only touched under doc_lock
+static void doc_share() {
+    InitializeCriticalSection(&doc_lock);
+    shared_buf = buf;
+    buf = NULL;
+    doc_shared = 1;
+}
+
+// take the document lock and make c's document active
+static void doc_enter(Client *c) {
+    if (!doc_shared || c->locked) return;
+    EnterCriticalSection(&doc_lock);
+    c->locked = 1;
+    buf = shared_buf;
+    session_open(c->doc);
+}
+
+static void doc_leave(Client *c) {
+    if (!c->locked) return;
+    // remember an open: so the client stays on that document
+    if (active) snprintf(c->doc, sizeof(c->doc), "%s", active->id);
+    shared_buf = buf;
+    buf = NULL;
+    c->locked = 0;
+    LeaveCriticalSection(&doc_lock);
+}
+
+// Background worker. Edits only mark word index segments dirty, and with
+// --autosave=MS leave their journal records unsynced. Once no change has
+// come in for WORKER_DEBOUNCE_MS, this thread retokenizes the dirty
+// segments, WORKER_SLICE_BYTES at a time with the lock dropped in between,
+// so a request waits for one slice at most. It syncs the journal on its own
+// copy of the file handle, outside the lock, once edits pause or the oldest
+// unsynced one is MS old. Queries that need the index before the worker
+// gets there finish the refresh themselves.
+#define WORKER_DEBOUNCE_MS 30
+#define WORKER_SLICE_BYTES (256 * 1024)
+
+static Thread worker_thread;
+static CONDITION_VARIABLE worker_wake;
+static CONDITION_VARIABLE sync_done;    // a document's syncing went back to 0
+static int worker_quit;
+static int autosave_ms;         // 0: sync before every reply
+static DWORD last_change;       // GetTickCount() of the last change
+
+// sync the active journal through a duplicate handle, so the lock can be
+// dropped meanwhile; the records count as synced only if none came after.
+// The document stays pinned until then: session_close waits for it.
+static void worker_sync() {
+    Document *d = active;
+    unsigned long gen = journal_gen;
+    size_t bytes = journal_bytes;
+    if (journal_failed || fflush(journal) != 0) { journal_failed = 1; return; }
+    int fd = fd_dup(file_fd(journal));
+    if (fd < 0) { journal_sync(); return; }
+    d->syncing = 1;
+    buf = NULL;
+    LeaveCriticalSection(&doc_lock);
+    StatTimer timer = stats_start(TIMER_JOURNAL_SYNC);
+    int ok = file_sync(fd) == 0;
+    stats_stop(&timer, NULL);
+    fd_close(fd);
+    EnterCriticalSection(&doc_lock);
+    d->syncing = 0;
+    WakeAllConditionVariable(&sync_done);
+    // the next edit to the document is refused, which reports a failure
+    if (!ok && active == d) journal_failed = 1;
+    else if (!ok) d->journal_failed = 1;
+    else if (active == d && journal_gen == gen && journal_bytes == bytes) journal_pending = 0;
+}
+
+// wait, under doc_lock, for the worker to finish a sync. Other requests
+// run meanwhile and may switch documents, so the caller's one is made
+// active again afterwards.
+static void doc_sync_wait() {
+    char id[DOC_ID_MAX + 1];
+    snprintf(id, sizeof(id), "%s", active->id);
+    shared_buf = buf;
+    buf = NULL;
+    SleepConditionVariableCS(&sync_done, &doc_lock, INFINITE);
+    buf = shared_buf;
+    session_open(id);
+}
+
+static DWORD WINAPI worker_main(LPVOID arg) {
+    (void)arg;
+    EnterCriticalSection(&doc_lock);
+    while (!worker_quit) {
+        buf = shared_buf;
+        DWORD now = GetTickCount();
+        DWORD quiet = now - last_change;
+        int sync = journal && journal_pending && !journal_failed
+                && (quiet >= WORKER_DEBOUNCE_MS || now - unsynced_since >= (DWORD)autosave_ms);
+        int index = buf && word_index.dirty && quiet >= WORKER_DEBOUNCE_MS;
+        if (sync) {
+            worker_sync();
+        } else if (index) {
+            index_refresh_some(WORKER_SLICE_BYTES);
+        } else {
+            // sleep until the next change, or until pending work is due
+            DWORD wait = INFINITE;
+            if (journal_pending && !journal_failed) wait = WORKER_DEBOUNCE_MS;
+            else if (buf && word_index.dirty) wait = WORKER_DEBOUNCE_MS - quiet;
+            buf = NULL;
+            SleepConditionVariableCS(&worker_wake, &doc_lock, wait);
+            continue;
+        }
+        // let waiting requests in between slices
+        buf = NULL;
+        LeaveCriticalSection(&doc_lock);
+        SwitchToThread();
+        EnterCriticalSection(&doc_lock);
+    }
+    buf = NULL;
+    LeaveCriticalSection(&doc_lock);
+    return 0;
+}
+
+static void worker_start() {
+    InitializeConditionVariable(&worker_wake);
+    InitializeConditionVariable(&sync_done);
+    last_change = GetTickCount();
+    worker_thread = thread_start(worker_main, NULL);
+}
+
+static void worker_stop() {
+    if (!worker_thread) return;
+    EnterCriticalSection(&doc_lock);
+    worker_quit = 1;
+    WakeConditionVariable(&worker_wake);
+    LeaveCriticalSection(&doc_lock);
+    thread_join(worker_thread);
+    worker_thread = NULL;
+}
+
+// End of a run of changes, under the lock: sync them before the replies
+// go out, or with --autosave hand that to the worker
+static void changes_done() {
+    if (autosave_ms > 0 && worker_thread) {
+        journal_cursors();
+    } else {
+        journal_commit();
+    }
+    journal_maybe_compact();
+    last_change = GetTickCount();
+    if (worker_thread) WakeConditionVariable(&worker_wake);
+}
+
+// Edits only apply while the journal works, so once a change is made and
+// the journal has failed by the time it is synced, that change is not on
+// disk: its reply becomes this error.
+#define JOURNAL_FAILED_REPLY "Journal write failed; the change is not on disk."
+
+// the batch's changes did not reach the disk: rewrite the replies at the
+// given wire offsets (u64 each, ascending) into errors
+static void fail_replies(OutBuf *wire, const OutBuf *changed) {
+    OutBuf out = { NULL, 0, 0 };
+    ByteReader r = { changed->data, changed->data + changed->len, 1 };
+    size_t next = (size_t)get_uint(&r, 8);
+    for (size_t at = 0; at < wire->len; ) {
+        size_t len = 4 + (size_t)read_u32(wire->data + at);
+        if (r.ok && at == next) {
+            put_u32(&out, (unsigned long)(sizeof(JOURNAL_FAILED_REPLY) - 1 + 5));
+            put_u8(&out, STATUS_ERROR);
+            out_write(&out, wire->data + at + 5, 4);
+            out_puts(&out, JOURNAL_FAILED_REPLY);
+            next = (size_t)get_uint(&r, 8);
+        } else {
+            out_write(&out, wire->data + at, len);
+        }
+        at += len;
+    }
+    free(wire->data);
+    *wire = out;
+}
+
+static int is_read_request(int op, const char *payload, size_t n) {
+    if (op == OP_READ || op == OP_LINES) return 1;
+    if (op != OP_COMMAND) return 0;
+    if ((n >= 7 && memcmp(payload, "search:", 7) == 0) || (n >= 8 && memcmp(payload, "isearch:", 8) == 0))
+        return 1;
+    char head[8];
+    size_t k = n < sizeof(head) - 1 ? n : sizeof(head) - 1;
+    memcpy(head, payload, k);
+    head[k] = '\0';
+    // "show" must match exactly; the others are prefixes
+    return (n == 4 && memcmp(payload, "show", 4) == 0)
+        || (strcmp(head, "show") != 0 && is_read_command(head));
+}
+
+// run a read on a frozen version of c's document. Index searches look the
+// words up under the lock (the index follows the live text, which is the
+// version taken at the same moment) and print outside it.
+static int run_read(Client *c, int op, const char *payload, size_t n) {
+    char *cmd = NULL;
+    if (op == OP_COMMAND) {
+        cmd = arena_dup(&scratch, payload, n);
+        if (!cmd) { out_puts(&reply, "Internal error"); return STATUS_ERROR; }
+    }
+    int fold = cmd && strncmp(cmd, "isearch:", 8) == 0;
+    const char *pat = !cmd ? NULL : fold ? cmd + 8 : strncmp(cmd, "search:", 7) == 0 ? cmd + 7 : NULL;
+    WordHit *hits = NULL;
+    size_t count = 0;
+    doc_enter(c);
+    if (pat && *pat) hits = index_match(pat, strlen(pat), fold, &count);
+    DocVersion *v = version_acquire();
+    doc_leave(c);
+
+    int status = STATUS_OK;
+    buf = v ? v->text : NULL;
+    if (!v) {
+        free(hits);
+        out_puts(&reply, "Internal error");
+        status = STATUS_ERROR;
+    } else if (pat && !*pat) {
+        out_puts(&reply, "Pattern empty.");
+    } else if (pat) {
+        print_hits(hits, count);
+    } else if (cmd) {
+        run_command(cmd);
+    } else {
+        status = run_binary(op, payload, n);
+    }
+    buf = NULL;
+
+    doc_enter(c);
+    version_release(v);
+    doc_leave(c);
+    return status;
+}
+
+static int client_read(Client *c, char *dst, int n) {
+    if (c->sock == INVALID_SOCKET) return fd_read(file_fd(stdin), dst, n);
+    return recv(c->sock, dst, n, 0);
+}
+
+static int client_write(Client *c, const char *data, size_t n) {
+    StatTimer timer = stats_start(TIMER_REPLY_WRITE);
+    int ok = 1;
+    stat_add(STAT_REPLY_BYTES, n);
+    if (c->sock == INVALID_SOCKET) {
+        fwrite(data, 1, n, stdout);
+        ok = fflush(stdout) == 0;
+    }
+    while (c->sock != INVALID_SOCKET && ok && n > 0) {
+        int sent = send(c->sock, data, n > 65536 ? 65536 : (int)n, 0);
+        ok = sent > 0;
+        if (ok) {
+            data += sent;
+            n -= (size_t)sent;
+        }
+    }
+    stats_stop(&timer, NULL);
+    return ok;
+}
+
+static void binary_loop(Client *c) {
+    OutBuf in = { NULL, 0, 0 };
+    OutBuf wire = { NULL, 0, 0 };
+    OutBuf changed = { NULL, 0, 0 };    // wire offsets of replies to changes
+    size_t head = 0;
+    int quit = 0;
+    while (!quit) {
+        // answer every complete request already received
+        int wrote = 0;
+        while (!quit && in.len - head >= 4) {
+            size_t n = (size_t)read_u32(in.data + head);
+            if (n < 5) { quit = 1; break; }     // malformed: drop the client
+            if (in.len - head - 4 < n) break;
+            const char *f = in.data + head + 4;
+            int op = (unsigned char)f[0];
+            unsigned long tag = read_u32(f + 1);
+            out_reset(&reply);
+            int status;
+            StatTimer timer = stats_start(TIMER_REQUEST);
+            if (listening && is_read_request(op, f + 5, n - 5)) {
+                doc_leave(c);
+                status = run_read(c, op, f + 5, n - 5);
+            } else {
+                doc_enter(c);
+                Buffer *b = buf;
+                unsigned long long version = buf->version;
+                status = run_binary(op, f + 5, n - 5);
+                if (buf == b && buf->version != version) put_u64(&changed, wire.len);
+                wrote = 1;
+            }
+            stats_stop(&timer, NULL);
+            scratch_reset();
+            put_u32(&wire, (unsigned long)(reply.len + 5));
+            put_u8(&wire, (unsigned)status);
+            put_u32(&wire, tag);
+            out_write(&wire, reply.data ? reply.data : "", reply.len);
+            head += 4 + n;
+            quit = op == OP_QUIT;
+        }
+        if (wrote) {
+            // the changes are on disk before the client sees the replies,
+            // unless --autosave defers that
+            doc_enter(c);
+            changes_done();
+            if (journal_failed && changed.len) fail_replies(&wire, &changed);
+            out_reset(&changed);
+        }
+        doc_leave(c);
+        if (wire.len) {
+            if (!client_write(c, wire.data, wire.len)) break;
+            out_reset(&wire);
+        }
+        if (quit) break;
+        // keep the partial request and read more behind it
+        if (head) memmove(in.data, in.data + head, in.len - head);
+        in.len -= head;
+        head = 0;
+        if (!out_reserve(&in, 65536)) break;
+        int got = client_read(c, in.data + in.len, 65536);
+        if (got <= 0) break;
+        in.len += (size_t)got;
+    }
+    free(in.data);
+    free(wire.data);
+    free(changed.data);
+}
+
+static DWORD WINAPI client_main(LPVOID arg) {
+    Client *c = (Client *)arg;
+    binary_loop(c);
+    closesocket(c->sock);
+    out_free(&reply);
+    arena_release(&scratch);
+    free(c);
+    return 0;
+}
+
+// accept clients on 127.0.0.1:port until the process is stopped; every
+// change is synced before its reply, so stopping it loses nothing
+static int listen_loop(int port, const char *start_doc) {
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return 0;
+    SOCKET ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (ls == INVALID_SOCKET) return 0;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)port);
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ls, SOMAXCONN) != 0) {
+        closesocket(ls);
+        return 0;
+    }
+    listening = 1;
+    for (;;) {
+        SOCKET s = accept(ls, NULL, NULL);
+        if (s == INVALID_SOCKET) continue;
+        Client *c = (Client *)calloc(1, sizeof(Client));
+        if (!c) { closesocket(s); continue; }
+        c->sock = s;
+        snprintf(c->doc, sizeof(c->doc), "%s", start_doc);
+        Thread t = thread_start(client_main, c);
+        if (!t) { closesocket(s); free(c); continue; }
+        thread_detach(t);
+    }
+}
+
+static void serve_loop(Client *c) {
+    stream_binary(stdin);
+    stream_binary(stdout);
+    size_t len;
+    char *cmd;
+    while ((cmd = read_frame(stdin, &len)) != NULL) {
+        int quit = strcmp(cmd, "quit") == 0;
+        out_reset(&reply);
+        doc_enter(c);
+        Buffer *b = buf;
+        unsigned long long version = buf->version;
+        if (quit) {
+            out_puts(&reply, "Bye.");
+        } else {
+            run_command(cmd);
+        }
+        // the change is on disk before the client sees the reply, unless
+        // --autosave defers that
+        changes_done();
+        if (journal_failed && buf == b && buf->version != version) {
+            out_reset(&reply);
+            out_puts(&reply, JOURNAL_FAILED_REPLY);
+        }
+        doc_leave(c);
+        scratch_reset();
+        write_frame(stdout, reply.data ? reply.data : "", reply.len);
+        free(cmd);
+        if (quit) break;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *start_doc = DEFAULT_DOC;
+    int listen_port = 0;
+#ifndef _WIN32
+    // a client that goes away is seen as a failed write, not a signal
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    ensure_dirs();
+    // initialize in-memory undo/redo stacks
+    memstack_init(&undo_stack);
+    memstack_init(&redo_stack);
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--serve") == 0) serve_mode = 1;
+        else if (strcmp(argv[i], "--binary") == 0) serve_mode = binary_mode = 1;
+        else if (strncmp(argv[i], "--listen=", 9) == 0) {
+            listen_port = atoi(argv[i] + 9);
+            serve_mode = binary_mode = 1;
+        }
+        else if (strcmp(argv[i], "--engine=rope") == 0) buffer_engine = ENGINE_ROPE;
+        else if (strcmp(argv[i], "--engine=pieces") == 0) buffer_engine = ENGINE_PIECES;
+        else if (strncmp(argv[i], "--threads=", 10) == 0) pool_threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--memory=", 9) == 0) memory_budget = (size_t)strtoull(argv[i] + 9, NULL, 10) * 1024 * 1024;
+        else if (strncmp(argv[i], "--doc=", 6) == 0) start_doc = argv[i] + 6;
+        else if (strncmp(argv[i], "--autosave=", 11) == 0) autosave_ms = atoi(argv[i] + 11);
+        else if (strcmp(argv[i], "--save-sync=none") == 0) save_sync = SAVE_SYNC_NONE;
+        else if (strcmp(argv[i], "--save-sync=data") == 0) save_sync = SAVE_SYNC_DATA;
+        else if (strcmp(argv[i], "--save-sync=full") == 0) save_sync = SAVE_SYNC_FULL;
+        else if (strcmp(argv[i], "--save-direct") == 0) save_direct = 1;
+        else if (strcmp(argv[i], "--compress") == 0) snapshot_compress = 1;
+        else if (strncmp(argv[i], "--trace=", 8) == 0) {
+#ifdef WITH_STATS
+            if (!trace_open(argv[i] + 8)) fprintf(stderr, "Cannot write %s\n", argv[i] + 8);
+#else
+            fprintf(stderr, "--trace needs a build with WITH_STATS\n");
+#endif
+        }
+    }
+
+    if (serve_mode) {
+        if (!session_open(start_doc)) session_open(DEFAULT_DOC);
+        Client c = { INVALID_SOCKET, "", 0 };
+        snprintf(c.doc, sizeof(c.doc), "%s", active ? active->id : DEFAULT_DOC);
+        doc_share();
+        worker_start();
+        if (listen_port > 0) {
+            if (!listen_loop(listen_port, c.doc))
+                fprintf(stderr, "Cannot listen on port %d\n", listen_port);
+        } else if (binary_mode) {
+            stream_binary(stdin);
+            stream_binary(stdout);
+            binary_loop(&c);
+        } else {
+            serve_loop(&c);
+        }
+        worker_stop();
+        buf = shared_buf;
+    } else {
+        size_t cap = 1024;
+        size_t len = 0;
+        char *raw = (char *)malloc(cap + 1);
+        if (!raw) return 0;
+        int ch;
+        while ((ch = fgetc(stdin)) != EOF) {
+            if (len + 1 >= cap) {
+                cap *= 2;
+                char *tmp = (char *)realloc(raw, cap + 1);
+                if (!tmp) { free(raw); return 0; }
+                raw = tmp;
+            }
+            raw[len++] = (char)ch;
+        }
+        raw[len] = '\0';
+
+        while (len > 0 && (raw[len-1] == '\n' || raw[len-1] == '\r')) raw[--len] = '\0';
+        if (len == 0) { free(raw); return 0; }
+
+        if (!session_open(start_doc)) session_open(DEFAULT_DOC);
+        unsigned long long version = buf->version;
+        run_command(raw);
+        if (!journal_commit() && buf->version != version) {
+            out_reset(&reply);
+            out_puts(&reply, JOURNAL_FAILED_REPLY);
+        }
+        journal_maybe_compact();
+        if (reply.len) fwrite(reply.data, 1, reply.len, stdout);
+        stat_add(STAT_REPLY_BYTES, reply.len);
+        free(raw);
+    }
+
+    session_shutdown();
+    pool_stop();
+    out_free(&reply);
+#ifdef WITH_STATS
+    trace_close();
+#endif
+    return 0;
+}
@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+# Benchmark for the backend. For every document size it writes a synthetic
+# document into a scratch directory, starts a fresh backend there with
+# --binary and times the editing and search commands one request at a time:
+# insert:, delete, search:, replace:, undo, redo and save (opcode 4).
+# It reports latency percentiles and throughput per command and the peak
+# RSS of the backend process, and can compare a run against an earlier one
+# saved with --json.
+#
+#   python3 bench.py --sizes 1K,1M,64M --ops 200 --json run.json
+#   python3 bench.py --baseline run.json      # exits 1 on a regression
+import argparse
+import json
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+OP_COMMAND, OP_EDIT, OP_READ, OP_SAVE, OP_UNDO, OP_REDO, OP_QUIT = range(1, 8)
+
+DEFAULT_SIZES = "1K,64K,1M,16M,256M,1G"
+UNITS = {"": 1, "K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+
+# the word replace: and search: look for; it occurs once per MARKER_EVERY
+# bytes, so the work they do grows with the document
+MARKER = "quixotic"
+MARKER_EVERY = 64 * 1024
+WORDS = ("the of and to in is that it for was on are as with his they at be this "
+         "from have or by one had not but what all were when we there can an your "
+         "which their said if do will each about how up out them then she many some "
+         "so these would other into has more her two like him see time could no make "
+         "than first been its who now people my made over did down only way find use "
+         "may water long little very after words called just where most know").split()
+
+
+def parse_size(text):
+    text = text.strip().upper().rstrip("B")
+    unit = text[-1:] if text[-1:] in UNITS else ""
+    return int(float(text[:len(text) - len(unit)]) * UNITS[unit])
+
+
+def format_size(n):
+    for unit in ("G", "M", "K"):
+        if n >= UNITS[unit] and n % UNITS[unit] == 0:
+            return f"{n // UNITS[unit]}{unit}"
+    return str(n)
+
+
+# One MiB of lines of common words (a marker every MARKER_EVERY bytes),
+# repeated up to size. Seeded, so every run benchmarks the same text.
+def make_document(path, size, seed):
+    rng = random.Random(seed)
+    block = bytearray()
+    next_marker = 0
+    while len(block) < (1 << 20):
+        line = []
+        while sum(len(w) + 1 for w in line) < 60:
+            if len(block) >= next_marker:
+                line.append(MARKER)
+                next_marker += MARKER_EVERY
+            else:
+                # a skewed pick, so a few words are very common
+                line.append(WORDS[int(len(WORDS) * rng.random() ** 2)])
+        block += (" ".join(line) + "\n").encode()
+    block = bytes(block[:1 << 20])
+    with open(path, "wb") as f:
+        left = size
+        while left > 0:
+            f.write(block[:left])
+            left -= min(left, len(block))
+
+
+class Backend:
+    def __init__(self, exe, workdir, extra):
+        self.proc = subprocess.Popen([exe, "--binary"] + extra, cwd=workdir,
+                                     stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.tag = 0
+
+    def request(self, op, payload=b""):
+        if isinstance(payload, str):
+            payload = payload.encode()
+        self.tag += 1
+        self.proc.stdin.write(struct.pack("<IBI", len(payload) + 5, op, self.tag) + payload)
+        self.proc.stdin.flush()
+        head = self.proc.stdout.read(4)
+        if len(head) < 4:
+            raise RuntimeError("backend exited")
+        n = struct.unpack("<I", head)[0]
+        body = self.proc.stdout.read(n)
+        return body[0], body[5:]
+
+    def command(self, text):
+        return self.request(OP_COMMAND, text)
+
+    # quit and return the peak RSS in bytes (None where it is not known)
+    def stop(self):
+        self.request(OP_QUIT)
+        self.proc.stdin.close()
+        if not hasattr(os, "wait4"):
+            self.proc.wait()
+            return None
+        _, _, usage = os.wait4(self.proc.pid, 0)
+        self.proc.returncode = 0
+        # ru_maxrss is in KiB on Linux and in bytes on macOS
+        return usage.ru_maxrss * (1 if sys.platform == "darwin" else 1024)
+
+
+def timed(fn):
+    t = time.perf_counter()
+    fn()
+    return time.perf_counter() - t
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    k = max(0, min(len(sorted_values) - 1, int(round(p / 100 * len(sorted_values) + 0.5)) - 1))
+    return sorted_values[k]
+
+
+def summarize(samples, size, per_op_bytes):
+    s = sorted(samples)
+    total = sum(s)
+    row = {
+        "count": len(s),
+        "p50_ms": percentile(s, 50) * 1e3,
+        "p90_ms": percentile(s, 90) * 1e3,
+        "p99_ms": percentile(s, 99) * 1e3,
+        "max_ms": s[-1] * 1e3 if s else 0.0,
+        "ops_per_s": len(s) / total if total else 0.0,
+    }
+    # commands that go over the whole document also get a byte rate
+    if per_op_bytes:
+        row["mb_per_s"] = len(s) * size / total / (1 << 20) if total else 0.0
+    return row
+
+
+def bench_size(args, size):
+    work = tempfile.mkdtemp(prefix="mwp-bench-", dir=args.workdir)
+    try:
+        os.makedirs(os.path.join(work, "backend_data"))
+        make_document(os.path.join(work, "backend_data", "current.txt"), size, args.seed)
+        rng = random.Random(args.seed)
+        results = {}
+        t = time.perf_counter()
+        be = Backend(args.backend, work, args.backend_args)
+        # edits reply with the lines around the cursor, as an editor would
+        # ask for, rather than the whole document
+        be.command(f"view:{args.view}")
+        results["open"] = summarize([time.perf_counter() - t], size, True)
+
+        ops = args.ops
+        # commands that read or write the whole document run fewer times
+        heavy = max(3, ops // 20) if size <= (64 << 20) else 3
+        length = size
+
+        def insert():
+            be.command("insert:bench ")
+
+        def delete():
+            be.command("delete")
+
+        samples = {"insert": [], "delete": []}
+        for _ in range(ops):
+            be.command(f"goto:{rng.randrange(length + 1)}")
+            samples["insert"].append(timed(insert))
+            length += len("bench ")
+        for _ in range(ops):
+            be.command(f"goto:{rng.randrange(1, length + 1)}")
+            samples["delete"].append(timed(delete))
+            length -= 1
+        samples["undo"] = [timed(lambda: be.request(OP_UNDO)) for _ in range(ops)]
+        samples["redo"] = [timed(lambda: be.request(OP_REDO)) for _ in range(ops)]
+        samples["search"] = [timed(lambda: be.command(f"search:{MARKER}")) for _ in range(heavy)]
+        samples["replace"] = []
+        for i in range(heavy):
+            old, new = (MARKER, MARKER + "al") if i % 2 == 0 else (MARKER + "al", MARKER)
+            samples["replace"].append(timed(lambda: be.command(f"replace:{old}::{new}")))
+        out = os.path.join(work, "saved.txt")
+        samples["save"] = [timed(lambda: be.request(OP_SAVE, out)) for _ in range(heavy)]
+
+        for name, s in samples.items():
+            results[name] = summarize(s, size, name in ("search", "replace", "save"))
+        rss = be.stop()
+        return {"size": size, "peak_rss": rss, "ops": results}
+    finally:
+        if not args.keep:
+            shutil.rmtree(work, ignore_errors=True)
+
+
+def print_report(runs):
+    print(f"{'size':>6} {'command':<8} {'count':>6} {'p50 ms':>9} {'p90 ms':>9} {'p99 ms':>9} "
+          f"{'max ms':>9} {'ops/s':>10} {'MB/s':>8}")
+    for run in runs:
+        for name, r in run["ops"].items():
+            mbs = f"{r['mb_per_s']:8.1f}" if "mb_per_s" in r else f"{'':>8}"
+            print(f"{format_size(run['size']):>6} {name:<8} {r['count']:>6} {r['p50_ms']:9.3f} "
+                  f"{r['p90_ms']:9.3f} {r['p99_ms']:9.3f} {r['max_ms']:9.3f} {r['ops_per_s']:10.1f} {mbs}")
+        rss = run["peak_rss"]
+        print(f"{format_size(run['size']):>6} peak RSS {rss / (1 << 20):.1f} MiB" if rss is not None
+              else f"{format_size(run['size']):>6} peak RSS n/a")
+
+
+# p50 latencies that got slower than the baseline by more than tolerance
+def regressions(runs, baseline, tolerance):
+    base = {(r["size"], name): v for r in baseline["runs"] for name, v in r["ops"].items()}
+    found = []
+    for run in runs:
+        for name, r in run["ops"].items():
+            b = base.get((run["size"], name))
+            if b and b["p50_ms"] > 0 and r["p50_ms"] > b["p50_ms"] * (1 + tolerance):
+                found.append((run["size"], name, b["p50_ms"], r["p50_ms"]))
+    return found
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    exe = os.path.join(here, "backend.exe" if os.name == "nt" else "backend")
+    ap = argparse.ArgumentParser(description="Benchmark the backend commands.")
+    ap.add_argument("--backend", default=exe, help="backend executable")
+    ap.add_argument("--sizes", default=DEFAULT_SIZES, help="document sizes, e.g. 1K,64M,1G")
+    ap.add_argument("--ops", type=int, default=200, help="requests per cheap command")
+    ap.add_argument("--view", type=int, default=40, help="lines edits reply with (0: everything)")
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--workdir", default=None, help="where the scratch directories go")
+    ap.add_argument("--keep", action="store_true", help="keep the scratch directories")
+    ap.add_argument("--json", help="also write the results here")
+    ap.add_argument("--baseline", help="results of an earlier run to compare with")
+    ap.add_argument("--tolerance", type=float, default=0.25,
+                    help="allowed p50 slowdown against the baseline (0.25 = 25%%)")
+    ap.add_argument("backend_args", nargs="*", help="extra backend flags, after --")
+    args = ap.parse_args()
+
+    runs = []
+    for text in args.sizes.split(","):
+        size = parse_size(text)
+        print(f"benchmarking {format_size(size)} ...", file=sys.stderr)
+        runs.append(bench_size(args, size))
+    print_report(runs)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"backend_args": args.backend_args, "runs": runs}, f, indent=1)
+    if args.baseline:
+        with open(args.baseline) as f:
+            found = regressions(runs, json.load(f), args.tolerance)
+        for size, name, was, now in found:
+            print(f"regression: {format_size(size)} {name} p50 {was:.3f} -> {now:.3f} ms")
+        if found:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,385 @@
+#!/usr/bin/env python3
+# Regression tests for the backend, run by `make test`. Every test starts
+# fresh backends with --binary in a scratch directory of its own, once per
+# buffer engine, and checks their replies against a model:
+#   regex   regex: on random patterns and texts, against a leftmost-longest
+#           matcher that takes what classes and escapes mean from re
+#   crash   random edits, undos and redos, kill -9 and a restart (once with
+#           a torn record at the end of the journal); the text and the whole
+#           undo/redo history must come back, down to the text imported at
+#           the start
+#   packed  --compress: a packed snapshot round-trips the text and history,
+#           and one with a damaged block is refused rather than loaded
+#
+#   python3 tests/test_backend.py                # every test
+#   python3 tests/test_backend.py regex --seed 7
+import argparse
+import os
+import random
+import re
+import shutil
+import struct
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+from bench import Backend, OP_EDIT, OP_READ, OP_UNDO, OP_REDO  # noqa: E402
+
+ENGINES = ("pieces", "rope")
+
+
+class Failure(Exception):
+    pass
+
+
+def shorten(value):
+    text = repr(value)
+    return text if len(text) <= 200 else text[:200] + "..."
+
+
+def expect(got, want, what):
+    if got != want:
+        raise Failure(f"{what}: got {shorten(got)}, want {shorten(want)}")
+
+
+class Session:
+    """A backend in a scratch directory that outlives it, so a test can
+    restart it over the same backend_data/."""
+
+    def __init__(self, args, engine, extra=()):
+        self.exe = args.backend
+        self.flags = [f"--engine={engine}"] + list(extra)
+        self.work = tempfile.mkdtemp(prefix="mwp-test-", dir=args.workdir)
+        self.keep = args.keep
+        self.backend = None
+
+    def start(self):
+        self.backend = Backend(self.exe, self.work, self.flags)
+        return self.backend
+
+    def stop(self):
+        if self.backend:
+            self.backend.stop()
+            self.backend.proc.wait()
+            self.backend = None
+
+    def close(self):
+        if self.backend:
+            self.backend.proc.kill()
+            self.backend.proc.wait()
+            self.backend = None
+        if not self.keep:
+            shutil.rmtree(self.work, ignore_errors=True)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def edit(b, pos, removed, text):
+    status, body = b.request(OP_EDIT, struct.pack("<QQ", pos, removed) + text)
+    expect(status, 0, f"edit at {pos}")
+    return struct.unpack("<Q", body[:8])[0]
+
+
+def read_all(b):
+    status, body = b.request(OP_READ, struct.pack("<QQ", 0, 1 << 62))
+    expect(status, 0, "read")
+    return body
+
+
+def set_text(b, text):
+    edit(b, 0, len(read_all(b)), text)
+
+
+# regex
+
+REGEX_TEXT = b"ab c1_.\n\t"
+REGEX_ATOMS = (b"a", b"b", b"c", b" ", b"1", b"\\.", b"\\n", b".", b"[ab]",
+               b"[^a ]", b"[a-c]", b"[.1]", b"\\d", b"\\w", b"\\s", b"\\W", b"\\D")
+
+
+# A random pattern in the syntax regex: and re share (literals, ., classes
+# and their escapes, groups, | and the * + ? quantifiers), and its tree:
+# ("atom", re), ("seq", nodes), ("alt", nodes) or (quantifier, node).
+def random_pattern(rng, depth=0):
+    branches = []
+    for _ in range(rng.choice((1, 1, 2))):
+        text, seq = b"", []
+        for _ in range(rng.randint(1, 3)):
+            if depth < 2 and rng.random() < 0.25:
+                sub, node = random_pattern(rng, depth + 1)
+                sub = b"(" + sub + b")"
+            else:
+                sub = rng.choice(REGEX_ATOMS)
+                node = ("atom", re.compile(sub))
+            quantifier = rng.choice((b"", b"", b"*", b"+", b"?"))
+            text += sub + quantifier
+            seq.append((quantifier.decode(), node) if quantifier else node)
+        branches.append((text, ("seq", seq)))
+    return b"|".join(t for t, _ in branches), ("alt", [n for _, n in branches])
+
+
+# The ends of every match of node in text starting at one of starts. It
+# follows all the ways through the pattern at once, so unlike re it never
+# backtracks; re only decides which bytes an atom takes.
+def match_ends(node, text, starts):
+    kind = node[0]
+    if kind == "atom":
+        return {i + 1 for i in starts if i < len(text) and node[1].fullmatch(text, i, i + 1)}
+    if kind == "seq":
+        for sub in node[1]:
+            starts = match_ends(sub, text, starts)
+        return starts
+    if kind == "alt":
+        return set().union(*(match_ends(sub, text, starts) for sub in node[1]))
+    if kind == "?":
+        return set(starts) | match_ends(node[1], text, starts)
+    reached = set(starts) if kind == "*" else set()
+    frontier = match_ends(node[1], text, starts)
+    while frontier - reached:
+        frontier -= reached
+        reached |= frontier
+        frontier = match_ends(node[1], text, frontier)
+    return reached
+
+
+# Leftmost-longest, non-overlapping, non-empty matches, the way regex:
+# reports them: the earliest start with a non-empty match, the longest match
+# there, and on from its end.
+def reference_matches(tree, text):
+    found = []
+    i = 0
+    while i < len(text):
+        end = max(match_ends(tree, text, {i}), default=i)
+        if end == i:
+            i += 1
+        else:
+            found.append((i, end - i))
+            i = end
+    return found
+
+
+def regex_reply(b, pattern):
+    status, body = b.command(b"regex:" + pattern)
+    expect(status, 0, f"regex:{pattern!r}")
+    if body == b"Word not found!":
+        return []
+    return [tuple(int(x) for x in line.split()) for line in body.decode().splitlines()]
+
+
+def test_regex(args, engine):
+    rng = random.Random(args.seed)
+    with Session(args, engine) as s:
+        b = s.start()
+        for _ in range(40):
+            text = bytes(rng.choice(REGEX_TEXT) for _ in range(rng.randint(0, 40)))
+            set_text(b, text)
+            for _ in range(10):
+                pattern, tree = random_pattern(rng)
+                want = reference_matches(tree, text)
+                expect(regex_reply(b, pattern), want, f"regex:{pattern!r} on {text!r}")
+        # more DFA states than the cache holds, so matching flushes it on
+        # the way; over a and b alone the one match runs from 0 to the end
+        # of the last a with 13 bytes after it
+        text = bytes(rng.choice(b"ab") for _ in range(1 << 17))
+        set_text(b, text)
+        pattern = b"(a|b)*a" + b"(a|b)" * 13
+        last = text.rfind(b"a", 0, len(text) - 13)
+        expect(regex_reply(b, pattern), [(0, last + 14)], "regex: past the DFA cache")
+        for pattern in (b"^a", b"a$"):
+            status, body = b.command(b"regex:" + pattern)
+            expect(body, b"Invalid regex: anchors are not supported", f"regex:{pattern!r}")
+        s.stop()
+
+
+# crash
+
+# The document as the backend should have it: the texts undo steps back
+# through, the current one and the texts redo steps forward through.
+class History:
+    def __init__(self, base):
+        self.undo, self.text, self.redo = [], base, []
+
+    def edit(self, b, rng):
+        n = len(self.text)
+        pos = rng.randint(0, n)
+        removed = rng.choice((0, 0, rng.randint(0, min(n - pos, 40))))
+        inserted = bytes(rng.choice(b"abc xyz\n") for _ in range(rng.choice((0, 1, 1, 5, 60))))
+        if not removed and not inserted:
+            inserted = b"q"
+        expect(edit(b, pos, removed, inserted), n - removed + len(inserted), "edit length")
+        self.undo.append(self.text)
+        self.text = self.text[:pos] + inserted + self.text[pos + removed:]
+        self.redo.clear()
+
+    def step(self, b, op):
+        back, forward = (self.undo, self.redo) if op == OP_UNDO else (self.redo, self.undo)
+        status, body = b.request(op)
+        if not back:
+            expect((status, body), (1, b"Nothing to undo!" if op == OP_UNDO else b"Nothing to redo!"),
+                   "undo/redo past the end")
+            return False
+        forward.append(self.text)
+        self.text = back.pop()
+        expect((status, body), (0, self.text), "undo" if op == OP_UNDO else "redo")
+        return True
+
+    # walk the whole history after a restart: every redo, every undo down to
+    # the base text and every redo again, ending where it started
+    def verify(self, b, base):
+        expect(read_all(b), self.text, "text after restart")
+        redos = 0
+        while self.step(b, OP_REDO):
+            redos += 1
+        while self.step(b, OP_UNDO):
+            pass
+        expect(self.text, base, "text after undoing everything")
+        while self.step(b, OP_REDO):
+            pass
+        for _ in range(redos):
+            self.step(b, OP_UNDO)
+
+
+def newest_journal(work):
+    data = os.path.join(work, "backend_data")
+    names = [n for n in os.listdir(data) if re.fullmatch(r"journal\.\d+", n)]
+    return os.path.join(data, max(names, key=lambda n: int(n.split(".")[1])))
+
+
+def test_crash(args, engine):
+    rng = random.Random(args.seed)
+    base = b"".join(b"line %d of the imported text\n" % i for i in range(200))
+    with Session(args, engine) as s:
+        os.makedirs(os.path.join(s.work, "backend_data"))
+        with open(os.path.join(s.work, "backend_data", "current.txt"), "wb") as f:
+            f.write(base)
+        h = History(base)
+        for round in range(4):
+            b = s.start()
+            h.verify(b, base)
+            for _ in range(150):
+                r = rng.random()
+                if r < 0.15:
+                    h.step(b, OP_UNDO)
+                elif r < 0.25:
+                    h.step(b, OP_REDO)
+                else:
+                    h.edit(b, rng)
+            s.backend.proc.kill()
+            s.backend.proc.wait()
+            s.backend = None
+            if round == 2:
+                # the head of a record whose payload never made it to disk,
+                # as if the machine died mid-write; the next start drops it
+                with open(newest_journal(s.work), "ab") as f:
+                    f.write(struct.pack("<BII", 1, 64, 0) + b"garbage")
+        b = s.start()
+        h.verify(b, base)
+        s.stop()
+
+
+# packed
+
+# where each block of the snapshot's text stream starts, its length and
+# whether it is stored as is; see put_blocks() in backend.c
+def text_blocks(snapshot):
+    expect(snapshot[:8], b"MWPSNAP4", "packed snapshot magic")
+    at = 24 + struct.unpack_from("<Q", snapshot, 16)[0] + 4
+    count = struct.unpack_from("<I", snapshot, at + 8)[0]
+    table, at = at + 12, at + 12 + 8 * count
+    blocks = []
+    for i in range(count):
+        size = struct.unpack_from("<I", snapshot, table + 8 * i)[0]
+        blocks.append((at, size & 0x7FFFFFFF, bool(size & 0x80000000)))
+        at += size & 0x7FFFFFFF
+    expect(at, len(snapshot), "end of the text stream")
+    return blocks
+
+
+def test_packed(args, engine):
+    rng = random.Random(args.seed)
+    words = b"the of and to in is that it for was on are as with his they".split()
+    with Session(args, engine, ["--compress"]) as s:
+        b = s.start()
+        h = History(b"")
+        # the journal has to pass 4 MiB and the document before it is
+        # folded into a snapshot; incompressible bytes at the end leave the
+        # last block stored as is
+        for _ in range(5):
+            text = b" ".join(rng.choice(words) for _ in range(200000))
+            text += bytes(rng.randrange(256) for _ in range(70000))
+            edit(b, 0, len(h.text), text)
+            h.undo.append(h.text)
+            h.text = text
+        h.step(b, OP_UNDO)
+        s.stop()
+        data = os.path.join(s.work, "backend_data")
+        with open(os.path.join(data, "snapshot.cur")) as f:
+            path = os.path.join(data, "snapshot." + f.read().strip())
+        with open(path, "rb") as f:
+            snapshot = f.read()
+        blocks = text_blocks(snapshot)
+        expect((blocks[0][2], blocks[-1][2]), (False, True), "first block packed, last stored")
+        b = s.start()
+        h.verify(b, b"")
+        s.stop()
+        # one byte changed in a compressed block, then in a stored one:
+        # either way nothing of the document is loaded, edits are refused
+        # and the snapshot stays as it was
+        for at, size, _ in (blocks[0], blocks[-1]):
+            damaged = bytearray(snapshot)
+            damaged[at + size // 2] ^= 0x20
+            with open(path, "wb") as f:
+                f.write(damaged)
+            b = s.start()
+            expect(read_all(b), b"", "text of a damaged snapshot")
+            status, _ = b.request(OP_EDIT, struct.pack("<QQ", 0, 0) + b"x")
+            expect(status, 1, "edit over a damaged snapshot")
+            s.stop()
+            with open(path, "rb") as f:
+                expect(f.read() == damaged, True, "damaged snapshot left alone")
+        with open(path, "wb") as f:
+            f.write(snapshot)
+        b = s.start()
+        h.verify(b, b"")
+        s.stop()
+
+
+TESTS = {
+    "regex": test_regex,
+    "crash": test_crash,
+    "packed": test_packed,
+}
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    exe = os.path.join(here, "..", "backend.exe" if os.name == "nt" else "backend")
+    ap = argparse.ArgumentParser(description="Run the backend regression tests.")
+    ap.add_argument("--backend", default=exe, help="backend executable")
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--workdir", default=None, help="where the scratch directories go")
+    ap.add_argument("--keep", action="store_true", help="keep the scratch directories")
+    ap.add_argument("tests", nargs="*", help=f"tests to run (default: {' '.join(TESTS)})")
+    args = ap.parse_args()
+    args.backend = os.path.abspath(args.backend)
+
+    failed = 0
+    for name in args.tests or TESTS:
+        if name not in TESTS:
+            ap.error(f"unknown test {name}")
+        for engine in ENGINES:
+            try:
+                TESTS[name](args, engine)
+                print(f"{name} ({engine}): ok")
+            except (Failure, RuntimeError, OSError) as e:
+                print(f"{name} ({engine}): FAILED: {e}")
+                failed += 1
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()